@@ -5,9 +5,14 @@ varying lowp     vec4 var_color;
 varying mediump  vec4 var_light;
 
 uniform lowp sampler2D tex0;
+uniform lowp vec4 covered; // 1 for each quarter of the patch (x + 2 * z) that is drawn by the finer lod, see TERRAIN_PATCH_COVERAGE
 
 void main()
 {
+    vec2 quarter = step(vec2(0.5), var_texcoord.xy);
+    if (mix(mix(covered.x, covered.y, quarter.x), mix(covered.z, covered.w, quarter.x), quarter.y) > 0.5)
+        discard;
+
     // Pre-multiply alpha since all runtime textures already are
     vec4 color = texture2D(tex0, var_texcoord.xy);
 
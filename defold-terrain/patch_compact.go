@@ -0,0 +1,20 @@
+embedded_components {
+  id: "mesh"
+  type: "mesh"
+  data: "material: \"/defold-terrain/materials/terrain_compact.material\"\n"
+  "vertices: \"/defold-terrain/meshes/empty.buffer\"\n"
+  "textures: \"/assets/images/green.png\"\n"
+  "primitive_type: PRIMITIVE_TRIANGLES\n"
+  ""
+  position {
+    x: 0.0
+    y: 0.0
+    z: 0.0
+  }
+  rotation {
+    x: 0.0
+    y: 0.0
+    z: 0.0
+    w: 1.0
+  }
+}
@@ -0,0 +1,194 @@
+#include "compress.h"
+
+namespace dmTerrain
+{
+    static inline int32_t Predict(const uint16_t* row, const uint16_t* prev_row, uint32_t x)
+    {
+        if (!prev_row)
+            return x > 0 ? row[x-1] : 0;
+        if (x == 0)
+            return prev_row[0];
+        return (int32_t)row[x-1] + prev_row[x] - prev_row[x-1];
+    }
+
+    static inline uint32_t ZigZag(int32_t v)
+    {
+        return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+    }
+
+    static inline int32_t UnZigZag(uint32_t v)
+    {
+        return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+    }
+
+    // Each row is Rice coded with its own parameter k: the value v is stored as (v >> k) in unary, followed by the low k bits.
+    // Large values are escaped, and stored as raw 18 bit values
+    static const uint32_t RICE_K_BITS = 4;
+    static const uint32_t RICE_MAX_K = (1 << RICE_K_BITS) - 1;
+    static const uint32_t RICE_ESCAPE = 16;
+    static const uint32_t RAW_VALUE_BITS = 18;  // The prediction error is in [-131070, 131070]
+
+    struct BitWriter
+    {
+        uint8_t*    m_Cursor;
+        uint8_t*    m_End;
+        uint64_t    m_Bits;
+        uint32_t    m_NumBits;
+        bool        m_Overflow;
+    };
+
+    struct BitReader
+    {
+        const uint8_t*  m_Cursor;
+        const uint8_t*  m_End;
+        uint64_t        m_Bits;
+        uint32_t        m_NumBits;
+    };
+
+    // count <= 32
+    static inline void WriteBits(BitWriter* writer, uint32_t value, uint32_t count)
+    {
+        writer->m_Bits |= (uint64_t)value << writer->m_NumBits;
+        writer->m_NumBits += count;
+        while (writer->m_NumBits >= 8)
+        {
+            if (writer->m_Cursor == writer->m_End)
+            {
+                writer->m_Overflow = true;
+                return;
+            }
+            *writer->m_Cursor++ = (uint8_t)writer->m_Bits;
+            writer->m_Bits >>= 8;
+            writer->m_NumBits -= 8;
+        }
+    }
+
+    static inline void FlushBits(BitWriter* writer)
+    {
+        if (writer->m_NumBits > 0)
+            WriteBits(writer, 0, 8 - writer->m_NumBits);
+    }
+
+    // count <= 32
+    static inline bool ReadBits(BitReader* reader, uint32_t count, uint32_t* value)
+    {
+        while (reader->m_NumBits < count && reader->m_Cursor != reader->m_End)
+        {
+            reader->m_Bits |= (uint64_t)*reader->m_Cursor++ << reader->m_NumBits;
+            reader->m_NumBits += 8;
+        }
+        if (reader->m_NumBits < count)
+            return false;
+        *value = (uint32_t)(reader->m_Bits & ((1ull << count) - 1));
+        reader->m_Bits >>= count;
+        reader->m_NumBits -= count;
+        return true;
+    }
+
+    static inline uint32_t GetRiceBits(uint32_t v, uint32_t k)
+    {
+        uint32_t q = v >> k;
+        return q < RICE_ESCAPE ? q + 1 + k : RICE_ESCAPE + RAW_VALUE_BITS;
+    }
+
+    static inline void WriteRice(BitWriter* writer, uint32_t v, uint32_t k)
+    {
+        uint32_t q = v >> k;
+        if (q < RICE_ESCAPE)
+        {
+            WriteBits(writer, (1u << q) - 1, q + 1); // q ones and a zero
+            WriteBits(writer, v & ((1u << k) - 1), k);
+        }
+        else
+        {
+            WriteBits(writer, (1u << RICE_ESCAPE) - 1, RICE_ESCAPE);
+            WriteBits(writer, v, RAW_VALUE_BITS);
+        }
+    }
+
+    static inline bool ReadRice(BitReader* reader, uint32_t k, uint32_t* v)
+    {
+        uint32_t q = 0;
+        uint32_t bit;
+        while (q < RICE_ESCAPE)
+        {
+            if (!ReadBits(reader, 1, &bit))
+                return false;
+            if (!bit)
+                break;
+            ++q;
+        }
+        if (q == RICE_ESCAPE)
+            return ReadBits(reader, RAW_VALUE_BITS, v);
+
+        uint32_t low;
+        if (!ReadBits(reader, k, &low))
+            return false;
+        *v = (q << k) | low;
+        return true;
+    }
+
+    uint32_t GetMaxCompressedSize(uint32_t width, uint32_t height)
+    {
+        // At most an escaped value (34 bits) and a share of the row parameter per value
+        return width * height * 5 + 1;
+    }
+
+    uint32_t CompressHeights(const uint16_t* heights, uint32_t width, uint32_t height, uint8_t* out, uint32_t out_size)
+    {
+        BitWriter writer = { out, out + out_size, 0, 0, false };
+        const uint16_t* prev_row = 0;
+        for (uint32_t z = 0; z < height && !writer.m_Overflow; ++z)
+        {
+            const uint16_t* row = heights + z * width;
+
+            // Pick the parameter that gives the smallest row
+            uint32_t bits[RICE_MAX_K + 1] = {0};
+            for (uint32_t x = 0; x < width; ++x)
+            {
+                uint32_t v = ZigZag((int32_t)row[x] - Predict(row, prev_row, x));
+                for (uint32_t k = 0; k <= RICE_MAX_K; ++k)
+                    bits[k] += GetRiceBits(v, k);
+            }
+            uint32_t best_k = 0;
+            for (uint32_t k = 1; k <= RICE_MAX_K; ++k)
+            {
+                if (bits[k] < bits[best_k])
+                    best_k = k;
+            }
+
+            WriteBits(&writer, best_k, RICE_K_BITS);
+            for (uint32_t x = 0; x < width; ++x)
+                WriteRice(&writer, ZigZag((int32_t)row[x] - Predict(row, prev_row, x)), best_k);
+            prev_row = row;
+        }
+        FlushBits(&writer);
+        return writer.m_Overflow ? 0 : (uint32_t)(writer.m_Cursor - out);
+    }
+
+    bool DecompressHeights(const uint8_t* data, uint32_t data_size, uint32_t width, uint32_t height, uint16_t* heights)
+    {
+        BitReader reader = { data, data + data_size, 0, 0 };
+        const uint16_t* prev_row = 0;
+        for (uint32_t z = 0; z < height; ++z)
+        {
+            uint16_t* row = heights + z * width;
+            uint32_t k;
+            if (!ReadBits(&reader, RICE_K_BITS, &k))
+                return false;
+            for (uint32_t x = 0; x < width; ++x)
+            {
+                uint32_t v;
+                if (!ReadRice(&reader, k, &v))
+                    return false;
+                int32_t h = Predict(row, prev_row, x) + UnZigZag(v);
+                if (h < 0 || h > 65535)
+                    return false;
+                row[x] = (uint16_t)h;
+            }
+            prev_row = row;
+        }
+        // Only the padding of the last byte may be left
+        return reader.m_Cursor == reader.m_End && reader.m_NumBits < 8;
+    }
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+
+namespace dmTerrain
+{
+    // Lossless compression of 16 bit heightmaps.
+    // Each sample is predicted from its left, upper and upper left neighbors (left + up - upleft),
+    // and the zigzag encoded prediction error is Rice coded, with the parameter chosen per row.
+    // Smooth terrain ends up with a few bits per sample, and flat areas with one bit per sample
+
+    // The worst case size of the compressed data
+    uint32_t GetMaxCompressedSize(uint32_t width, uint32_t height);
+
+    // Returns the number of bytes written, or 0 if the output buffer is too small
+    uint32_t CompressHeights(const uint16_t* heights, uint32_t width, uint32_t height, uint8_t* out, uint32_t out_size);
+
+    // Returns false if the data is truncated or corrupt
+    bool DecompressHeights(const uint8_t* data, uint32_t data_size, uint32_t width, uint32_t height, uint16_t* heights);
+}
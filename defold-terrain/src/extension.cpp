@@ -1,6 +1,7 @@
 
 // include the Defold SDK
 #include <dmsdk/sdk.h>
+#include <math.h>
 #include "terrain.h"
 
 #define MODULE_NAME "terrain"
@@ -19,20 +20,56 @@ struct TerrainCommand
 {
     TerrainEvents m_Event;
     TerrainPatch* m_Patch;
+    uint32_t      m_Sequence; // The order the events were sent in, across the event queue and the main thread events
+};
+
+// The patch events from the terrain thread. A fixed size, lock free queue with a single producer (the terrain thread,
+// or the main thread when single threaded) and a single consumer (the main thread).
+// A full queue refuses the event, and the terrain thread sends it again later, instead of waiting for the Lua callbacks
+static const uint32_t EVENT_QUEUE_CAPACITY = 512; // Must be a power of two
+
+struct EventQueue
+{
+    TerrainCommand  m_Events[EVENT_QUEUE_CAPACITY];
+    int32_atomic_t  m_Head; // The number of events read. Only written by the consumer
+    int32_atomic_t  m_Tail; // The number of events written. Only written by the producer
 };
 
 struct ExtensionContext
 {
     dmScript::LuaCallbackInfo* m_Callback;
     HTerrain m_Terrain;
-    dmArray<TerrainCommand> m_Commands;
-    dmMutex::HMutex m_CommandsMutex;
+    EventQueue m_Events;                // TERRAIN_PATCH_SHOW and TERRAIN_PATCH_HIDE
+    dmArray<TerrainCommand> m_Commands; // The events sent from the main thread
+    int32_atomic_t m_Sequence;          // The sequence number of the next event
+    dmArray<TerrainPatch*> m_Hidden;    // The patches hidden so far in the current flush
+    bool m_BatchEvents;                 // Deliver the queued events in one TERRAIN_PATCH_BATCH callback per update
+    int  m_BatchRef;                    // The reused array of the batched events (Lua registry ref)
+    int  m_BatchEntriesRef;             // The reused tables of the batched events (Lua registry ref)
+    uint32_t m_BatchCount;              // The number of events in the array of the last batch
+    int  m_BufferCacheRef;              // The Lua buffer of each patch, by id (Lua registry ref)
 };
+
+// Sent instead of TERRAIN_PATCH_SHOW and TERRAIN_PATCH_HIDE when the events are batched
+static const int TERRAIN_PATCH_BATCH = 100;
 ExtensionContext* g_TerrainWorld = 0;
 
 // ****************************************************************************************************************************************************************
 // callback functions
 
+// Pushes the sub tiles of a patch that are inside the view frustum (TerrainPatch::m_VisibleTiles), as a table of
+// PATCH_NUM_TILES row masks: bit x of row z (1-based) is the tile x + z * PATCH_NUM_TILES.
+// A Lua number can't hold all 64 bits
+static void PushVisibleTiles(lua_State* L, uint64_t tiles)
+{
+    lua_createtable(L, PATCH_NUM_TILES, 0);
+    for (uint32_t z = 0; z < PATCH_NUM_TILES; ++z)
+    {
+        lua_pushinteger(L, (tiles >> (z * PATCH_NUM_TILES)) & ((1U << PATCH_NUM_TILES) - 1));
+        lua_rawseti(L, -2, z+1);
+    }
+}
+
 // Invoke the Lua callback
 static void Terrain_PatchCallback(TerrainEvents event, TerrainPatch* patch)
 {
@@ -73,39 +110,269 @@ static void Terrain_PatchCallback(TerrainEvents event, TerrainPatch* patch)
     dmScript::PushBuffer(L, luabuf);
     lua_setfield(L, -2, "buffer");
 
+    // Only for custom render paths, a mesh component can't use it (see InitParams::m_Indexed)
+    dmBuffer::HBuffer index_buffer = dmTerrain::GetIndexBuffer(world->m_Terrain);
+    if (index_buffer)
+    {
+        dmScript::LuaHBuffer luaindexbuf(index_buffer, dmScript::OWNER_C);
+        dmScript::PushBuffer(L, luaindexbuf);
+        lua_setfield(L, -2, "indices");
+    }
+
+    if (event == TERRAIN_PATCH_UPDATE)
+    {
+        uint32_t first_vertex, num_vertices;
+        dmTerrain::GetDirtyVertexRange(world->m_Terrain, patch, &first_vertex, &num_vertices);
+        lua_pushinteger(L, first_vertex);
+        lua_setfield(L, -2, "dirty_first_vertex");
+        lua_pushinteger(L, num_vertices);
+        lua_setfield(L, -2, "dirty_num_vertices");
+    }
+
+    if (event == TERRAIN_PATCH_COVERAGE)
+    {
+        lua_pushinteger(L, patch->m_CoveredQuarters);
+        lua_setfield(L, -2, "covered");
+    }
+
+    if (event == TERRAIN_PATCH_VISIBLE)
+    {
+        PushVisibleTiles(L, patch->m_VisibleTiles);
+        lua_setfield(L, -2, "visible_tiles");
+    }
+
     dmScript::PCall(L, 3, 0); // self + # user arguments
 
     dmScript::TeardownCallback(world->m_Callback);
 
+    if (event == TERRAIN_PATCH_UPDATE)
+        patch->m_Dirty = 0;
+
     dmAtomicStore32(&patch->m_LuaCallback, 1);
 }
 
+static void EventQueue_Init(EventQueue* queue)
+{
+    dmAtomicStore32(&queue->m_Head, 0);
+    dmAtomicStore32(&queue->m_Tail, 0);
+}
+
+// Called by the producer. Returns false if the queue is full
+static bool EventQueue_Push(EventQueue* queue, const TerrainCommand& cmd)
+{
+    uint32_t tail = (uint32_t)dmAtomicGet32(&queue->m_Tail);
+    uint32_t head = (uint32_t)dmAtomicGet32(&queue->m_Head);
+    if (tail - head == EVENT_QUEUE_CAPACITY)
+        return false;
+
+    queue->m_Events[tail & (EVENT_QUEUE_CAPACITY - 1)] = cmd;
+    dmAtomicAdd32(&queue->m_Tail, 1); // Publishes the event
+    return true;
+}
+
+// Fills the reused table at the top of the stack with the event.
+// The position vector and the patch buffers are only created the first time (the index buffer is set when the table is created)
+static void SetBatchEntry(lua_State* L, ExtensionContext* world, TerrainEvents event, TerrainPatch* patch)
+{
+    lua_pushnumber(L, (lua_Number)event);
+    lua_setfield(L, -2, "event");
+    lua_pushinteger(L, patch->m_Id);
+    lua_setfield(L, -2, "id");
+    lua_pushinteger(L, patch->m_XZ[0]);
+    lua_setfield(L, -2, "x");
+    lua_pushinteger(L, patch->m_XZ[1]);
+    lua_setfield(L, -2, "z");
+    lua_pushinteger(L, patch->m_Lod);
+    lua_setfield(L, -2, "lod");
+
+    lua_getfield(L, -1, "position");
+    Vector3* position = dmScript::ToVector3(L, -1);
+    lua_pop(L, 1);
+    if (position)
+    {
+        *position = patch->m_Position;
+    }
+    else
+    {
+        dmScript::PushVector3(L, patch->m_Position);
+        lua_setfield(L, -2, "position");
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, world->m_BufferCacheRef);
+    lua_rawgeti(L, -1, patch->m_Id + 1);
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        dmScript::LuaHBuffer luabuf(patch->m_Buffer, dmScript::OWNER_C);
+        dmScript::PushBuffer(L, luabuf);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, patch->m_Id + 1);
+    }
+    lua_setfield(L, -3, "buffer");
+    lua_pop(L, 1); // pop the cache
+}
+
+// Invokes the Lua callback once for all the queued events: callback(self, TERRAIN_PATCH_BATCH, events),
+// where events[1..events.count] are tables with the same fields as the single events, plus "event".
+// The array, its tables and their position vectors are reused by the next batch, so the script must copy what it keeps.
+// The array has no entries after events.count.
+// The slots are freed after the callback, since the patches are kept until the Lua callback has been invoked
+static void Terrain_BatchCallback(ExtensionContext* world)
+{
+    EventQueue* queue = &world->m_Events;
+    uint32_t head = (uint32_t)dmAtomicGet32(&queue->m_Head);
+    uint32_t tail = (uint32_t)dmAtomicGet32(&queue->m_Tail);
+    if (head == tail)
+        return;
+
+    if (!dmScript::IsCallbackValid(world->m_Callback))
+    {
+        dmLogWarning("No callback function set!");
+        return;
+    }
+
+    if (!dmScript::SetupCallback(world->m_Callback))
+    {
+        return;
+    }
+    lua_State* L = dmScript::GetCallbackLuaContext(world->m_Callback);
+
+    lua_pushnumber(L, (lua_Number)TERRAIN_PATCH_BATCH);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, world->m_BatchRef);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, world->m_BatchEntriesRef);
+    uint32_t count = tail - head;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        lua_rawgeti(L, -1, i + 1);
+        if (lua_isnil(L, -1))
+        {
+            lua_pop(L, 1);
+            lua_createtable(L, 0, 9);
+            lua_getfield(L, -3, "indices");
+            lua_setfield(L, -2, "indices");
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -3, i + 1);
+        }
+
+        const TerrainCommand& cmd = queue->m_Events[(head + i) & (EVENT_QUEUE_CAPACITY - 1)];
+        SetBatchEntry(L, world, cmd.m_Event, cmd.m_Patch);
+        lua_rawseti(L, -3, i + 1);
+
+        if (cmd.m_Event == TERRAIN_PATCH_HIDE)
+        {
+            if (world->m_Hidden.Full())
+                world->m_Hidden.OffsetCapacity(32);
+            world->m_Hidden.Push(cmd.m_Patch);
+        }
+    }
+    lua_pop(L, 1); // pop the entries
+
+    // The tables of a larger previous batch stay in the entries, for the next batch
+    for (uint32_t i = count; i < world->m_BatchCount; ++i)
+    {
+        lua_pushnil(L);
+        lua_rawseti(L, -2, i + 1);
+    }
+    world->m_BatchCount = count;
+
+    lua_pushinteger(L, count);
+    lua_setfield(L, -2, "count");
+
+    dmScript::PCall(L, 3, 0); // self + # user arguments
+
+    dmScript::TeardownCallback(world->m_Callback);
+
+    for (uint32_t i = 0; i < count; ++i)
+        dmAtomicStore32(&queue->m_Events[(head + i) & (EVENT_QUEUE_CAPACITY - 1)].m_Patch->m_LuaCallback, 1);
+    dmAtomicAdd32(&queue->m_Head, (int32_t)count); // Frees the slots
+}
+
 // Callbacks from the terrain system
-static void Terrain_Callback(TerrainEvents event, TerrainPatch* patch)
+static bool Terrain_Callback(TerrainEvents event, TerrainPatch* patch)
 {
     ExtensionContext* world = g_TerrainWorld;
     TerrainCommand cmd;
     cmd.m_Event = event;
     cmd.m_Patch = patch;
+    cmd.m_Sequence = (uint32_t)dmAtomicIncrement32(&world->m_Sequence);
+
+    if (event == TERRAIN_PATCH_SHOW || event == TERRAIN_PATCH_HIDE)
+        return EventQueue_Push(&world->m_Events, cmd);
 
-    DM_MUTEX_SCOPED_LOCK(world->m_CommandsMutex);
+    // The other events are sent from the main thread
     if (world->m_Commands.Full())
-        world->m_Commands.OffsetCapacity(9*2);
+        world->m_Commands.OffsetCapacity(32);
     world->m_Commands.Push(cmd);
+    return true;
 }
 
+// The events from the main thread are only sent for shown patches. If the patch was hidden before the event
+// is delivered, the event would refer to a patch that the script no longer knows of, and that may be regenerating
+static bool IsHiddenPatch(ExtensionContext* world, TerrainPatch* patch)
+{
+    if (dmAtomicGet32(&patch->m_State) != PS_LOADED)
+        return true;
+    for (uint32_t i = 0; i < world->m_Hidden.Size(); ++i)
+    {
+        if (world->m_Hidden[i] == patch)
+            return true;
+    }
+    return false;
+}
 
-static void FlushCommandQueue(ExtensionContext* world, dmArray<TerrainCommand>& commands)
+// Invokes the Lua callbacks without holding any lock, so that the terrain thread can keep queueing events meanwhile.
+// The events of the queue and the main thread events are delivered in the order they were sent.
+// When batched, the queued events are delivered first, followed by the main thread events.
+// Main thread events of hidden patches are dropped
+static void FlushCommandQueue(ExtensionContext* world)
 {
-    DM_MUTEX_SCOPED_LOCK(world->m_CommandsMutex);
+    world->m_Hidden.SetSize(0);
+
+    EventQueue* queue = &world->m_Events;
+    uint32_t head = (uint32_t)dmAtomicGet32(&queue->m_Head);
+    uint32_t tail = (uint32_t)dmAtomicGet32(&queue->m_Tail);
+    if (world->m_BatchEvents)
+    {
+        Terrain_BatchCallback(world);
+        tail = head; // The events queued meanwhile are part of the next batch
+    }
 
-    uint32_t size = commands.Size();
-    for (uint32_t i = 0; i < size; ++i)
+    // The Lua callbacks may send more events (e.g. terrain.edit())
+    uint32_t i = 0;
+    while (head != tail || i < world->m_Commands.Size())
     {
-        TerrainCommand& cmd = commands[i];
+        bool from_queue = head != tail;
+        if (from_queue && i < world->m_Commands.Size())
+            from_queue = (int32_t)(queue->m_Events[head & (EVENT_QUEUE_CAPACITY - 1)].m_Sequence - world->m_Commands[i].m_Sequence) < 0;
+
+        TerrainCommand cmd;
+        if (from_queue)
+        {
+            cmd = queue->m_Events[head & (EVENT_QUEUE_CAPACITY - 1)];
+            ++head;
+            dmAtomicAdd32(&queue->m_Head, 1); // Frees the slot
+
+            if (cmd.m_Event == TERRAIN_PATCH_HIDE)
+            {
+                if (world->m_Hidden.Full())
+                    world->m_Hidden.OffsetCapacity(32);
+                world->m_Hidden.Push(cmd.m_Patch);
+            }
+        }
+        else
+        {
+            cmd = world->m_Commands[i++];
+            if (IsHiddenPatch(world, cmd.m_Patch))
+            {
+                if (cmd.m_Event == TERRAIN_PATCH_UPDATE)
+                    cmd.m_Patch->m_Dirty = 0; // The edit is lost with the patch, so the next edit must be sent
+                continue;
+            }
+        }
         Terrain_PatchCallback(cmd.m_Event, cmd.m_Patch);
     }
-    commands.SetSize(0);
+    world->m_Commands.SetSize(0);
 }
 
 
@@ -122,6 +389,24 @@ static int Terrain_Init(lua_State* L)
     dmTerrain::InitParams init_params;
     init_params.m_Callback = Terrain_Callback;
     init_params.m_BasePatchSize = 512;
+    init_params.m_Indexed = false;
+    init_params.m_CompactVertices = false;
+    init_params.m_NumWorkers = 2;
+#if defined(DM_PLATFORM_HTML5)
+    init_params.m_SingleThreaded = true;
+#else
+    init_params.m_SingleThreaded = false;
+#endif
+    init_params.m_FrameBudget = 0.0f;
+    init_params.m_NumLodLevels = 1;
+    init_params.m_RingRadius = 1;
+    init_params.m_CircularRing = false;
+    init_params.m_NumCachedPatches = 0;
+    init_params.m_UnloadMargin = 32.0f;
+    init_params.m_CachePath = 0;
+    init_params.m_CacheMaxSize = 256 * 1024 * 1024;
+    init_params.m_HeightmapPath = 0;
+    world->m_BatchEvents = false;
 
     if (lua_istable(L, 2))
     {
@@ -140,11 +425,105 @@ static int Terrain_Init(lua_State* L)
             init_params.m_Proj = *proj;
         lua_pop(L, 1);
 
+        lua_getfield(L, -1, "indexed");
+        if (lua_isboolean(L, -1))
+            init_params.m_Indexed = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, -1, "compact_vertices");
+        if (lua_isboolean(L, -1))
+            init_params.m_CompactVertices = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, -1, "num_workers");
+        if (lua_isnumber(L, -1))
+            init_params.m_NumWorkers = (int)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, -1, "single_threaded");
+        if (lua_isboolean(L, -1))
+            init_params.m_SingleThreaded = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, -1, "frame_budget");
+        if (lua_isnumber(L, -1))
+            init_params.m_FrameBudget = (float)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, -1, "num_lods");
+        if (lua_isnumber(L, -1))
+            init_params.m_NumLodLevels = (int)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, -1, "ring_radius");
+        if (lua_isnumber(L, -1))
+            init_params.m_RingRadius = (int)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, -1, "circular");
+        if (lua_isboolean(L, -1))
+            init_params.m_CircularRing = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, -1, "unload_margin");
+        if (lua_isnumber(L, -1))
+            init_params.m_UnloadMargin = (float)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, -1, "num_cached_patches");
+        if (lua_isnumber(L, -1))
+            init_params.m_NumCachedPatches = (int)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        // The string is kept alive by the table, until after the terrain is created
+        lua_getfield(L, -1, "cache_path");
+        if (lua_isstring(L, -1))
+            init_params.m_CachePath = lua_tostring(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, -1, "cache_size");
+        if (lua_isnumber(L, -1))
+            init_params.m_CacheMaxSize = (uint64_t)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, -1, "heightmap_path");
+        if (lua_isstring(L, -1))
+            init_params.m_HeightmapPath = lua_tostring(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, -1, "batch_events");
+        if (lua_isboolean(L, -1))
+            world->m_BatchEvents = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
         lua_pop(L, 1); // pop the table
     }
 
     world->m_Terrain = dmTerrain::Create(init_params);
 
+    world->m_BatchRef = LUA_NOREF;
+    world->m_BatchEntriesRef = LUA_NOREF;
+    world->m_BufferCacheRef = LUA_NOREF;
+    world->m_BatchCount = 0;
+    if (world->m_BatchEvents)
+    {
+        lua_newtable(L);
+        dmBuffer::HBuffer index_buffer = dmTerrain::GetIndexBuffer(world->m_Terrain);
+        if (index_buffer)
+        {
+            dmScript::LuaHBuffer luaindexbuf(index_buffer, dmScript::OWNER_C);
+            dmScript::PushBuffer(L, luaindexbuf);
+            lua_setfield(L, -2, "indices");
+        }
+        world->m_BatchRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        lua_newtable(L);
+        world->m_BatchEntriesRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        lua_newtable(L);
+        world->m_BufferCacheRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
     printf("terrain.init()\n");
 
     return 0;
@@ -157,6 +536,19 @@ static int Terrain_Exit(lua_State* L)
 
     dmTerrain::Destroy(world->m_Terrain);
 
+    // The patches of the undelivered events are gone
+    EventQueue_Init(&world->m_Events);
+    world->m_Commands.SetSize(0);
+    world->m_Hidden.SetSize(0);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, world->m_BatchRef);
+    luaL_unref(L, LUA_REGISTRYINDEX, world->m_BatchEntriesRef);
+    luaL_unref(L, LUA_REGISTRYINDEX, world->m_BufferCacheRef);
+    world->m_BatchRef = LUA_NOREF;
+    world->m_BatchEntriesRef = LUA_NOREF;
+    world->m_BufferCacheRef = LUA_NOREF;
+    world->m_BatchCount = 0;
+
     dmScript::DestroyCallback(world->m_Callback);
     world->m_Callback = 0;
 
@@ -169,7 +561,7 @@ static int Terrain_Update(lua_State* L)
     ExtensionContext* world = g_TerrainWorld;
 
     dmTerrain::UpdateParams update_params;
-    update_params.m_Dt = (float)luaL_checknumber(L, 1); // not sure if needed. perhaps use for time slicing?
+    update_params.m_Dt = (float)luaL_checknumber(L, 1); // The time budget when single threaded
 
     if (lua_istable(L, 2))
     {
@@ -193,7 +585,7 @@ static int Terrain_Update(lua_State* L)
 
     dmTerrain::Update(world->m_Terrain, update_params);
 
-    FlushCommandQueue(world, world->m_Commands);
+    FlushCommandQueue(world);
 
     return 0;
 }
@@ -202,18 +594,299 @@ static int Terrain_Reload(lua_State* L)
 {
     DM_LUA_STACK_CHECK(L, 0);
 
-    if (!lua_islightuserdata(L, 1))
-        return DM_LUA_ERROR("Argument must be the terrain patch pointer");
-
     int id = luaL_checkinteger(L, 1);
     printf("reload patch: %d\n", id);
 
     ExtensionContext* world = g_TerrainWorld;
-    //dmTerrain::PatchUnload(world->m_Terrain, patch);
+    dmTerrain::ReloadPatch(world->m_Terrain, (uint32_t)id);
 
     return 0;
 }
 
+// terrain.edit(mode, position, radius, strength, [options]) -> number of changed patches
+// Options: falloff (0-1), stamp (a table of size*size heights)
+static int Terrain_Edit(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+    ExtensionContext* world = g_TerrainWorld;
+
+    dmTerrain::Brush brush;
+    int mode = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, mode >= dmTerrain::BRUSH_RAISE && mode <= dmTerrain::BRUSH_STAMP, 1, "invalid brush mode");
+    brush.m_Mode = (dmTerrain::BrushMode)mode;
+    brush.m_Position = *dmScript::CheckVector3(L, 2);
+    brush.m_Radius = (float)luaL_checknumber(L, 3);
+    brush.m_Strength = (float)luaL_checknumber(L, 4);
+    brush.m_Falloff = 0.0f;
+    brush.m_Stamp = 0;
+    brush.m_StampSize = 0;
+
+    float* stamp = 0;
+    if (lua_istable(L, 5))
+    {
+        lua_getfield(L, 5, "falloff");
+        if (lua_isnumber(L, -1))
+            brush.m_Falloff = (float)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 5, "stamp");
+        if (lua_istable(L, -1))
+        {
+            uint32_t count = (uint32_t)lua_objlen(L, -1);
+            uint32_t size = (uint32_t)(sqrtf((float)count) + 0.5f);
+            if (size * size != count)
+            {
+                lua_pop(L, 1);
+                return DM_LUA_ERROR("The stamp must be square: %u values", count);
+            }
+
+            stamp = new float[count];
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                lua_rawgeti(L, -1, i+1);
+                stamp[i] = (float)lua_tonumber(L, -1);
+                lua_pop(L, 1);
+            }
+            brush.m_Stamp = stamp;
+            brush.m_StampSize = size;
+        }
+        lua_pop(L, 1);
+    }
+
+    uint32_t num_changed = dmTerrain::Edit(world->m_Terrain, brush);
+    delete[] stamp;
+
+    lua_pushinteger(L, num_changed);
+    return 1;
+}
+
+// terrain.get_visible_patches() -> {id, ...}, {visible_tiles, ...}
+// The ids of the patches inside the view frustum, and their sub tiles inside the view frustum (see PushVisibleTiles())
+static int Terrain_GetVisiblePatches(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 2);
+    ExtensionContext* world = g_TerrainWorld;
+
+    uint32_t count = dmTerrain::GetVisiblePatches(world->m_Terrain, 0, 0);
+    TerrainPatch** patches = new TerrainPatch*[count > 0 ? count : 1];
+    dmTerrain::GetVisiblePatches(world->m_Terrain, patches, count);
+
+    lua_createtable(L, count, 0);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        lua_pushinteger(L, patches[i]->m_Id);
+        lua_rawseti(L, -2, i+1);
+    }
+    lua_createtable(L, count, 0);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        PushVisibleTiles(L, patches[i]->m_VisibleTiles);
+        lua_rawseti(L, -2, i+1);
+    }
+
+    delete[] patches;
+    return 2;
+}
+
+// terrain.get_height(x, z) -> height, normal
+static int Terrain_GetHeight(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 2);
+    ExtensionContext* world = g_TerrainWorld;
+
+    float x = (float)luaL_checknumber(L, 1);
+    float z = (float)luaL_checknumber(L, 2);
+
+    Vector3 normal;
+    float height = dmTerrain::GetHeightAndNormal(world->m_Terrain, x, z, &normal);
+    lua_pushnumber(L, height);
+    dmScript::PushVector3(L, normal);
+    return 2;
+}
+
+// terrain.get_height_scale() -> the world height of the max height value
+static int Terrain_GetHeightScale(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+    ExtensionContext* world = g_TerrainWorld;
+    lua_pushnumber(L, dmTerrain::GetHeightScale(world->m_Terrain));
+    return 1;
+}
+
+// Raises a Lua error if an entry of the array isn't a vector3. Called before allocating, since the error doesn't return
+static void CheckVector3Array(lua_State* L, int index, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        lua_rawgeti(L, index, i+1);
+        dmScript::CheckVector3(L, -1);
+        lua_pop(L, 1);
+    }
+}
+
+// terrain.get_heights({vmath.vector3, ...}) -> {height, ...}, {normal, ...}
+// The y component of the positions is ignored
+static int Terrain_GetHeights(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 2);
+    ExtensionContext* world = g_TerrainWorld;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    uint32_t count = (uint32_t)lua_objlen(L, 1);
+    CheckVector3Array(L, 1, count);
+
+    float* x = new float[count * 3 + 1];
+    float* z = x + count;
+    float* heights = z + count;
+    Vector3* normals = new Vector3[count + 1];
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        lua_rawgeti(L, 1, i+1);
+        Vector3* pos = dmScript::ToVector3(L, -1);
+        x[i] = pos->getX();
+        z[i] = pos->getZ();
+        lua_pop(L, 1);
+    }
+
+    dmTerrain::GetHeights(world->m_Terrain, count, x, z, heights, normals);
+
+    lua_createtable(L, count, 0);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        lua_pushnumber(L, heights[i]);
+        lua_rawseti(L, -2, i+1);
+    }
+    lua_createtable(L, count, 0);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        dmScript::PushVector3(L, normals[i]);
+        lua_rawseti(L, -2, i+1);
+    }
+
+    delete[] x;
+    delete[] normals;
+    return 2;
+}
+
+static void PushRaycastHit(lua_State* L, const dmTerrain::RaycastHit& hit, float length)
+{
+    lua_newtable(L);
+    dmScript::PushVector3(L, hit.m_Position);
+    lua_setfield(L, -2, "position");
+    dmScript::PushVector3(L, hit.m_Normal);
+    lua_setfield(L, -2, "normal");
+    lua_pushnumber(L, hit.m_Distance / length);
+    lua_setfield(L, -2, "fraction");
+    lua_pushinteger(L, hit.m_Patch->m_Id);
+    lua_setfield(L, -2, "id");
+}
+
+// terrain.raycast(from, to) -> {position, normal, fraction, id} or nil
+static int Terrain_Raycast(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+    ExtensionContext* world = g_TerrainWorld;
+
+    Vector3 from = *dmScript::CheckVector3(L, 1);
+    Vector3 to = *dmScript::CheckVector3(L, 2);
+    float length = dmVMath::length(to - from);
+
+    dmTerrain::RaycastHit hit;
+    if (length > 0.0f && dmTerrain::Raycast(world->m_Terrain, from, to - from, length, &hit))
+        PushRaycastHit(L, hit, length);
+    else
+        lua_pushnil(L);
+    return 1;
+}
+
+// terrain.raycast_batch({from, ...}, {to, ...}) -> {result, ...}
+// Each result is a table like the one from terrain.raycast(), or false if there was no hit
+static int Terrain_RaycastBatch(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+    ExtensionContext* world = g_TerrainWorld;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    uint32_t count = (uint32_t)lua_objlen(L, 1);
+    if (count != (uint32_t)lua_objlen(L, 2))
+        return DM_LUA_ERROR("The number of start and end points differ: %u != %u", count, (uint32_t)lua_objlen(L, 2));
+    CheckVector3Array(L, 1, count);
+    CheckVector3Array(L, 2, count);
+
+    Vector3* origins = new Vector3[count * 2 + 1];
+    Vector3* directions = origins + count;
+    float* lengths = new float[count + 1];
+    dmTerrain::RaycastHit* hits = new dmTerrain::RaycastHit[count + 1];
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        lua_rawgeti(L, 1, i+1);
+        origins[i] = *dmScript::ToVector3(L, -1);
+        lua_pop(L, 1);
+        lua_rawgeti(L, 2, i+1);
+        directions[i] = *dmScript::ToVector3(L, -1) - origins[i];
+        lua_pop(L, 1);
+        lengths[i] = dmVMath::length(directions[i]);
+    }
+
+    dmTerrain::Raycast(world->m_Terrain, count, origins, directions, lengths, hits);
+
+    lua_createtable(L, count, 0);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (hits[i].m_Hit)
+            PushRaycastHit(L, hits[i], lengths[i]);
+        else
+            lua_pushboolean(L, 0);
+        lua_rawseti(L, -2, i+1);
+    }
+
+    delete[] origins;
+    delete[] lengths;
+    delete[] hits;
+    return 1;
+}
+
+static int Terrain_GetMemoryStats(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+    ExtensionContext* world = g_TerrainWorld;
+
+    dmTerrain::MemoryStats stats;
+    dmTerrain::GetMemoryStats(world->m_Terrain, &stats);
+
+    lua_newtable(L);
+    lua_pushnumber(L, (lua_Number)stats.m_HeightmapBytes);
+    lua_setfield(L, -2, "heightmap_bytes");
+    lua_pushnumber(L, (lua_Number)stats.m_VertexBufferBytes);
+    lua_setfield(L, -2, "vertex_buffer_bytes");
+    lua_pushnumber(L, (lua_Number)stats.m_IndexBufferBytes);
+    lua_setfield(L, -2, "index_buffer_bytes");
+    lua_pushnumber(L, (lua_Number)stats.m_ScratchBytes);
+    lua_setfield(L, -2, "scratch_bytes");
+    lua_pushnumber(L, (lua_Number)stats.m_HeightPyramidBytes);
+    lua_setfield(L, -2, "height_pyramid_bytes");
+    lua_pushinteger(L, stats.m_NumPatches);
+    lua_setfield(L, -2, "num_patches");
+    lua_pushinteger(L, stats.m_NumPatchesInUse);
+    lua_setfield(L, -2, "num_patches_in_use");
+    lua_pushinteger(L, stats.m_MaxPatchesInUse);
+    lua_setfield(L, -2, "max_patches_in_use");
+    lua_pushinteger(L, stats.m_NumPatchesCached);
+    lua_setfield(L, -2, "num_patches_cached");
+    lua_pushinteger(L, stats.m_NumPatchesRead);
+    lua_setfield(L, -2, "num_patches_read");
+    lua_pushinteger(L, stats.m_NumPatchesBuilt);
+    lua_setfield(L, -2, "num_patches_built");
+    lua_pushnumber(L, stats.m_NumPatchesRead ? stats.m_ReadTime / 1000.0 / stats.m_NumPatchesRead : 0.0);
+    lua_setfield(L, -2, "read_ms_per_patch");
+    lua_pushnumber(L, stats.m_NumPatchesBuilt ? stats.m_BuildTime / 1000.0 / stats.m_NumPatchesBuilt : 0.0);
+    lua_setfield(L, -2, "build_ms_per_patch");
+    return 1;
+}
+
 static int Terrain_DebugPrint(lua_State* L)
 {
     DM_LUA_STACK_CHECK(L, 0);
@@ -228,6 +901,14 @@ static const luaL_reg Module_methods[] =
     {"init", Terrain_Init},
     {"update", Terrain_Update},
     {"reload_patch", Terrain_Reload},
+    {"edit", Terrain_Edit},
+    {"get_visible_patches", Terrain_GetVisiblePatches},
+    {"get_memory_stats", Terrain_GetMemoryStats},
+    {"get_height", Terrain_GetHeight},
+    {"get_height_scale", Terrain_GetHeightScale},
+    {"get_heights", Terrain_GetHeights},
+    {"raycast", Terrain_Raycast},
+    {"raycast_batch", Terrain_RaycastBatch},
     {"debug_print", Terrain_DebugPrint},
     {"exit", Terrain_Exit},
     {0, 0}
@@ -246,6 +927,16 @@ static void LuaInit(lua_State* L)
 
      SETCONSTANT(TERRAIN_PATCH_HIDE); // a patch is about to be moved
      SETCONSTANT(TERRAIN_PATCH_SHOW); // a patch is about to be shown
+     SETCONSTANT(TERRAIN_PATCH_INVISIBLE); // a shown patch is outside of the view frustum
+     SETCONSTANT(TERRAIN_PATCH_VISIBLE); // a shown patch is inside the view frustum, see visible_tiles
+     SETCONSTANT(TERRAIN_PATCH_UPDATE); // a loaded patch was edited
+     SETCONSTANT(TERRAIN_PATCH_COVERAGE); // the quarters of a shown patch that are drawn by the finer lod changed
+     SETCONSTANT(TERRAIN_PATCH_BATCH); // the shown and hidden patches of this update (if batch_events is set)
+
+     SETCONSTANT(BRUSH_RAISE);
+     SETCONSTANT(BRUSH_LOWER);
+     SETCONSTANT(BRUSH_FLATTEN);
+     SETCONSTANT(BRUSH_STAMP);
 
 #undef SETCONSTANT
 
@@ -262,7 +953,15 @@ static dmExtension::Result AppInitialize(dmExtension::AppParams* params)
 static dmExtension::Result Initialize(dmExtension::Params* params)
 {
     g_TerrainWorld = new ExtensionContext;
-    g_TerrainWorld->m_CommandsMutex = dmMutex::New();
+    EventQueue_Init(&g_TerrainWorld->m_Events);
+    g_TerrainWorld->m_Commands.SetCapacity(64);
+    g_TerrainWorld->m_Hidden.SetCapacity(64);
+    dmAtomicStore32(&g_TerrainWorld->m_Sequence, 0);
+    g_TerrainWorld->m_BatchEvents = false;
+    g_TerrainWorld->m_BatchRef = LUA_NOREF;
+    g_TerrainWorld->m_BatchEntriesRef = LUA_NOREF;
+    g_TerrainWorld->m_BufferCacheRef = LUA_NOREF;
+    g_TerrainWorld->m_BatchCount = 0;
     LuaInit(params->m_L);
     printf("Registered %s Extension\n", MODULE_NAME);
     return dmExtension::RESULT_OK;
@@ -275,7 +974,6 @@ static dmExtension::Result AppFinalize(dmExtension::AppParams* params)
 
 static dmExtension::Result Finalize(dmExtension::Params* params)
 {
-    dmMutex::Delete(g_TerrainWorld->m_CommandsMutex);
     delete g_TerrainWorld;
     g_TerrainWorld = 0;
     return dmExtension::RESULT_OK;
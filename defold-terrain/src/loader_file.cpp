@@ -1,20 +1,38 @@
 #include <dmsdk/dlib/log.h>
 #include "terrain_private.h"
+#include "loader_file.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <math.h>
+
+#if defined(_WIN32)
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
 
 namespace dmTerrain
 {
     struct TerrainFileLoader
     {
-        FILE* m_File;
-        uint32_t m_ImageSize;
-        uint32_t m_BytesPerPixel; // 2 for 16 bit height data
+        const uint8_t*  m_Data;         // The mapped file
+        uint64_t        m_DataSize;
+        uint32_t        m_ImageSize;
+        uint32_t        m_BytesPerPixel; // 2 for 16 bit height data
+#if defined(_WIN32)
+        HANDLE          m_File;
+        HANDLE          m_Mapping;
+#else
+        int             m_File;
+#endif
     };
 
     // Assumes raw format, square size, no header
-    static bool GuessSize(const char* path, int filesize, uint32_t* bpp, uint32_t* size)
+    static bool GuessSize(const char* path, uint64_t filesize, uint32_t* bpp, uint32_t* size)
     {
         const char* end = strrchr(path, '.');
 
@@ -29,75 +47,185 @@ namespace dmTerrain
 
         if (*bpp != 0)
         {
-            *size = sqrt(filesize / *bpp);
+            *size = (uint32_t)sqrt((double)(filesize / *bpp));
         } else
         {
-            for (int i = 1; i <= 4; ++i)
+            static const uint32_t bpps[] = {1, 2, 4};
+            for (int i = 0; i < 3; ++i)
             {
-                *bpp = i;
-                *size = sqrt(filesize / i);
-                if ( (*size * *size * *bpp) == filesize )
+                *bpp = bpps[i];
+                *size = (uint32_t)sqrt((double)(filesize / *bpp));
+                if ( ((uint64_t)*size * *size * *bpp) == filesize )
                 {
                     break;
                 }
-
             }
         }
 
-        uint32_t total_size = (*bpp * *size * *size);
-        //dmLogWarning("MAWE: bpp: %u  size: %u  -> total size: %u   filesize: %u", *bpp, *size, total_size, filesize);
+        uint64_t total_size = ((uint64_t)*bpp * *size * *size);
         return filesize == total_size;
     }
 
+    static bool MapFile(TerrainFileLoader* loader, const char* path)
+    {
+#if defined(_WIN32)
+        loader->m_Mapping = 0;
+        loader->m_File = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if (loader->m_File == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(loader->m_File, &size))
+            return false;
+        loader->m_DataSize = (uint64_t)size.QuadPart;
+
+        loader->m_Mapping = CreateFileMappingA(loader->m_File, 0, PAGE_READONLY, 0, 0, 0);
+        if (!loader->m_Mapping)
+            return false;
+        loader->m_Data = (const uint8_t*)MapViewOfFile(loader->m_Mapping, FILE_MAP_READ, 0, 0, 0);
+        return loader->m_Data != 0;
+#else
+        loader->m_File = open(path, O_RDONLY);
+        if (loader->m_File < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(loader->m_File, &st) != 0)
+            return false;
+        loader->m_DataSize = (uint64_t)st.st_size;
+        if ((uint64_t)(size_t)loader->m_DataSize != loader->m_DataSize)
+            return false; // Too large for the address space
+
+        void* data = mmap(0, (size_t)loader->m_DataSize, PROT_READ, MAP_SHARED, loader->m_File, 0);
+        if (data == MAP_FAILED)
+            return false;
+        loader->m_Data = (const uint8_t*)data;
+        return true;
+#endif
+    }
+
+    static void UnmapFile(TerrainFileLoader* loader)
+    {
+#if defined(_WIN32)
+        if (loader->m_Data)
+            UnmapViewOfFile(loader->m_Data);
+        if (loader->m_Mapping)
+            CloseHandle(loader->m_Mapping);
+        if (loader->m_File != INVALID_HANDLE_VALUE)
+            CloseHandle(loader->m_File);
+#else
+        if (loader->m_Data)
+            munmap((void*)loader->m_Data, (size_t)loader->m_DataSize);
+        if (loader->m_File >= 0)
+            close(loader->m_File);
+#endif
+    }
+
     void* RawFileLoader_Init(const char* path)
     {
-        FILE* f = fopen(path, "rb");
-        if (!f)
+        TerrainFileLoader* loader = new TerrainFileLoader;
+        memset(loader, 0, sizeof(*loader));
+        if (!MapFile(loader, path))
         {
             dmLogError("Failed to open '%s' for reading.", path);
+            UnmapFile(loader);
+            delete loader;
             return 0;
         }
 
-        // guess size
-        fseek(f, 0, SEEK_END);
-        uint32_t filesize = (uint32_t)ftell(f);
-
         uint32_t bpp;
         uint32_t size;
-        if (!GuessSize(path, filesize, &bpp, &size)) {
-            dmLogError("Failed to guess image size of '%s' from file size %u", path, filesize);
-            fclose(f);
+        if (!GuessSize(path, loader->m_DataSize, &bpp, &size)) {
+            dmLogError("Failed to guess image size of '%s' from file size %llu", path, (unsigned long long)loader->m_DataSize);
+            UnmapFile(loader);
+            delete loader;
             return 0;
         }
 
-        fseek(f, 0, SEEK_SET);
-
-        dmLogInfo("Loaded '%s': bpp: %u  size: %u", path, bpp, size);
-
-        TerrainFileLoader* loader = new TerrainFileLoader;
-        loader->m_File = f;
         loader->m_BytesPerPixel = bpp;
         loader->m_ImageSize = size;
 
+        dmLogInfo("Loaded '%s': bpp: %u  size: %u", path, bpp, size);
         return loader;
     }
 
     void RawFileLoader_Exit(void* ctx)
     {
         if (ctx) {
-            assert(ctx);
             TerrainFileLoader* loader = (TerrainFileLoader*)ctx;
-            fclose(loader->m_File);
+            UnmapFile(loader);
             delete loader;
         }
     }
 
-    void RawFileLoader_Load(void* ctx, struct TerrainPatch* patch)
+    // The pixels are read as they are in the file (i.e. little endian). The 32 bit format is floats in [0,1]
+    static inline uint16_t GetPixel(const TerrainFileLoader* loader, const uint8_t* row, uint32_t x)
+    {
+        switch(loader->m_BytesPerPixel)
+        {
+        case 1: return row[x] * 257;
+        case 2:
+            {
+                uint16_t v;
+                memcpy(&v, row + x * 2, sizeof(v));
+                return v;
+            }
+        default:
+            {
+                float v;
+                memcpy(&v, row + x * 4, sizeof(v));
+                v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+                return (uint16_t)(v * 65535.0f + 0.5f);
+            }
+        }
+    }
+
+    static inline uint32_t ClampPixelCoord(const TerrainFileLoader* loader, int64_t v)
+    {
+        return v < 0 ? 0 : (v >= loader->m_ImageSize ? loader->m_ImageSize - 1 : (uint32_t)v);
+    }
+
+    static inline const uint8_t* GetRow(const TerrainFileLoader* loader, uint32_t z)
+    {
+        return loader->m_Data + (uint64_t)z * loader->m_ImageSize * loader->m_BytesPerPixel;
+    }
+
+    bool RawFileLoader_Load(void* ctx, struct TerrainPatch* patch)
     {
         assert(ctx);
         TerrainFileLoader* loader = (TerrainFileLoader*)ctx;
 
-    }
+        // Coarser lods skip pixels
+        int64_t step = GetPatchStep(patch->m_Lod);
+        int64_t origin_x = (int64_t)floorf(patch->m_Position.getX());
+        int64_t origin_z = (int64_t)floorf(patch->m_Position.getZ());
+        int size = GetPatchSize(0) + 3; // The patch vertices, and a border of one vertex
 
+        uint16_t* heights = patch->m_Heightmap;
+        for (int z = 0; z < size; ++z)
+        {
+            const uint8_t* row = GetRow(loader, ClampPixelCoord(loader, origin_z + (z - 1) * step));
+            for (int x = 0; x < size; ++x)
+            {
+                *heights++ = GetPixel(loader, row, ClampPixelCoord(loader, origin_x + (x - 1) * step));
+            }
+        }
+        return true;
+    }
 
-}
\ No newline at end of file
+    float RawFileLoader_GetHeight(void* ctx, float x, float z)
+    {
+        TerrainFileLoader* loader = (TerrainFileLoader*)ctx;
+        float fx = floorf(x);
+        float fz = floorf(z);
+        float tx = x - fx;
+        float tz = z - fz;
+        uint32_t x0 = ClampPixelCoord(loader, (int64_t)fx);
+        uint32_t x1 = ClampPixelCoord(loader, (int64_t)fx + 1);
+        const uint8_t* row0 = GetRow(loader, ClampPixelCoord(loader, (int64_t)fz));
+        const uint8_t* row1 = GetRow(loader, ClampPixelCoord(loader, (int64_t)fz + 1));
+        float h0 = GetPixel(loader, row0, x0) + (GetPixel(loader, row0, x1) - (float)GetPixel(loader, row0, x0)) * tx;
+        float h1 = GetPixel(loader, row1, x0) + (GetPixel(loader, row1, x1) - (float)GetPixel(loader, row1, x0)) * tx;
+        return h0 + (h1 - h0) * tz;
+    }
+}
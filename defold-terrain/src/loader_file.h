@@ -1,8 +1,17 @@
 #pragma once
+#include <stdint.h>
 
 namespace dmTerrain
 {
+    // A square heightmap (.r16, .r32 or 8 bit raw, no header) that is memory mapped, so that only the parts that are
+    // used are read from disk. One pixel per world unit, with pixel (0,0) at the world origin.
+    // The edge pixels are repeated outside of the image.
     void*   RawFileLoader_Init(const char* path);
     void    RawFileLoader_Exit(void* ctx);
-    void    RawFileLoader_Load(void* ctx, struct TerrainPatch* patch);
-}
\ No newline at end of file
+
+    // Copies the heights of the patch (including the border) into the patch heightmap
+    bool    RawFileLoader_Load(void* ctx, struct TerrainPatch* patch);
+
+    // The bilinearly filtered height at a world position [0, 65535]. Thread safe
+    float   RawFileLoader_GetHeight(void* ctx, float x, float z);
+}
@@ -0,0 +1,308 @@
+#include <dmsdk/sdk.h>
+#include <dmsdk/dlib/log.h>
+#include "terrain_private.h"
+#include "loader_tiles.h"
+#include "tile_format.h"
+#include "compress.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+namespace dmTerrain
+{
+    // The last decoded tile
+    struct TileCache
+    {
+        int         m_Level;    // -1 = empty
+        uint32_t    m_X;
+        uint32_t    m_Z;
+        uint16_t*   m_Heights;
+    };
+
+    enum TileCacheType
+    {
+        TILE_CACHE_LOAD,    // The terrain thread
+        TILE_CACHE_QUERY,   // The height queries
+        NUM_TILE_CACHES,
+    };
+
+    struct TileFileLoader
+    {
+        FILE*           m_File;
+        dmMutex::HMutex m_Mutex;        // Protects the file, m_Compressed and the query cache
+        TileFileHeader  m_Header;
+        TileFileEntry*  m_Entries;
+        uint32_t        m_LevelFirstEntry[TILE_FILE_MAX_LEVELS];
+        uint32_t        m_LevelSize[TILE_FILE_MAX_LEVELS][2];   // Samples
+        uint32_t        m_LevelTiles[TILE_FILE_MAX_LEVELS][2];
+        uint8_t*        m_Compressed;
+        uint32_t        m_CompressedSize;
+        TileCache       m_Caches[NUM_TILE_CACHES];
+    };
+
+    static bool SeekFile(FILE* file, uint64_t offset)
+    {
+#if defined(_WIN32)
+        return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+        return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+    }
+
+    static bool ReadHeader(TileFileLoader* loader, const char* path)
+    {
+        TileFileHeader& header = loader->m_Header;
+        if (fread(&header, 1, sizeof(header), loader->m_File) != sizeof(header))
+        {
+            dmLogError("Failed to read the header of '%s'", path);
+            return false;
+        }
+        if (header.m_Magic != TILE_FILE_MAGIC || header.m_Version != TILE_FILE_VERSION)
+        {
+            dmLogError("'%s' isn't a terrain file of version %u", path, TILE_FILE_VERSION);
+            return false;
+        }
+        if (header.m_Width == 0 || header.m_Height == 0 || header.m_TileSize == 0 || header.m_NumLevels == 0 || header.m_NumLevels > TILE_FILE_MAX_LEVELS)
+        {
+            dmLogError("'%s' has an invalid header", path);
+            return false;
+        }
+
+        uint32_t num_entries = 0;
+        for (uint32_t level = 0; level < header.m_NumLevels; ++level)
+        {
+            loader->m_LevelFirstEntry[level] = num_entries;
+            loader->m_LevelSize[level][0] = GetTileLevelSize(header.m_Width, level);
+            loader->m_LevelSize[level][1] = GetTileLevelSize(header.m_Height, level);
+            loader->m_LevelTiles[level][0] = (loader->m_LevelSize[level][0] + header.m_TileSize - 1) / header.m_TileSize;
+            loader->m_LevelTiles[level][1] = (loader->m_LevelSize[level][1] + header.m_TileSize - 1) / header.m_TileSize;
+            num_entries += loader->m_LevelTiles[level][0] * loader->m_LevelTiles[level][1];
+        }
+
+        loader->m_Entries = new TileFileEntry[num_entries];
+        if (fread(loader->m_Entries, sizeof(TileFileEntry), num_entries, loader->m_File) != num_entries)
+        {
+            dmLogError("Failed to read the tile table of '%s'", path);
+            return false;
+        }
+        return true;
+    }
+
+    static void Destroy(TileFileLoader* loader)
+    {
+        if (loader->m_File)
+            fclose(loader->m_File);
+        if (loader->m_Mutex)
+            dmMutex::Delete(loader->m_Mutex);
+        for (uint32_t i = 0; i < NUM_TILE_CACHES; ++i)
+            delete[] loader->m_Caches[i].m_Heights;
+        delete[] loader->m_Compressed;
+        delete[] loader->m_Entries;
+        delete loader;
+    }
+
+    void* TileFileLoader_Init(const char* path)
+    {
+        TileFileLoader* loader = new TileFileLoader;
+        memset(loader, 0, sizeof(*loader));
+
+        loader->m_File = fopen(path, "rb");
+        if (!loader->m_File)
+        {
+            dmLogError("Failed to open '%s' for reading.", path);
+            Destroy(loader);
+            return 0;
+        }
+
+        if (!ReadHeader(loader, path))
+        {
+            Destroy(loader);
+            return 0;
+        }
+
+        uint32_t stored_size = GetTileStoredSize(loader->m_Header.m_TileSize);
+        loader->m_CompressedSize = GetMaxCompressedSize(stored_size, stored_size);
+        loader->m_Compressed = new uint8_t[loader->m_CompressedSize];
+        for (uint32_t i = 0; i < NUM_TILE_CACHES; ++i)
+        {
+            loader->m_Caches[i].m_Level = -1;
+            loader->m_Caches[i].m_Heights = new uint16_t[stored_size * stored_size];
+        }
+        loader->m_Mutex = dmMutex::New();
+
+        dmLogInfo("Loaded '%s': size: %ux%u  tile size: %u  levels: %u", path, loader->m_Header.m_Width, loader->m_Header.m_Height,
+                    loader->m_Header.m_TileSize, loader->m_Header.m_NumLevels);
+        return loader;
+    }
+
+    void TileFileLoader_Exit(void* ctx)
+    {
+        if (ctx)
+            Destroy((TileFileLoader*)ctx);
+    }
+
+    float TileFileLoader_GetHeightScale(void* ctx)
+    {
+        return ((TileFileLoader*)ctx)->m_Header.m_HeightScale;
+    }
+
+    // The caller must hold m_Mutex
+    static bool DecodeTile(TileFileLoader* loader, TileCache* cache, uint32_t level, uint32_t x, uint32_t z)
+    {
+        if (cache->m_Level == (int)level && cache->m_X == x && cache->m_Z == z)
+            return true;
+
+        const TileFileEntry& entry = loader->m_Entries[loader->m_LevelFirstEntry[level] + z * loader->m_LevelTiles[level][0] + x];
+        uint32_t stored_size = GetTileStoredSize(loader->m_Header.m_TileSize);
+
+        cache->m_Level = -1;
+
+        if (entry.m_Size > loader->m_CompressedSize || !SeekFile(loader->m_File, entry.m_Offset) ||
+            fread(loader->m_Compressed, 1, entry.m_Size, loader->m_File) != entry.m_Size)
+        {
+            dmLogError("Failed to read tile %u, %u at level %u", x, z, level);
+            return false;
+        }
+        if (!DecompressHeights(loader->m_Compressed, entry.m_Size, stored_size, stored_size, cache->m_Heights))
+        {
+            dmLogError("Failed to decompress tile %u, %u at level %u", x, z, level);
+            return false;
+        }
+
+        cache->m_Level = level;
+        cache->m_X = x;
+        cache->m_Z = z;
+        return true;
+    }
+
+    // The samples of a patch along one axis, in level coordinates
+    struct SampleAxis
+    {
+        int64_t     m_Origin;   // The first sample inside the patch
+        int64_t     m_Stride;
+        uint32_t    m_Size;     // The number of samples in the level
+    };
+
+    static inline int64_t GetSampleCoord(const SampleAxis& axis, uint32_t i)
+    {
+        int64_t c = axis.m_Origin + ((int64_t)i - 1) * axis.m_Stride; // The first sample is the border
+        return c < 0 ? 0 : (c >= axis.m_Size ? axis.m_Size - 1 : c);
+    }
+
+    // Finds the tile that holds the most consecutive samples, starting at 'begin'.
+    // Returns the end of that range
+    static uint32_t GetTileRange(uint32_t tile_size, const SampleAxis& axis, uint32_t begin, uint32_t end, uint32_t* tile)
+    {
+        int64_t c = GetSampleCoord(axis, begin);
+        int64_t t = c / tile_size;
+        if (begin + 1 < end)
+        {
+            // The sample may be in the apron of the next tile
+            int64_t next = GetSampleCoord(axis, begin + 1) / tile_size;
+            if (next != t && c >= next * tile_size - TILE_APRON_BEFORE)
+                t = next;
+        }
+
+        int64_t last = t * tile_size + tile_size - 1 + TILE_APRON_AFTER;
+        uint32_t i = begin + 1;
+        while (i < end && GetSampleCoord(axis, i) <= last)
+            ++i;
+
+        *tile = (uint32_t)t;
+        return i;
+    }
+
+    bool TileFileLoader_Load(void* ctx, struct TerrainPatch* patch)
+    {
+        assert(ctx);
+        TileFileLoader* loader = (TileFileLoader*)ctx;
+        TileCache* cache = &loader->m_Caches[TILE_CACHE_LOAD];
+
+        // The lods that aren't stored are read from the coarsest level
+        uint32_t level = dmMath::Min((uint32_t)patch->m_Lod, loader->m_Header.m_NumLevels - 1);
+        int64_t level_step = 1 << level;
+
+        SampleAxis axis_x, axis_z;
+        axis_x.m_Origin = (int64_t)floorf(patch->m_Position.getX() / level_step);
+        axis_z.m_Origin = (int64_t)floorf(patch->m_Position.getZ() / level_step);
+        axis_x.m_Stride = axis_z.m_Stride = GetPatchStep(patch->m_Lod) / level_step;
+        axis_x.m_Size = loader->m_LevelSize[level][0];
+        axis_z.m_Size = loader->m_LevelSize[level][1];
+
+        uint32_t tile_size = loader->m_Header.m_TileSize;
+        uint32_t stored_size = GetTileStoredSize(tile_size);
+        uint32_t size = GetPatchSize(0) + 3; // The patch vertices, and a border of one vertex
+
+        uint32_t tile_z;
+        for (uint32_t z_begin = 0, z_end; z_begin < size; z_begin = z_end)
+        {
+            z_end = GetTileRange(tile_size, axis_z, z_begin, size, &tile_z);
+
+            uint32_t tile_x;
+            for (uint32_t x_begin = 0, x_end; x_begin < size; x_begin = x_end)
+            {
+                x_end = GetTileRange(tile_size, axis_x, x_begin, size, &tile_x);
+                {
+                    // The load cache is only used by the thread that loads the patches (the reader thread, see patch_reader.h),
+                    // so the samples are copied without the lock. The lock protects the file and m_Compressed
+                    DM_MUTEX_SCOPED_LOCK(loader->m_Mutex);
+                    if (!DecodeTile(loader, cache, level, tile_x, tile_z))
+                        return false;
+                }
+
+                // The first stored sample is one apron sample before the tile
+                int64_t tile_origin_x = (int64_t)tile_x * tile_size - TILE_APRON_BEFORE;
+                int64_t tile_origin_z = (int64_t)tile_z * tile_size - TILE_APRON_BEFORE;
+                for (uint32_t z = z_begin; z < z_end; ++z)
+                {
+                    const uint16_t* src = cache->m_Heights + (GetSampleCoord(axis_z, z) - tile_origin_z) * stored_size;
+                    uint16_t* dst = patch->m_Heightmap + z * size;
+                    for (uint32_t x = x_begin; x < x_end; ++x)
+                        dst[x] = src[GetSampleCoord(axis_x, x) - tile_origin_x];
+                }
+            }
+        }
+        return true;
+    }
+
+    float TileFileLoader_GetHeight(void* ctx, float x, float z)
+    {
+        TileFileLoader* loader = (TileFileLoader*)ctx;
+        TileCache* cache = &loader->m_Caches[TILE_CACHE_QUERY];
+
+        float fx = floorf(x);
+        float fz = floorf(z);
+        float tx = x - fx;
+        float tz = z - fz;
+
+        // Both neighbors are in the same tile, thanks to the apron
+        SampleAxis axis_x = { (int64_t)fx + 1, 1, loader->m_LevelSize[0][0] };
+        SampleAxis axis_z = { (int64_t)fz + 1, 1, loader->m_LevelSize[0][1] };
+        int64_t x0 = GetSampleCoord(axis_x, 0);
+        int64_t z0 = GetSampleCoord(axis_z, 0);
+        int64_t x1 = GetSampleCoord(axis_x, 1);
+        int64_t z1 = GetSampleCoord(axis_z, 1);
+
+        uint32_t tile_size = loader->m_Header.m_TileSize;
+        uint32_t stored_size = GetTileStoredSize(tile_size);
+        uint32_t tile_x = (uint32_t)(x0 / tile_size);
+        uint32_t tile_z = (uint32_t)(z0 / tile_size);
+
+        // Held until the samples are read, since the query cache is shared by all callers
+        DM_MUTEX_SCOPED_LOCK(loader->m_Mutex);
+        if (!DecodeTile(loader, cache, 0, tile_x, tile_z))
+            return 0.0f;
+
+        int64_t tile_origin_x = (int64_t)tile_x * tile_size - TILE_APRON_BEFORE;
+        int64_t tile_origin_z = (int64_t)tile_z * tile_size - TILE_APRON_BEFORE;
+        const uint16_t* row0 = cache->m_Heights + (z0 - tile_origin_z) * stored_size;
+        const uint16_t* row1 = cache->m_Heights + (z1 - tile_origin_z) * stored_size;
+        float h00 = row0[x0 - tile_origin_x];
+        float h10 = row0[x1 - tile_origin_x];
+        float h01 = row1[x0 - tile_origin_x];
+        float h11 = row1[x1 - tile_origin_x];
+        float h0 = h00 + (h10 - h00) * tx;
+        float h1 = h01 + (h11 - h01) * tx;
+        return h0 + (h1 - h0) * tz;
+    }
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+
+namespace dmTerrain
+{
+    // Loads patches from a tiled heightmap container (see tile_format.h).
+    // A patch is read with one seek and one small read, when the tile size matches the patch size.
+    void*   TileFileLoader_Init(const char* path);
+    void    TileFileLoader_Exit(void* ctx);
+
+    // Copies the heights of the patch (including the border) into the patch heightmap
+    bool    TileFileLoader_Load(void* ctx, struct TerrainPatch* patch);
+
+    // The bilinearly filtered height at a world position [0, 65535]. Thread safe
+    float   TileFileLoader_GetHeight(void* ctx, float x, float z);
+
+    // The world height of the max value
+    float   TileFileLoader_GetHeightScale(void* ctx);
+}
@@ -10,4 +10,8 @@ namespace dmNoise
     float Noise2Df(float x, float y, uint32_t seed);
 
     float Fbm_2D(uint32_t seed, float x, float y, float frequency, float lacunarity, float amplitude, float gain, int num_octaves);
+
+    // Same as Fbm_2D() for each of the coordinates (x[i], y[i]), using SSE2/AVX2/NEON when available
+    void Fbm_2D_Batch(uint32_t seed, const float* x, const float* y, uint32_t count,
+                        float frequency, float lacunarity, float amplitude, float gain, int num_octaves, float* out);
 }
@@ -0,0 +1,351 @@
+#include "noise.h"
+#include <limits.h>
+#include <math.h>
+
+// Batch versions of Fbm_2D(), evaluating several samples at once.
+//
+// The kernels perform the same operations in the same order as the scalar Noise2Df()/Fbm_2D(), so the
+// SSE2 and AVX2 paths are bit exact with the scalar path. On NEON, the compiler may fuse the scalar
+// multiply-adds differently, and the results may differ by up to 1e-6.
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__)) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define NOISE_SIMD_SSE2
+    #include <emmintrin.h>
+    #if defined(__GNUC__) || defined(__clang__)
+        #define NOISE_SIMD_AVX2
+        #include <immintrin.h>
+        #define NOISE_TARGET_AVX2 __attribute__((target("avx2")))
+    #elif defined(_MSC_VER)
+        #define NOISE_SIMD_AVX2
+        #include <immintrin.h>
+        #include <intrin.h>
+        #define NOISE_TARGET_AVX2
+    #endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #define NOISE_SIMD_NEON
+    #include <arm_neon.h>
+#endif
+
+namespace dmNoise
+{
+    // Same as in noise.cpp
+    static const uint32_t XXH_PRIME32_2 = 2246822519U;
+    static const uint32_t XXH_PRIME32_3 = 3266489917U;
+    static const uint32_t XXH_PRIME32_4 =  668265263U;
+    static const uint32_t XXH_PRIME32_5 =  374761393U;
+
+    static const float OO_UINT_MAX = 1.0f / (float)UINT_MAX; // (float)UINT_MAX == 2^32, so the multiply is exact
+
+    typedef void (*FbmBatchFn)(uint32_t seed, const float* x, const float* y, uint32_t count,
+                                float frequency, float lacunarity, float amplitude, float gain, int num_octaves, float* out);
+
+    static void Fbm_2D_Batch_Scalar(uint32_t seed, const float* x, const float* y, uint32_t count,
+                                float frequency, float lacunarity, float amplitude, float gain, int num_octaves, float* out)
+    {
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            out[i] = Fbm_2D(seed, x[i], y[i], frequency, lacunarity, amplitude, gain, num_octaves);
+        }
+    }
+
+#if defined(NOISE_SIMD_SSE2)
+    // SSE2 lacks a 32 bit multiply (_mm_mullo_epi32 is SSE4.1)
+    static inline __m128i Mul32_SSE2(__m128i a, __m128i b)
+    {
+        __m128i even = _mm_mul_epu32(a, b);
+        __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+        return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0)));
+    }
+
+    // Noise1D(), where seed5 = seed + XXH_PRIME32_5
+    static inline __m128i Hash_SSE2(__m128i x, __m128i seed5)
+    {
+        __m128i h = _mm_add_epi32(x, seed5);
+        h = _mm_xor_si128(h, _mm_srli_epi32(h, 15));
+        h = Mul32_SSE2(h, _mm_set1_epi32((int)XXH_PRIME32_2));
+        h = _mm_xor_si128(h, _mm_srli_epi32(h, 13));
+        h = Mul32_SSE2(h, _mm_set1_epi32((int)XXH_PRIME32_3));
+        h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+        return h;
+    }
+
+    // Correctly rounded, as the high part is exact, and the add is rounded once
+    static inline __m128 U32ToFloat_SSE2(__m128i v)
+    {
+        __m128 hi = _mm_cvtepi32_ps(_mm_srli_epi32(v, 16));
+        __m128 lo = _mm_cvtepi32_ps(_mm_and_si128(v, _mm_set1_epi32(0xFFFF)));
+        return _mm_add_ps(_mm_mul_ps(hi, _mm_set1_ps(65536.0f)), lo);
+    }
+
+    static inline __m128i Floor_SSE2(__m128 v)
+    {
+        __m128i t = _mm_cvttps_epi32(v);
+        __m128 gt = _mm_cmpgt_ps(_mm_cvtepi32_ps(t), v);
+        return _mm_add_epi32(t, _mm_castps_si128(gt)); // the mask is -1 where we truncated upwards
+    }
+
+    static inline __m128 Noise2Df_SSE2(__m128 x, __m128 y, __m128i seed5)
+    {
+        __m128i xi = Floor_SSE2(x);
+        __m128i yi = Floor_SSE2(y);
+        __m128 fracx = _mm_sub_ps(x, _mm_cvtepi32_ps(xi));
+        __m128 fracy = _mm_sub_ps(y, _mm_cvtepi32_ps(yi));
+
+        // Noise2D(x, y) = Noise1D(x + PRIME4 * y)
+        __m128i prime4 = _mm_set1_epi32((int)XXH_PRIME32_4);
+        __m128i one = _mm_set1_epi32(1);
+        __m128i n00 = _mm_add_epi32(xi, Mul32_SSE2(prime4, yi));
+        __m128i n10 = _mm_add_epi32(n00, one);
+        __m128i n01 = _mm_add_epi32(n00, prime4);
+        __m128i n11 = _mm_add_epi32(n01, one);
+
+        __m128 scale = _mm_set1_ps(OO_UINT_MAX);
+        __m128 h0 = _mm_mul_ps(U32ToFloat_SSE2(Hash_SSE2(n00, seed5)), scale);
+        __m128 h1 = _mm_mul_ps(U32ToFloat_SSE2(Hash_SSE2(n10, seed5)), scale);
+        __m128 h2 = _mm_mul_ps(U32ToFloat_SSE2(Hash_SSE2(n01, seed5)), scale);
+        __m128 h3 = _mm_mul_ps(U32ToFloat_SSE2(Hash_SSE2(n11, seed5)), scale);
+
+        __m128 three = _mm_set1_ps(3.0f);
+        __m128 two = _mm_set1_ps(2.0f);
+        __m128 tx = _mm_mul_ps(_mm_mul_ps(fracx, fracx), _mm_sub_ps(three, _mm_mul_ps(two, fracx)));
+        __m128 ty = _mm_mul_ps(_mm_mul_ps(fracy, fracy), _mm_sub_ps(three, _mm_mul_ps(two, fracy)));
+
+        // Mix(h0, h1, tx) + (h2 - h0) * ty * (1.0f - tx) + (h3 - h1) * tx * ty
+        __m128 r = _mm_add_ps(h0, _mm_mul_ps(_mm_sub_ps(h1, h0), tx));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(h2, h0), ty), _mm_sub_ps(_mm_set1_ps(1.0f), tx)));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(h3, h1), tx), ty));
+        return r;
+    }
+
+    static void Fbm_2D_Batch_SSE2(uint32_t seed, const float* x, const float* y, uint32_t count,
+                                float frequency, float lacunarity, float amplitude, float gain, int num_octaves, float* out)
+    {
+        __m128i seed5 = _mm_set1_epi32((int)(seed + XXH_PRIME32_5));
+
+        uint32_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128 vx = _mm_loadu_ps(x + i);
+            __m128 vy = _mm_loadu_ps(y + i);
+            __m128 sum = _mm_setzero_ps();
+            float f = frequency;
+            float a = amplitude;
+            for (int o = 0; o < num_octaves; ++o)
+            {
+                sum = _mm_add_ps(sum, _mm_mul_ps(Noise2Df_SSE2(vx, vy, seed5), _mm_set1_ps(a)));
+                vx = _mm_mul_ps(vx, _mm_set1_ps(f));
+                vy = _mm_mul_ps(vy, _mm_set1_ps(f));
+                f *= lacunarity;
+                a *= gain;
+            }
+            _mm_storeu_ps(out + i, sum);
+        }
+
+        Fbm_2D_Batch_Scalar(seed, x + i, y + i, count - i, frequency, lacunarity, amplitude, gain, num_octaves, out + i);
+    }
+#endif
+
+#if defined(NOISE_SIMD_AVX2)
+    NOISE_TARGET_AVX2 static inline __m256i Hash_AVX2(__m256i x, __m256i seed5)
+    {
+        __m256i h = _mm256_add_epi32(x, seed5);
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+        h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int)XXH_PRIME32_2));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+        h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int)XXH_PRIME32_3));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+        return h;
+    }
+
+    NOISE_TARGET_AVX2 static inline __m256 U32ToFloat_AVX2(__m256i v)
+    {
+        __m256 hi = _mm256_cvtepi32_ps(_mm256_srli_epi32(v, 16));
+        __m256 lo = _mm256_cvtepi32_ps(_mm256_and_si256(v, _mm256_set1_epi32(0xFFFF)));
+        return _mm256_add_ps(_mm256_mul_ps(hi, _mm256_set1_ps(65536.0f)), lo);
+    }
+
+    NOISE_TARGET_AVX2 static inline __m256 Noise2Df_AVX2(__m256 x, __m256 y, __m256i seed5)
+    {
+        __m256 xf = _mm256_floor_ps(x);
+        __m256 yf = _mm256_floor_ps(y);
+        __m256i xi = _mm256_cvttps_epi32(xf);
+        __m256i yi = _mm256_cvttps_epi32(yf);
+        __m256 fracx = _mm256_sub_ps(x, xf);
+        __m256 fracy = _mm256_sub_ps(y, yf);
+
+        __m256i prime4 = _mm256_set1_epi32((int)XXH_PRIME32_4);
+        __m256i one = _mm256_set1_epi32(1);
+        __m256i n00 = _mm256_add_epi32(xi, _mm256_mullo_epi32(prime4, yi));
+        __m256i n10 = _mm256_add_epi32(n00, one);
+        __m256i n01 = _mm256_add_epi32(n00, prime4);
+        __m256i n11 = _mm256_add_epi32(n01, one);
+
+        __m256 scale = _mm256_set1_ps(OO_UINT_MAX);
+        __m256 h0 = _mm256_mul_ps(U32ToFloat_AVX2(Hash_AVX2(n00, seed5)), scale);
+        __m256 h1 = _mm256_mul_ps(U32ToFloat_AVX2(Hash_AVX2(n10, seed5)), scale);
+        __m256 h2 = _mm256_mul_ps(U32ToFloat_AVX2(Hash_AVX2(n01, seed5)), scale);
+        __m256 h3 = _mm256_mul_ps(U32ToFloat_AVX2(Hash_AVX2(n11, seed5)), scale);
+
+        __m256 three = _mm256_set1_ps(3.0f);
+        __m256 two = _mm256_set1_ps(2.0f);
+        __m256 tx = _mm256_mul_ps(_mm256_mul_ps(fracx, fracx), _mm256_sub_ps(three, _mm256_mul_ps(two, fracx)));
+        __m256 ty = _mm256_mul_ps(_mm256_mul_ps(fracy, fracy), _mm256_sub_ps(three, _mm256_mul_ps(two, fracy)));
+
+        __m256 r = _mm256_add_ps(h0, _mm256_mul_ps(_mm256_sub_ps(h1, h0), tx));
+        r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(h2, h0), ty), _mm256_sub_ps(_mm256_set1_ps(1.0f), tx)));
+        r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(h3, h1), tx), ty));
+        return r;
+    }
+
+    NOISE_TARGET_AVX2 static void Fbm_2D_Batch_AVX2(uint32_t seed, const float* x, const float* y, uint32_t count,
+                                float frequency, float lacunarity, float amplitude, float gain, int num_octaves, float* out)
+    {
+        __m256i seed5 = _mm256_set1_epi32((int)(seed + XXH_PRIME32_5));
+
+        uint32_t i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256 vx = _mm256_loadu_ps(x + i);
+            __m256 vy = _mm256_loadu_ps(y + i);
+            __m256 sum = _mm256_setzero_ps();
+            float f = frequency;
+            float a = amplitude;
+            for (int o = 0; o < num_octaves; ++o)
+            {
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(Noise2Df_AVX2(vx, vy, seed5), _mm256_set1_ps(a)));
+                vx = _mm256_mul_ps(vx, _mm256_set1_ps(f));
+                vy = _mm256_mul_ps(vy, _mm256_set1_ps(f));
+                f *= lacunarity;
+                a *= gain;
+            }
+            _mm256_storeu_ps(out + i, sum);
+        }
+
+        Fbm_2D_Batch_SSE2(seed, x + i, y + i, count - i, frequency, lacunarity, amplitude, gain, num_octaves, out + i);
+    }
+
+    static bool HasAVX2()
+    {
+    #if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return false;
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) // the OS must save the ymm registers
+            return false;
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+    #else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    #endif
+    }
+#endif
+
+#if defined(NOISE_SIMD_NEON)
+    static inline uint32x4_t Hash_NEON(uint32x4_t x, uint32x4_t seed5)
+    {
+        uint32x4_t h = vaddq_u32(x, seed5);
+        h = veorq_u32(h, vshrq_n_u32(h, 15));
+        h = vmulq_u32(h, vdupq_n_u32(XXH_PRIME32_2));
+        h = veorq_u32(h, vshrq_n_u32(h, 13));
+        h = vmulq_u32(h, vdupq_n_u32(XXH_PRIME32_3));
+        h = veorq_u32(h, vshrq_n_u32(h, 16));
+        return h;
+    }
+
+    static inline int32x4_t Floor_NEON(float32x4_t v)
+    {
+        int32x4_t t = vcvtq_s32_f32(v); // truncates
+        uint32x4_t gt = vcgtq_f32(vcvtq_f32_s32(t), v);
+        return vaddq_s32(t, vreinterpretq_s32_u32(gt)); // the mask is -1 where we truncated upwards
+    }
+
+    static inline float32x4_t Noise2Df_NEON(float32x4_t x, float32x4_t y, uint32x4_t seed5)
+    {
+        int32x4_t xi = Floor_NEON(x);
+        int32x4_t yi = Floor_NEON(y);
+        float32x4_t fracx = vsubq_f32(x, vcvtq_f32_s32(xi));
+        float32x4_t fracy = vsubq_f32(y, vcvtq_f32_s32(yi));
+
+        uint32x4_t prime4 = vdupq_n_u32(XXH_PRIME32_4);
+        uint32x4_t one = vdupq_n_u32(1);
+        uint32x4_t n00 = vaddq_u32(vreinterpretq_u32_s32(xi), vmulq_u32(prime4, vreinterpretq_u32_s32(yi)));
+        uint32x4_t n10 = vaddq_u32(n00, one);
+        uint32x4_t n01 = vaddq_u32(n00, prime4);
+        uint32x4_t n11 = vaddq_u32(n01, one);
+
+        float32x4_t scale = vdupq_n_f32(OO_UINT_MAX);
+        float32x4_t h0 = vmulq_f32(vcvtq_f32_u32(Hash_NEON(n00, seed5)), scale);
+        float32x4_t h1 = vmulq_f32(vcvtq_f32_u32(Hash_NEON(n10, seed5)), scale);
+        float32x4_t h2 = vmulq_f32(vcvtq_f32_u32(Hash_NEON(n01, seed5)), scale);
+        float32x4_t h3 = vmulq_f32(vcvtq_f32_u32(Hash_NEON(n11, seed5)), scale);
+
+        float32x4_t three = vdupq_n_f32(3.0f);
+        float32x4_t two = vdupq_n_f32(2.0f);
+        float32x4_t tx = vmulq_f32(vmulq_f32(fracx, fracx), vsubq_f32(three, vmulq_f32(two, fracx)));
+        float32x4_t ty = vmulq_f32(vmulq_f32(fracy, fracy), vsubq_f32(three, vmulq_f32(two, fracy)));
+
+        float32x4_t r = vaddq_f32(h0, vmulq_f32(vsubq_f32(h1, h0), tx));
+        r = vaddq_f32(r, vmulq_f32(vmulq_f32(vsubq_f32(h2, h0), ty), vsubq_f32(vdupq_n_f32(1.0f), tx)));
+        r = vaddq_f32(r, vmulq_f32(vmulq_f32(vsubq_f32(h3, h1), tx), ty));
+        return r;
+    }
+
+    static void Fbm_2D_Batch_NEON(uint32_t seed, const float* x, const float* y, uint32_t count,
+                                float frequency, float lacunarity, float amplitude, float gain, int num_octaves, float* out)
+    {
+        uint32x4_t seed5 = vdupq_n_u32(seed + XXH_PRIME32_5);
+
+        uint32_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            float32x4_t vx = vld1q_f32(x + i);
+            float32x4_t vy = vld1q_f32(y + i);
+            float32x4_t sum = vdupq_n_f32(0.0f);
+            float f = frequency;
+            float a = amplitude;
+            for (int o = 0; o < num_octaves; ++o)
+            {
+                sum = vaddq_f32(sum, vmulq_f32(Noise2Df_NEON(vx, vy, seed5), vdupq_n_f32(a)));
+                vx = vmulq_f32(vx, vdupq_n_f32(f));
+                vy = vmulq_f32(vy, vdupq_n_f32(f));
+                f *= lacunarity;
+                a *= gain;
+            }
+            vst1q_f32(out + i, sum);
+        }
+
+        Fbm_2D_Batch_Scalar(seed, x + i, y + i, count - i, frequency, lacunarity, amplitude, gain, num_octaves, out + i);
+    }
+#endif
+
+    static FbmBatchFn SelectFbmBatch()
+    {
+    #if defined(NOISE_SIMD_AVX2)
+        if (HasAVX2())
+            return Fbm_2D_Batch_AVX2;
+    #endif
+    #if defined(NOISE_SIMD_SSE2)
+        return Fbm_2D_Batch_SSE2;
+    #elif defined(NOISE_SIMD_NEON)
+        return Fbm_2D_Batch_NEON;
+    #else
+        return Fbm_2D_Batch_Scalar;
+    #endif
+    }
+
+    static FbmBatchFn g_FbmBatch = 0;
+
+    void Fbm_2D_Batch(uint32_t seed, const float* x, const float* y, uint32_t count,
+                        float frequency, float lacunarity, float amplitude, float gain, int num_octaves, float* out)
+    {
+        // Selecting the same function from several threads is harmless
+        if (!g_FbmBatch)
+            g_FbmBatch = SelectFbmBatch();
+        g_FbmBatch(seed, x, y, count, frequency, lacunarity, amplitude, gain, num_octaves, out);
+    }
+}
@@ -0,0 +1,366 @@
+#include <dmsdk/sdk.h>
+#include <dmsdk/dlib/log.h>
+#include "patch_cache.h"
+#include "compress.h"
+#include <stdio.h>
+#include <string.h>
+
+namespace dmTerrain
+{
+    static const uint32_t PATCH_CACHE_INDEX_MAGIC = 0x49435054; // "TPCI"
+    static const uint32_t PATCH_CACHE_FILE_MAGIC = 0x48435054;  // "TPCH"
+    static const uint32_t PATCH_CACHE_FORMAT_VERSION = 2;
+    static const uint32_t PATCH_CACHE_MAX_PATH = 1024;
+
+    struct PatchCacheEntry
+    {
+        PatchCacheKey   m_Key;
+        uint32_t        m_Size;     // The size of the file
+        uint32_t        m_LastUsed; // Ticks
+    };
+
+    enum PatchCacheRecordType
+    {
+        RECORD_STORE = 1,   // Adds the entry, or updates it if the key exists
+        RECORD_REMOVE = 2,
+    };
+
+    // The changes since the index was written are appended to it, so that it matches the files even after a crash
+    struct PatchCacheRecord
+    {
+        uint32_t        m_Type;
+        PatchCacheEntry m_Entry;
+    };
+
+    struct PatchCacheFileHeader
+    {
+        uint32_t        m_Magic;
+        uint32_t        m_FormatVersion;
+        PatchCacheKey   m_Key;
+        uint32_t        m_Width;
+        uint32_t        m_Height;
+        uint32_t        m_DataSize;
+    };
+
+    struct PatchCache
+    {
+        char                m_Dir[PATCH_CACHE_MAX_PATH];
+        PatchCacheEntry*    m_Entries;
+        uint32_t            m_NumEntries;
+        uint32_t            m_MaxEntries;
+        uint64_t            m_Size;
+        uint64_t            m_MaxSize;
+        uint32_t            m_Tick;
+        uint32_t            m_NumHits;
+        uint32_t            m_NumMisses;
+
+        uint8_t*            m_Buffer;   // The compressed data of one heightmap
+        uint32_t            m_BufferSize;
+
+        FILE*               m_Journal;  // The index file, opened for appending the records. 0 = not opened
+        uint32_t            m_NumRecords; // The number of records appended since the index was written
+    };
+
+    static bool IsEqual(const PatchCacheKey& a, const PatchCacheKey& b)
+    {
+        return memcmp(&a, &b, sizeof(PatchCacheKey)) == 0;
+    }
+
+    static void GetIndexPath(HPatchCache cache, char* path, uint32_t path_size)
+    {
+        snprintf(path, path_size, "%s/index", cache->m_Dir);
+    }
+
+    static void GetEntryPath(HPatchCache cache, const PatchCacheKey& key, char* path, uint32_t path_size)
+    {
+        snprintf(path, path_size, "%s/%08x_%u_%u_%u_%d_%d.hmc", cache->m_Dir, key.m_Seed, key.m_Version, key.m_PatchSize, key.m_Lod, key.m_X, key.m_Z);
+    }
+
+    static PatchCacheEntry* FindEntry(HPatchCache cache, const PatchCacheKey& key)
+    {
+        for (uint32_t i = 0; i < cache->m_NumEntries; ++i)
+        {
+            if (IsEqual(cache->m_Entries[i].m_Key, key))
+                return &cache->m_Entries[i];
+        }
+        return 0;
+    }
+
+    static bool WriteIndex(HPatchCache cache);
+
+    static void AppendRecord(HPatchCache cache, uint32_t type, const PatchCacheEntry& entry)
+    {
+        if (!cache->m_Journal)
+            return;
+
+        // Too many records makes the index slow to read, so it's rewritten instead
+        if (cache->m_NumRecords >= cache->m_MaxEntries)
+        {
+            WriteIndex(cache);
+            return;
+        }
+
+        PatchCacheRecord record;
+        memset(&record, 0, sizeof(record));
+        record.m_Type = type;
+        record.m_Entry = entry;
+        if (fwrite(&record, sizeof(record), 1, cache->m_Journal) != 1 || fflush(cache->m_Journal) != 0)
+            dmLogError("Failed to write to the patch cache index");
+        cache->m_NumRecords++;
+    }
+
+    // Removes the entry from the array only
+    static void ForgetEntry(HPatchCache cache, PatchCacheEntry* entry)
+    {
+        cache->m_Size -= entry->m_Size;
+        *entry = cache->m_Entries[--cache->m_NumEntries];
+    }
+
+    static void RemoveEntry(HPatchCache cache, PatchCacheEntry* entry)
+    {
+        char path[PATCH_CACHE_MAX_PATH];
+        GetEntryPath(cache, entry->m_Key, path, sizeof(path));
+        remove(path);
+
+        PatchCacheEntry removed = *entry;
+        ForgetEntry(cache, entry);
+        AppendRecord(cache, RECORD_REMOVE, removed);
+    }
+
+    // Replays a record read from the index
+    static void ApplyRecord(HPatchCache cache, const PatchCacheRecord& record)
+    {
+        PatchCacheEntry* entry = FindEntry(cache, record.m_Entry.m_Key);
+        if (record.m_Type == RECORD_REMOVE)
+        {
+            if (entry)
+                ForgetEntry(cache, entry);
+        }
+        else if (record.m_Type == RECORD_STORE)
+        {
+            if (entry)
+                ForgetEntry(cache, entry);
+            if (cache->m_NumEntries == cache->m_MaxEntries)
+                return; // Forgotten, like the entries of the index that don't fit
+            cache->m_Entries[cache->m_NumEntries++] = record.m_Entry;
+            cache->m_Size += record.m_Entry.m_Size;
+        }
+    }
+
+    static void RemoveLeastRecentlyUsed(HPatchCache cache)
+    {
+        PatchCacheEntry* lru = &cache->m_Entries[0];
+        for (uint32_t i = 1; i < cache->m_NumEntries; ++i)
+        {
+            if (cache->m_Entries[i].m_LastUsed < lru->m_LastUsed)
+                lru = &cache->m_Entries[i];
+        }
+        RemoveEntry(cache, lru);
+    }
+
+    static void ReadIndex(HPatchCache cache)
+    {
+        char path[PATCH_CACHE_MAX_PATH];
+        GetIndexPath(cache, path, sizeof(path));
+        FILE* f = fopen(path, "rb");
+        if (!f)
+            return;
+
+        uint32_t header[3] = {0, 0, 0};
+        if (fread(header, sizeof(header), 1, f) != 1 || header[0] != PATCH_CACHE_INDEX_MAGIC || header[1] != PATCH_CACHE_FORMAT_VERSION)
+        {
+            dmLogWarning("Ignoring the patch cache index '%s'", path);
+            fclose(f);
+            return;
+        }
+
+        // Entries that don't fit are forgotten (and their files are left as they are)
+        uint32_t num_entries = dmMath::Min(header[2], cache->m_MaxEntries);
+        cache->m_NumEntries = (uint32_t)fread(cache->m_Entries, sizeof(PatchCacheEntry), num_entries, f);
+        for (uint32_t i = 0; i < cache->m_NumEntries; ++i)
+            cache->m_Size += cache->m_Entries[i].m_Size;
+
+        // The records appended after the entries. A partly written last record (e.g. after a crash) is ignored
+        if (cache->m_NumEntries == header[2] || fseek(f, (long)(sizeof(header) + header[2] * sizeof(PatchCacheEntry)), SEEK_SET) == 0)
+        {
+            PatchCacheRecord record;
+            while (fread(&record, sizeof(record), 1, f) == 1)
+                ApplyRecord(cache, record);
+        }
+        fclose(f);
+
+        for (uint32_t i = 0; i < cache->m_NumEntries; ++i)
+            cache->m_Tick = dmMath::Max(cache->m_Tick, cache->m_Entries[i].m_LastUsed + 1);
+
+        // In case the size limit has been lowered
+        while (cache->m_NumEntries > 0 && cache->m_Size > cache->m_MaxSize)
+            RemoveLeastRecentlyUsed(cache);
+    }
+
+    // Writes all the entries, and reopens the index for appending the records
+    static bool WriteIndex(HPatchCache cache)
+    {
+        char path[PATCH_CACHE_MAX_PATH];
+        GetIndexPath(cache, path, sizeof(path));
+        if (cache->m_Journal)
+            fclose(cache->m_Journal);
+        cache->m_Journal = 0;
+        cache->m_NumRecords = 0;
+
+        FILE* f = fopen(path, "wb");
+        if (!f)
+        {
+            dmLogError("Failed to open '%s' for writing.", path);
+            return false;
+        }
+
+        uint32_t header[3] = { PATCH_CACHE_INDEX_MAGIC, PATCH_CACHE_FORMAT_VERSION, cache->m_NumEntries };
+        bool ok = fwrite(header, sizeof(header), 1, f) == 1;
+        ok = ok && fwrite(cache->m_Entries, sizeof(PatchCacheEntry), cache->m_NumEntries, f) == cache->m_NumEntries;
+        ok = fclose(f) == 0 && ok;
+        if (!ok)
+        {
+            dmLogError("Failed to write '%s'", path);
+            return false;
+        }
+
+        cache->m_Journal = fopen(path, "ab");
+        if (!cache->m_Journal)
+            dmLogError("Failed to open '%s' for appending.", path);
+        return true;
+    }
+
+    HPatchCache PatchCache_Init(const char* dir, uint64_t max_size, uint32_t max_entries, uint32_t num_heights)
+    {
+        if (strlen(dir) + 64 > PATCH_CACHE_MAX_PATH)
+        {
+            dmLogError("The patch cache path is too long: '%s'", dir);
+            return 0;
+        }
+
+        PatchCache* cache = new PatchCache;
+        memset(cache, 0, sizeof(*cache));
+        strcpy(cache->m_Dir, dir);
+        cache->m_MaxSize = max_size;
+        cache->m_MaxEntries = max_entries;
+        cache->m_Entries = new PatchCacheEntry[max_entries];
+        cache->m_BufferSize = GetMaxCompressedSize(num_heights, 1);
+        cache->m_Buffer = new uint8_t[cache->m_BufferSize];
+
+        ReadIndex(cache);
+
+        // Make sure we can write to it
+        if (!WriteIndex(cache))
+        {
+            PatchCache_Exit(cache);
+            return 0;
+        }
+
+        dmLogInfo("Patch cache '%s': %u entries, %llu bytes", dir, cache->m_NumEntries, (unsigned long long)cache->m_Size);
+        return cache;
+    }
+
+    void PatchCache_Exit(HPatchCache cache)
+    {
+        WriteIndex(cache);
+        if (cache->m_Journal)
+            fclose(cache->m_Journal);
+        delete[] cache->m_Entries;
+        delete[] cache->m_Buffer;
+        delete cache;
+    }
+
+    bool PatchCache_Load(HPatchCache cache, const PatchCacheKey& key, uint16_t* heights, uint32_t width, uint32_t height)
+    {
+        PatchCacheEntry* entry = FindEntry(cache, key);
+        if (!entry)
+        {
+            cache->m_NumMisses++;
+            return false;
+        }
+
+        char path[PATCH_CACHE_MAX_PATH];
+        GetEntryPath(cache, key, path, sizeof(path));
+
+        bool ok = false;
+        FILE* f = fopen(path, "rb");
+        if (f)
+        {
+            PatchCacheFileHeader header;
+            ok = fread(&header, sizeof(header), 1, f) == 1;
+            ok = ok && header.m_Magic == PATCH_CACHE_FILE_MAGIC && header.m_FormatVersion == PATCH_CACHE_FORMAT_VERSION;
+            ok = ok && IsEqual(header.m_Key, key) && header.m_Width == width && header.m_Height == height;
+            ok = ok && header.m_DataSize <= cache->m_BufferSize;
+            ok = ok && fread(cache->m_Buffer, 1, header.m_DataSize, f) == header.m_DataSize;
+            ok = ok && DecompressHeights(cache->m_Buffer, header.m_DataSize, width, height, heights);
+            fclose(f);
+        }
+
+        if (!ok)
+        {
+            dmLogWarning("Removing the invalid patch cache entry '%s'", path);
+            RemoveEntry(cache, entry);
+            cache->m_NumMisses++;
+            return false;
+        }
+
+        entry->m_LastUsed = cache->m_Tick++;
+        AppendRecord(cache, RECORD_STORE, *entry);
+        cache->m_NumHits++;
+        return true;
+    }
+
+    void PatchCache_Store(HPatchCache cache, const PatchCacheKey& key, const uint16_t* heights, uint32_t width, uint32_t height)
+    {
+        PatchCacheEntry* entry = FindEntry(cache, key);
+        if (entry)
+            RemoveEntry(cache, entry);
+
+        PatchCacheFileHeader header;
+        memset(&header, 0, sizeof(header));
+        header.m_Magic = PATCH_CACHE_FILE_MAGIC;
+        header.m_FormatVersion = PATCH_CACHE_FORMAT_VERSION;
+        header.m_Key = key;
+        header.m_Width = width;
+        header.m_Height = height;
+        header.m_DataSize = CompressHeights(heights, width, height, cache->m_Buffer, cache->m_BufferSize);
+        if (header.m_DataSize == 0)
+            return;
+
+        uint32_t size = sizeof(header) + header.m_DataSize;
+        if (size > cache->m_MaxSize)
+            return;
+        while (cache->m_NumEntries > 0 && (cache->m_NumEntries == cache->m_MaxEntries || cache->m_Size + size > cache->m_MaxSize))
+            RemoveLeastRecentlyUsed(cache);
+
+        // The entry is recorded before the file is written, so that a crash leaves an invalid entry
+        // (removed when it's loaded), rather than a file that isn't in the index
+        entry = &cache->m_Entries[cache->m_NumEntries++];
+        entry->m_Key = key;
+        entry->m_Size = size;
+        entry->m_LastUsed = cache->m_Tick++;
+        cache->m_Size += size;
+        AppendRecord(cache, RECORD_STORE, *entry);
+
+        char path[PATCH_CACHE_MAX_PATH];
+        GetEntryPath(cache, key, path, sizeof(path));
+        FILE* f = fopen(path, "wb");
+        bool ok = f != 0;
+        ok = ok && fwrite(&header, sizeof(header), 1, f) == 1;
+        ok = ok && fwrite(cache->m_Buffer, 1, header.m_DataSize, f) == header.m_DataSize;
+        ok = (!f || fclose(f) == 0) && ok;
+        if (!ok)
+        {
+            dmLogError("Failed to write '%s'", path);
+            RemoveEntry(cache, entry);
+        }
+    }
+
+    void PatchCache_GetStats(HPatchCache cache, uint32_t* num_entries, uint64_t* size, uint32_t* num_hits, uint32_t* num_misses)
+    {
+        *num_entries = cache->m_NumEntries;
+        *size = cache->m_Size;
+        *num_hits = cache->m_NumHits;
+        *num_misses = cache->m_NumMisses;
+    }
+}
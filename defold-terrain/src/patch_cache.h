@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+
+namespace dmTerrain
+{
+    // A disk cache of generated heightmaps, so that revisited patches don't need to be regenerated.
+    // Each heightmap is stored compressed in its own file, and an index file keeps track of the
+    // entries, so that the least recently used ones can be removed when the cache grows too large.
+    // The changes are appended to the index as they happen, so that it matches the files after a crash.
+    // Not thread safe, it's only used by the terrain thread.
+
+    struct PatchCacheKey
+    {
+        uint32_t    m_Seed;
+        uint32_t    m_Version;      // The version of the height generator
+        uint32_t    m_PatchSize;    // The number of grid steps per patch
+        uint32_t    m_Lod;
+        int32_t     m_X;
+        int32_t     m_Z;
+    };
+
+    typedef struct PatchCache* HPatchCache;
+
+    // The directory must exist. Returns 0 if the directory isn't writable
+    HPatchCache PatchCache_Init(const char* dir, uint64_t max_size, uint32_t max_entries, uint32_t num_heights);
+    // Rewrites the index, without the appended changes
+    void        PatchCache_Exit(HPatchCache cache);
+
+    // Returns false if the patch isn't in the cache
+    bool        PatchCache_Load(HPatchCache cache, const PatchCacheKey& key, uint16_t* heights, uint32_t width, uint32_t height);
+    void        PatchCache_Store(HPatchCache cache, const PatchCacheKey& key, const uint16_t* heights, uint32_t width, uint32_t height);
+
+    void        PatchCache_GetStats(HPatchCache cache, uint32_t* num_entries, uint64_t* size, uint32_t* num_hits, uint32_t* num_misses);
+}
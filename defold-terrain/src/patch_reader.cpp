@@ -0,0 +1,129 @@
+#include <dmsdk/sdk.h>
+#include <dmsdk/dlib/atomic.h>
+#include <dmsdk/dlib/thread.h>
+#include <dmsdk/dlib/condition_variable.h>
+#include <dmsdk/dlib/time.h>
+#include "terrain_private.h"
+#include "patch_reader.h"
+
+namespace dmTerrain
+{
+    struct PatchReader
+    {
+        const HeightmapLoader*  m_Loader;
+        void*                   m_LoaderContext;
+
+        dmThread::Thread        m_Thread;   // 0 = read on the calling thread
+        dmMutex::HMutex         m_Mutex;
+        dmConditionVariable::HConditionVariable m_Condition; // Signaled when there are new requests
+        int32_atomic_t          m_Active;
+
+        // Protected by m_Mutex
+        TerrainPatch**          m_Requests; // A ring buffer
+        uint32_t                m_MaxRequests;
+        uint32_t                m_First;
+        uint32_t                m_NumRequests;
+        uint32_t                m_NumRead;
+        uint64_t                m_ReadTime;
+    };
+
+    static void ReadPatch(HPatchReader reader, TerrainPatch* patch)
+    {
+        uint64_t time_start = dmTime::GetTime();
+        bool ok = reader->m_Loader->m_Load(reader->m_LoaderContext, patch);
+        uint64_t time = dmTime::GetTime() - time_start;
+
+        dmAtomicStore32(&patch->m_ReadState, ok ? PRS_READ : PRS_FAILED);
+
+        DM_MUTEX_SCOPED_LOCK(reader->m_Mutex);
+        reader->m_NumRead++;
+        reader->m_ReadTime += time;
+    }
+
+    static void ReaderThread(void* ctx)
+    {
+        HPatchReader reader = (HPatchReader)ctx;
+        while (true)
+        {
+            TerrainPatch* patch;
+            {
+                DM_MUTEX_SCOPED_LOCK(reader->m_Mutex);
+                while (reader->m_NumRequests == 0 && dmAtomicGet32(&reader->m_Active))
+                {
+                    dmConditionVariable::Wait(reader->m_Condition, reader->m_Mutex);
+                }
+                if (!dmAtomicGet32(&reader->m_Active))
+                    break;
+
+                patch = reader->m_Requests[reader->m_First];
+                reader->m_First = (reader->m_First + 1) % reader->m_MaxRequests;
+                reader->m_NumRequests--;
+            }
+
+            ReadPatch(reader, patch);
+        }
+    }
+
+    HPatchReader PatchReader_New(const HeightmapLoader* loader, void* loader_ctx, uint32_t max_requests, bool use_thread)
+    {
+        PatchReader* reader = new PatchReader;
+        reader->m_Loader = loader;
+        reader->m_LoaderContext = loader_ctx;
+        reader->m_Requests = new TerrainPatch*[max_requests];
+        reader->m_MaxRequests = max_requests;
+        reader->m_First = 0;
+        reader->m_NumRequests = 0;
+        reader->m_NumRead = 0;
+        reader->m_ReadTime = 0;
+        reader->m_Mutex = dmMutex::New();
+        reader->m_Condition = dmConditionVariable::New();
+        dmAtomicStore32(&reader->m_Active, 1);
+        reader->m_Thread = use_thread ? dmThread::New(ReaderThread, 0x20000, reader, "terrain_reader") : 0;
+        return reader;
+    }
+
+    void PatchReader_Delete(HPatchReader reader)
+    {
+        if (reader->m_Thread)
+        {
+            {
+                DM_MUTEX_SCOPED_LOCK(reader->m_Mutex);
+                dmAtomicStore32(&reader->m_Active, 0);
+                dmConditionVariable::Signal(reader->m_Condition);
+            }
+            dmThread::Join(reader->m_Thread);
+        }
+
+        dmConditionVariable::Delete(reader->m_Condition);
+        dmMutex::Delete(reader->m_Mutex);
+        delete[] reader->m_Requests;
+        delete reader;
+    }
+
+    bool PatchReader_Request(HPatchReader reader, TerrainPatch* patch)
+    {
+        if (!reader->m_Thread)
+        {
+            dmAtomicStore32(&patch->m_ReadState, PRS_READING);
+            ReadPatch(reader, patch);
+            return true;
+        }
+
+        DM_MUTEX_SCOPED_LOCK(reader->m_Mutex);
+        if (reader->m_NumRequests == reader->m_MaxRequests)
+            return false;
+
+        dmAtomicStore32(&patch->m_ReadState, PRS_READING);
+        reader->m_Requests[(reader->m_First + reader->m_NumRequests) % reader->m_MaxRequests] = patch;
+        reader->m_NumRequests++;
+        dmConditionVariable::Signal(reader->m_Condition);
+        return true;
+    }
+
+    void PatchReader_GetStats(HPatchReader reader, uint32_t* num_read, uint64_t* read_time)
+    {
+        DM_MUTEX_SCOPED_LOCK(reader->m_Mutex);
+        *num_read = reader->m_NumRead;
+        *read_time = reader->m_ReadTime;
+    }
+}
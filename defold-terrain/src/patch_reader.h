@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+namespace dmTerrain
+{
+    // Reads the heightmaps of the patches from file on a separate thread, so that the terrain thread can build
+    // the vertices of one patch, while the heights of the next patches are read.
+    // The patch m_ReadState goes from PRS_READING to PRS_READ (or PRS_FAILED) when the heightmap is ready.
+    // Without a thread (use_thread is false, or it can't be created), the heightmaps are read directly in PatchReader_Request()
+
+    typedef struct PatchReader* HPatchReader;
+
+    HPatchReader PatchReader_New(const struct HeightmapLoader* loader, void* loader_ctx, uint32_t max_requests, bool use_thread);
+    // Waits for the current read to finish
+    void         PatchReader_Delete(HPatchReader reader);
+
+    // Returns false if there are too many pending reads. Called from the terrain thread
+    bool         PatchReader_Request(HPatchReader reader, struct TerrainPatch* patch);
+
+    // Totals, time in microseconds
+    void         PatchReader_GetStats(HPatchReader reader, uint32_t* num_read, uint64_t* read_time);
+}
@@ -1,11 +1,15 @@
 #include <assert.h>
+#include <float.h>
 #include <dmsdk/dlib/math.h>
 #include <dmsdk/dlib/time.h>
 #include "terrain_private.h"
 #include "loader_file.h"
+#include "loader_tiles.h"
+#include "patch_reader.h"
 #include "terrain.h"
 #include "noise.h"
 #include "rng.h"
+#include "worker_pool.h"
 
 namespace dmTerrain
 {
@@ -14,20 +18,33 @@ static const dmhash_t VERTEX_STREAM_NAME_POSITION = dmHashString64("position");
 static const dmhash_t VERTEX_STREAM_NAME_NORMAL = dmHashString64("normal");
 static const dmhash_t VERTEX_STREAM_NAME_TEXCOORD = dmHashString64("texcoord");
 static const dmhash_t VERTEX_STREAM_NAME_COLOR = dmHashString64("color");
+static const dmhash_t VERTEX_STREAM_NAME_INDEX = dmHashString64("indices");
 
-static float HEIGHT_SCALE = 256.0f;
+static const float DEFAULT_HEIGHT_SCALE = 256.0f;
+static float HEIGHT_SCALE = DEFAULT_HEIGHT_SCALE; // May be set by the heightmap file
 static float UNSIGNED_TO_HEIGHT_FACTOR = HEIGHT_SCALE / 65535.0f;
 
-int PATCH_SIZES[NUM_LOD_LEVELS];
+static int PATCH_SIZES[MAX_LOD_LEVELS];
+
+// The min/max height pyramid of a patch is a full quad tree, where each leaf covers 4x4 grid cells.
+// With two uint16 per node, it is less than 1/5 of the size of the heightmap
+static const int PYRAMID_LEAF_SIZE = 4;
+static const int PYRAMID_TILE_LEVEL = 3; // The level with PATCH_NUM_TILES x PATCH_NUM_TILES nodes
 
 static void TerrainThread(void* ctx);
-static void UpdatePatches(HTerrain terrain, Vector3 camera_pos);
+static bool UpdatePatches(HTerrain terrain);
 
 int GetPatchSize(int lod)
 {
     return PATCH_SIZES[lod];
 }
 
+// All lods have the same number of vertices, so the coarser lods are sampled at a larger stride
+int GetPatchStep(int lod)
+{
+    return PATCH_SIZES[lod] / PATCH_SIZES[0];
+}
+
 void WorldToPatchCoord(const Vector3& pos, uint32_t lod, int xz[2])
 {
     float size = GetPatchSize(lod);
@@ -41,71 +58,200 @@ Vector3 PatchToWorldCoord(int xz[2], uint32_t lod)
     return Vector3(xz[0] * size, 0, xz[1] * size);
 }
 
+// Coords are relative the camera patch
+static bool IsInRing(int radius, bool circular, int x, int z)
+{
+    if (dmMath::Abs(x) > radius || dmMath::Abs(z) > radius)
+        return false;
+    // Within a circle of radius + 0.5 patches
+    return !circular || (x * x + z * z) <= radius * radius + radius;
+}
 
-// https://stackoverflow.com/a/34960913/468516
-// hartmann/gribbs
-// void extract_planes_from_projmat(
-//         const float mat[4][4],
-//         float left[4], float right[4], float top[4], float bottom[4],
-//         float near[4], float far[4])
-// {
-//     for (int i = 4; i--; ) left[i]      = mat[i][3] + mat[i][0];
-//     for (int i = 4; i--; ) right[i]     = mat[i][3] - mat[i][0];
-//     for (int i = 4; i--; ) bottom[i]    = mat[i][3] + mat[i][1];
-//     for (int i = 4; i--; ) top[i]       = mat[i][3] - mat[i][1];
-//     for (int i = 4; i--; ) near[i]      = mat[i][3] + mat[i][2];
-//     for (int i = 4; i--; ) far[i]       = mat[i][3] - mat[i][2];
-// }
+static bool IsInRing(HTerrain terrain, int x, int z)
+{
+    return IsInRing(terrain->m_RingRadius, terrain->m_CircularRing, x, z);
+}
+
+// Coords are relative the camera patch. Row-major, starting at (-radius, -radius)
+static int ToIndex(HTerrain terrain, int x, int z)
+{
+    int radius = terrain->m_RingRadius;
+    return (x + radius) + (2 * radius + 1) * (z + radius);
+}
+
+static void ToXZ(HTerrain terrain, int idx, int *out_x, int *out_z)
+{
+    int radius = terrain->m_RingRadius;
+    *out_x = idx % (2 * radius + 1) - radius;
+    *out_z = idx / (2 * radius + 1) - radius;
+}
+
+static uint32_t GetNumRingSlots(HTerrain terrain)
+{
+    int width = 2 * terrain->m_RingRadius + 1;
+    return width * width;
+}
 
-static inline void SetVertex(const Vector3& p, const Vector3& n, const uint8_t* c,
-                            float* positions, float* normals, uint8_t* colors)
+// https://stackoverflow.com/a/34960913/468516
+// Gribb/Hartmann: The planes are the sum/difference of the fourth row and the other rows.
+// The plane normals point inwards
+static void ExtractFrustumPlanes(const Matrix4& view_proj, Vector4 planes[6])
 {
-    positions[0] = p.getX();
-    positions[1] = p.getY();
-    positions[2] = p.getZ();
+    Vector4 r0 = view_proj.getRow(0);
+    Vector4 r1 = view_proj.getRow(1);
+    Vector4 r2 = view_proj.getRow(2);
+    Vector4 r3 = view_proj.getRow(3);
+    planes[0] = r3 + r0; // left
+    planes[1] = r3 - r0; // right
+    planes[2] = r3 + r1; // bottom
+    planes[3] = r3 - r1; // top
+    planes[4] = r3 + r2; // near
+    planes[5] = r3 - r2; // far
+}
 
-    normals[0] = n.getX();
-    normals[1] = n.getY();
-    normals[2] = n.getZ();
+enum FrustumResult
+{
+    FRUSTUM_OUTSIDE,
+    FRUSTUM_INTERSECTS,
+    FRUSTUM_INSIDE,
+};
 
-    colors[0] = c[0];
-    colors[1] = c[1];
-    colors[2] = c[2];
+static FrustumResult ClassifyAABB(const Vector4 planes[6], const Vector3& aabb_min, const Vector3& aabb_max)
+{
+    FrustumResult result = FRUSTUM_INSIDE;
+    for (int i = 0; i < 6; ++i)
+    {
+        const Vector4& plane = planes[i];
+        // The corner furthest along the plane normal
+        Vector3 p(plane.getX() >= 0.0f ? aabb_max.getX() : aabb_min.getX(),
+                  plane.getY() >= 0.0f ? aabb_max.getY() : aabb_min.getY(),
+                  plane.getZ() >= 0.0f ? aabb_max.getZ() : aabb_min.getZ());
+        if (dot(plane.getXYZ(), p) + plane.getW() < 0.0f)
+            return FRUSTUM_OUTSIDE;
+
+        // The opposite corner
+        Vector3 n(plane.getX() >= 0.0f ? aabb_min.getX() : aabb_max.getX(),
+                  plane.getY() >= 0.0f ? aabb_min.getY() : aabb_max.getY(),
+                  plane.getZ() >= 0.0f ? aabb_min.getZ() : aabb_max.getZ());
+        if (dot(plane.getXYZ(), n) + plane.getW() < 0.0f)
+            result = FRUSTUM_INTERSECTS;
+    }
+    return result;
 }
 
-static void GetStreams(dmBuffer::HBuffer buffer,
-                float*& positions, uint32_t& positions_stride,
-                float*& normals, uint32_t& normals_stride,
-                uint8_t*& colors, uint32_t& colors_stride)
+
+static inline float Clampf(float a, float b, float v)
 {
+    return v < a ? a : (v > b ? b : v);
+}
 
-    void* out_bytes = 0;
-    uint32_t out_size = 0;
-    dmBuffer::GetBytes(buffer, &out_bytes, &out_size);
-    //printf("Buffer is %u bytes (%u mb)\n", out_size, out_size/(1024*1024));
+static inline int Clampi(int a, int b, int v)
+{
+    return v < a ? a : (v > b ? b : v);
+}
 
-    uint32_t positions_count; uint32_t positions_components;
-    uint32_t normals_count; uint32_t normals_components;
-    uint32_t colors_count; uint32_t colors_components;
+// The vertex streams of a patch buffer (see CreateBuffer()).
+// The stride is in elements of the stream type
+struct VertexStreams
+{
+    float*      m_Positions;        // float32 x 3
+    float*      m_Normals;          // float32 x 3
+    uint8_t*    m_Colors;           // uint8 x 3
+    uint16_t*   m_PackedPositions;  // Compact: uint16 x 4 (grid x, quantized height, grid z, skirt depth in grid steps)
+    int8_t*     m_PackedNormals;    // Compact: int8 x 2, octahedral encoded
+    uint32_t    m_PositionsStride;
+    uint32_t    m_NormalsStride;
+    uint32_t    m_ColorsStride;
+};
 
-    dmBuffer::Result r = dmBuffer::GetStream(buffer, VERTEX_STREAM_NAME_POSITION, (void**)&positions, &positions_count, &positions_components, &positions_stride);
+static bool GetStream(dmBuffer::HBuffer buffer, dmhash_t name, void** data, uint32_t* stride)
+{
+    uint32_t count, components;
+    dmBuffer::Result r = dmBuffer::GetStream(buffer, name, data, &count, &components, stride);
     if (r != dmBuffer::RESULT_OK)
     {
-        dmLogError("Failed to get stream '%s': %s (%d)", dmHashReverseSafe64(VERTEX_STREAM_NAME_NORMAL), dmBuffer::GetResultString(r), r);
-        return;
+        dmLogError("Failed to get stream '%s': %s (%d)", dmHashReverseSafe64(name), dmBuffer::GetResultString(r), r);
+        return false;
     }
-    r = dmBuffer::GetStream(buffer, VERTEX_STREAM_NAME_NORMAL, (void**)&normals, &normals_count, &normals_components, &normals_stride);
-    if (r != dmBuffer::RESULT_OK)
+    return true;
+}
+
+static bool GetStreams(dmBuffer::HBuffer buffer, bool compact, VertexStreams* streams)
+{
+    memset(streams, 0, sizeof(*streams));
+    if (compact)
     {
-        dmLogError("Failed to get stream '%s': %s (%d)", dmHashReverseSafe64(VERTEX_STREAM_NAME_NORMAL), dmBuffer::GetResultString(r), r);
-        return;
+        return GetStream(buffer, VERTEX_STREAM_NAME_POSITION, (void**)&streams->m_PackedPositions, &streams->m_PositionsStride) &&
+               GetStream(buffer, VERTEX_STREAM_NAME_NORMAL, (void**)&streams->m_PackedNormals, &streams->m_NormalsStride);
     }
-    r = dmBuffer::GetStream(buffer, VERTEX_STREAM_NAME_COLOR, (void**)&colors, &colors_count, &colors_components, &colors_stride);
-    if (r != dmBuffer::RESULT_OK)
+    return GetStream(buffer, VERTEX_STREAM_NAME_POSITION, (void**)&streams->m_Positions, &streams->m_PositionsStride) &&
+           GetStream(buffer, VERTEX_STREAM_NAME_NORMAL, (void**)&streams->m_Normals, &streams->m_NormalsStride) &&
+           GetStream(buffer, VERTEX_STREAM_NAME_COLOR, (void**)&streams->m_Colors, &streams->m_ColorsStride);
+}
+
+static inline void SkipVertices(VertexStreams* streams, uint32_t count)
+{
+    if (streams->m_PackedPositions)
     {
-        dmLogError("Failed to get stream '%s': %s (%d)", dmHashReverseSafe64(VERTEX_STREAM_NAME_COLOR), dmBuffer::GetResultString(r), r);
-        return;
+        streams->m_PackedPositions += count * streams->m_PositionsStride;
+        streams->m_PackedNormals += count * streams->m_NormalsStride;
+    }
+    else
+    {
+        streams->m_Positions += count * streams->m_PositionsStride;
+        streams->m_Normals += count * streams->m_NormalsStride;
+        streams->m_Colors += count * streams->m_ColorsStride;
+    }
+}
+
+static inline int8_t PackSignedUnit(float v)
+{
+    return (int8_t)floorf(Clampf(-1.0f, 1.0f, v) * 127.0f + 0.5f);
+}
+
+// Projects the normal onto the octahedron |x| + |y| + |z| = 1, with the lower half (y < 0) folded over the upper half
+static inline void PackNormal(const Vector3& n, int8_t* out)
+{
+    float length = fabsf(n.getX()) + fabsf(n.getY()) + fabsf(n.getZ());
+    float u = n.getX() / length;
+    float v = n.getZ() / length;
+    if (n.getY() < 0.0f)
+    {
+        float folded_u = (1.0f - fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+        float folded_v = (1.0f - fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+        u = folded_u;
+        v = folded_v;
+    }
+    out[0] = PackSignedUnit(u);
+    out[1] = PackSignedUnit(v);
+}
+
+// Writes the vertex and moves to the next one.
+// Skirt vertices are moved down by the skirt depth
+static inline void WriteVertex(VertexStreams* streams, const Vector3& p, const Vector3& n, float skirt_depth)
+{
+    if (streams->m_PackedPositions)
+    {
+        // The grid coordinates and the skirt depth are the same for all patches, see WriteCompactGrid()
+        streams->m_PackedPositions[1] = (uint16_t)Clampf(0.0f, 65535.0f, p.getY() / UNSIGNED_TO_HEIGHT_FACTOR + 0.5f);
+        PackNormal(n, streams->m_PackedNormals);
+    }
+    else
+    {
+        float* positions = streams->m_Positions;
+        positions[0] = p.getX();
+        positions[1] = p.getY() - skirt_depth;
+        positions[2] = p.getZ();
+
+        float* normals = streams->m_Normals;
+        normals[0] = n.getX();
+        normals[1] = n.getY();
+        normals[2] = n.getZ();
+
+        uint8_t* colors = streams->m_Colors;
+        colors[0] = colors[1] = colors[2] = 255;
     }
+    SkipVertices(streams, 1);
 }
 
 // static void FillFlatBuffer(uint32_t patch_size, float* positions, uint32_t positions_stride,
@@ -151,25 +297,23 @@ static void GetStreams(dmBuffer::HBuffer buffer,
 //     }
 // }
 
-static float GenerateHeight(uint32_t seed, float x, float z)
-{
-    int num_octaves = 6;
-    float frequency = 1.5f;
-    float lacunarity = 1.2f;
-    float amplitude = 0.5f;
-    float gain = 0.5f;
-
-    return dmNoise::Fbm_2D(seed, x, z, frequency, lacunarity, amplitude, gain, num_octaves);
-}
+static const int   HEIGHT_NUM_OCTAVES = 6;
+static const float HEIGHT_FREQUENCY = 1.5f;
+static const float HEIGHT_LACUNARITY = 1.2f;
+static const float HEIGHT_AMPLITUDE = 0.5f;
+static const float HEIGHT_GAIN = 0.5f;
+static const uint32_t HEIGHT_GENERATOR_VERSION = 1; // Increase when the generated heights change, to invalidate the disk cache
+static const uint32_t PATCH_CACHE_MAX_ENTRIES = 4096;
 
-static inline float Clampf(float a, float b, float v)
+static float GenerateHeight(uint32_t seed, float x, float z)
 {
-    return v < a ? a : (v > b ? b : v);
+    return dmNoise::Fbm_2D(seed, x, z, HEIGHT_FREQUENCY, HEIGHT_LACUNARITY, HEIGHT_AMPLITUDE, HEIGHT_GAIN, HEIGHT_NUM_OCTAVES);
 }
 
-static inline int Clampi(int a, int b, int v)
+// Same as GenerateHeight() for each (x[i], z[i])
+static void GenerateHeights(uint32_t seed, const float* x, const float* z, uint32_t count, float* out)
 {
-    return v < a ? a : (v > b ? b : v);
+    dmNoise::Fbm_2D_Batch(seed, x, z, count, HEIGHT_FREQUENCY, HEIGHT_LACUNARITY, HEIGHT_AMPLITUDE, HEIGHT_GAIN, HEIGHT_NUM_OCTAVES, out);
 }
 
 // Coord range (-1,-1), (patch_size+1, patch_size+1)
@@ -177,7 +321,7 @@ static float GetHeight(TerrainPatch* patch, int x, int z)
 {
     x++;
     z++;
-    uint32_t patch_size = GetPatchSize(patch->m_Lod);
+    uint32_t patch_size = GetPatchSize(0);
     // x = Clampi(0, patch_size+1, x);
     // z = Clampi(0, patch_size+1, z);
 
@@ -189,16 +333,20 @@ static float GetHeight(TerrainPatch* patch, int x, int z)
     return h;
 }
 
+// The normal of the surface y = h(x, z), from the heights on either side of a point (-x, +x, -z, +z), step units away
+static Vector3 GetGradientNormal(float x_a, float x_b, float z_a, float z_b, float step)
+{
+    return normalize(Vector3(x_a - x_b, 2 * step, z_a - z_b));
+}
+
+// Used both for the vertices and the height queries, so that they agree
 static Vector3 GetNormal(TerrainPatch* patch, int x, int z)
 {
     float x_a = GetHeight(patch, x-1, z);
     float x_b = GetHeight(patch, x+1, z);
     float z_a = GetHeight(patch, x, z-1);
     float z_b = GetHeight(patch, x, z+1);
-
-    float xz_scale = 1.0f;
-    Vector3 n(x_b - x_a, 2 * xz_scale, z_b - z_a);
-    return normalize(n);
+    return GetGradientNormal(x_a, x_b, z_a, z_b, GetPatchStep(patch->m_Lod));
 }
 
 struct TimerScope
@@ -215,171 +363,354 @@ struct TimerScope
     uint64_t m_TimeStart;
 };
 
-static bool GeneratePatchHeights(TerrainPatch* patch)
+static uint32_t GetNumHeights()
 {
-    TimerScope tscope(__FUNCTION__);
+    int size = GetPatchSize(0) + 3; // num vertices + an extra border in order to get correct normal values
+    return size * size;
+}
 
+// Generates the heightmap rows [row_begin, row_end). Row 0 is the border at z = -1
+// The scratch memory must fit 3 rows of floats
+static void GeneratePatchHeights(TerrainPatch* patch, uint32_t row_begin, uint32_t row_end, float* scratch)
+{
     uint32_t seed = patch->m_HeightSeed;
-    float wx = patch->m_XZ[0];
-    float wz = patch->m_XZ[1];
+
+    // The noise is sampled in lod 0 patch units, and coarser lods sample it with a larger stride
+    int step = GetPatchStep(patch->m_Lod);
+    float wx = patch->m_XZ[0] * step;
+    float wz = patch->m_XZ[1] * step;
 
     int patch_size = GetPatchSize(0);
 
     int num_verts = patch_size+1;
-    float oo_patch_size_f = 1.0f / patch_size;
+    float oo_patch_size_f = (float)step / patch_size;
 
     int size = num_verts+2; // we have an extra border in order to get correct normal values
-    if (patch->m_Heightmap == 0)
-        patch->m_Heightmap = new uint16_t[size * size];
-
-    patch->m_HeightMin = 65535;
-    patch->m_HeightMax = 0;
 
+    // The coordinates of one row, so we can generate the heights in batches
+    float* row_x = scratch;
+    float* row_z = row_x + size;
+    float* row_h = row_z + size;
 
     for (int x = -1; x < num_verts+1; ++x)
     {
-        for (int z = -1; z < num_verts+1; ++z)
-        {
-            float u = x * oo_patch_size_f;
-            float v = z * oo_patch_size_f;
-            float h = GenerateHeight(seed, wx + u, wz + v);
-            h = Clampf(0.0f, 1.0f, h);
+        float u = x * oo_patch_size_f;
+        row_x[x+1] = wx + u;
+    }
 
-            //printf("x/z %d %d  uv: %f %f   h: %f\n", x, z, u, v, h * HEIGHT_SCALE);
+    for (int z = (int)row_begin - 1; z < (int)row_end - 1; ++z)
+    {
+        float v = z * oo_patch_size_f;
+        for (int x = 0; x < size; ++x)
+            row_z[x] = wz + v;
 
-            // if (patch->m_XZ[0] == 0 && patch->m_XZ[1] == 0)
-            // {
-            //     h = 1.0f;
-            // }
-            // else if (patch->m_XZ[0] == -1 && patch->m_XZ[1] == 0)
-            // {
-            //     h = x / (float)(size-1);
-            // }
-            // else if (patch->m_XZ[0] == 1 && patch->m_XZ[1] == 0)
-            // {
-            //     h = 1.0f - x / (float)(size-1);
-            // }
-            // else if (patch->m_XZ[0] == 0 && patch->m_XZ[1] == -1)
-            // {
-            //     h = z / (float)(size-1);
-            // }
-            // else if (patch->m_XZ[0] == 0 && patch->m_XZ[1] == 1)
-            // {
-            //     h = 1.0f - z / (float)(size-1);
-            // }
+        GenerateHeights(seed, row_x, row_z, size, row_h);
+
+        uint16_t* heights = &patch->m_Heightmap[(z+1) * size];
+        for (int x = 0; x < size; ++x)
+        {
+            float h = Clampf(0.0f, 1.0f, row_h[x]);
+            heights[x] = (uint16_t)(h * 65535);
+        }
+    }
+}
+
+// Derived from the patch size, so that there is no state to keep in sync with PATCH_SIZES
+static int GetPyramidNumLevels()
+{
+    int num_levels = 1;
+    while ((PYRAMID_LEAF_SIZE << (num_levels - 1)) < GetPatchSize(0))
+        num_levels++;
+    return num_levels;
+}
 
+static uint32_t GetPyramidNumNodes()
+{
+    return ((1U << (2 * GetPyramidNumLevels())) - 1) / 3;
+}
 
-            uint16_t uh = (uint16_t)(h * 65535);
-            patch->m_Heightmap[(z+1) * size + (x+1)] = uh;
+// Level 0 is the root, and each level has 2x2 times more nodes than the previous one
+static uint32_t GetPyramidNodeIndex(int level, int x, int z)
+{
+    return ((1U << (2 * level)) - 1) / 3 + z * (1 << level) + x;
+}
 
-            //if (z == -1)
-            //    printf("height: %f  uh: %u   idx: %u  u/v: %f %f\n", h, uh, z * size + x, u, v);
+// Updates the min/max pyramid from the heightmap, for the leaves in [leaf_begin, leaf_end) and their parents.
+// The nodes share their edge vertices
+static void UpdatePatchHeightRange(TerrainPatch* patch, const int leaf_begin[2], const int leaf_end[2])
+{
+    int size = GetPatchSize(0) + 3;
+    uint16_t* pyramid = patch->m_HeightPyramid;
 
-            if (uh < patch->m_HeightMin)
-                patch->m_HeightMin = uh;
+    int leaf_level = GetPyramidNumLevels() - 1;
+    for (int lz = leaf_begin[1]; lz < leaf_end[1]; ++lz)
+    {
+        for (int lx = leaf_begin[0]; lx < leaf_end[0]; ++lx)
+        {
+            uint16_t height_min = 65535;
+            uint16_t height_max = 0;
+            for (int z = lz * PYRAMID_LEAF_SIZE; z <= (lz + 1) * PYRAMID_LEAF_SIZE; ++z)
+            {
+                // +1 to skip the border
+                const uint16_t* row = &patch->m_Heightmap[(z + 1) * size + lx * PYRAMID_LEAF_SIZE + 1];
+                for (int x = 0; x <= PYRAMID_LEAF_SIZE; ++x)
+                {
+                    uint16_t uh = row[x];
+                    if (uh < height_min)
+                        height_min = uh;
+                    if (uh > height_max)
+                        height_max = uh;
+                }
+            }
+            uint16_t* node = &pyramid[GetPyramidNodeIndex(leaf_level, lx, lz) * 2];
+            node[0] = height_min;
+            node[1] = height_max;
+        }
+    }
 
-            if (uh > patch->m_HeightMax)
-                patch->m_HeightMax = uh;
+    int begin[2] = { leaf_begin[0], leaf_begin[1] };
+    int end[2] = { leaf_end[0], leaf_end[1] };
+    for (int level = leaf_level - 1; level >= 0; --level)
+    {
+        begin[0] /= 2;
+        begin[1] /= 2;
+        end[0] = (end[0] + 1) / 2;
+        end[1] = (end[1] + 1) / 2;
+        for (int z = begin[1]; z < end[1]; ++z)
+        {
+            for (int x = begin[0]; x < end[0]; ++x)
+            {
+                const uint16_t* c00 = &pyramid[GetPyramidNodeIndex(level + 1, x * 2, z * 2) * 2];
+                const uint16_t* c10 = c00 + 2;
+                const uint16_t* c01 = &pyramid[GetPyramidNodeIndex(level + 1, x * 2, z * 2 + 1) * 2];
+                const uint16_t* c11 = c01 + 2;
+                uint16_t* node = &pyramid[GetPyramidNodeIndex(level, x, z) * 2];
+                node[0] = dmMath::Min(dmMath::Min(c00[0], c10[0]), dmMath::Min(c01[0], c11[0]));
+                node[1] = dmMath::Max(dmMath::Max(c00[1], c10[1]), dmMath::Max(c01[1], c11[1]));
+            }
         }
     }
 
-    //dmAtomicStore32(&patch->m_IsDataLoaded, 1);
+    patch->m_HeightMin = pyramid[0];
+    patch->m_HeightMax = pyramid[1];
+}
 
-    //printf("XZ: %d %d\n", patch->m_XZ[0], patch->m_XZ[1]);
-    //printf("HEIGHT min/max: %f %f\n", height_min, height_max);
-    return true;
+static void UpdatePatchHeightRange(TerrainPatch* patch)
+{
+    int num_leaves = 1 << (GetPyramidNumLevels() - 1);
+    int leaf_begin[2] = { 0, 0 };
+    int leaf_end[2] = { num_leaves, num_leaves };
+    UpdatePatchHeightRange(patch, leaf_begin, leaf_end);
 }
 
-static bool GenerateVertexData(TerrainPatch* patch)
+// The world space bounds of a pyramid node
+static void GetPyramidNodeAABB(TerrainPatch* patch, int level, int x, int z, float skirt_depth, Vector3* aabb_min, Vector3* aabb_max)
 {
-    TimerScope tscope(__FUNCTION__);
+    float node_size = (float)GetPatchSize(patch->m_Lod) / (1 << level);
+    const uint16_t* node = &patch->m_HeightPyramid[GetPyramidNodeIndex(level, x, z) * 2];
+    const Vector3& pos = patch->m_Position;
+    *aabb_min = Vector3(pos.getX() + x * node_size, node[0] * UNSIGNED_TO_HEIGHT_FACTOR - skirt_depth, pos.getZ() + z * node_size);
+    *aabb_max = Vector3(aabb_min->getX() + node_size, node[1] * UNSIGNED_TO_HEIGHT_FACTOR, aabb_min->getZ() + node_size);
+}
+
+static const float SKIRT_DEPTH = 4.0f; // In vertex steps
+
+// Edges next to a coarser lod are stitched: the odd vertices are placed on the line between the even vertices,
+// so that they match the edge of the coarser patch, and no T-junction cracks appear.
+static float GetStitchedHeight(TerrainPatch* patch, uint32_t x, uint32_t z, uint32_t coarser_edges)
+{
+    uint32_t patch_size = GetPatchSize(0);
+    if (coarser_edges)
+    {
+        bool stitch_x = (x & 1) && (((coarser_edges & (1 << EDGE_NORTH)) && z == 0) || ((coarser_edges & (1 << EDGE_SOUTH)) && z == patch_size));
+        bool stitch_z = (z & 1) && (((coarser_edges & (1 << EDGE_WEST)) && x == 0) || ((coarser_edges & (1 << EDGE_EAST)) && x == patch_size));
+        if (stitch_x)
+            return 0.5f * (GetHeight(patch, x - 1, z) + GetHeight(patch, x + 1, z));
+        if (stitch_z)
+            return 0.5f * (GetHeight(patch, x, z - 1) + GetHeight(patch, x, z + 1));
+    }
+    return GetHeight(patch, x, z);
+}
+
+static void GetGridVertex(TerrainPatch* patch, uint32_t x, uint32_t z, uint32_t coarser_edges, GridVertex* vertex)
+{
+    float step = GetPatchStep(patch->m_Lod);
+    vertex->m_Position = Vector3(x * step, GetStitchedHeight(patch, x, z, coarser_edges), z * step);
+    vertex->m_Normal = GetNormal(patch, x, z);
+}
+
+// Calculates the position and normal for the vertices [x_begin, x_end) in grid row z
+static void GenerateGridRow(TerrainPatch* patch, uint32_t z, uint32_t x_begin, uint32_t x_end, uint32_t coarser_edges, GridVertex* row)
+{
+    for (uint32_t x = x_begin; x < x_end; ++x)
+    {
+        GetGridVertex(patch, x, z, coarser_edges, &row[x - x_begin]);
+    }
+}
 
-    float* positions; uint32_t positions_stride;
-    float* normals; uint32_t normals_stride;
-    uint8_t* colors; uint32_t colors_stride;
-    GetStreams(patch->m_Buffer,
-                positions, positions_stride,
-                normals, normals_stride,
-                colors, colors_stride);
+// The grid coordinate of the i'th vertex along an edge.
+// The order is chosen so that the skirt triangles face outwards
+static void GetEdgeCoord(int edge, uint32_t i, uint32_t patch_size, uint32_t* x, uint32_t* z)
+{
+    switch(edge)
+    {
+    case EDGE_NORTH:    *x = i;                 *z = 0; break;
+    case EDGE_SOUTH:    *x = patch_size - i;    *z = patch_size; break;
+    case EDGE_WEST:     *x = 0;                 *z = patch_size - i; break;
+    default:            *x = patch_size;        *z = i; break;
+    }
+}
+
+// Number of rows (and columns) processed by GenerateVertexData()
+static uint32_t GetNumVertexRows(bool indexed)
+{
+    uint32_t patch_size = GetPatchSize(0);
+    return indexed ? patch_size + 1 : patch_size;
+}
 
+// Generates the columns [col_begin, col_end) of the vertex rows [row_begin, row_end)
+// For indexed buffers, a row is a row of grid vertices, otherwise it's a row of quads
+// The scratch memory must fit 2 rows of grid vertices
+static void GenerateVertexData(TerrainPatch* patch, bool indexed, uint32_t coarser_edges, uint32_t row_begin, uint32_t row_end,
+                                uint32_t col_begin, uint32_t col_end, GridVertex* scratch)
+{
+    VertexStreams streams;
+    if (!GetStreams(patch->m_Buffer, patch->m_CompactVertices, &streams))
+        return;
 
     uint32_t patch_size = GetPatchSize(0);
-    float oo_patch_size_f = 1.0f / patch_size;
-    uint32_t step_size = 1;
-    float wx = patch->m_XZ[0];
-    float wz = patch->m_XZ[1];
+    uint32_t num_verts = patch_size + 1;
+
+    uint32_t first_vertex = indexed ? row_begin * num_verts + col_begin : (row_begin * patch_size + col_begin) * 2 * 3;
+    SkipVertices(&streams, first_vertex);
+
+    // The number of vertices to skip at the end of each row
+    uint32_t row_skip = indexed ? num_verts - (col_end - col_begin) : (patch_size - (col_end - col_begin)) * 2 * 3;
 
-    //printf("******************************************\n");
-    //printf("XZ: %d %d  patch_size: %u\n", patch->m_XZ[0], patch->m_XZ[1], patch_size);
+    if (indexed)
+    {
+        // Each grid vertex is written once, row by row. The triangles are described by the shared index buffer.
+        GridVertex* row = scratch;
+        for (uint32_t z = row_begin; z < row_end; ++z)
+        {
+            GenerateGridRow(patch, z, col_begin, col_end, coarser_edges, row);
+            for (uint32_t x = 0; x < col_end - col_begin; ++x)
+            {
+                WriteVertex(&streams, row[x].m_Position, row[x].m_Normal, 0.0f);
+            }
+            SkipVertices(&streams, row_skip);
+        }
+        return;
+    }
 
-    uint32_t world_size = 65536;
+    // We keep two rows of vertices, so that each vertex is only calculated once
+    GridVertex* rows = scratch;
+    GridVertex* row0 = rows;
+    GridVertex* row1 = rows + num_verts;
 
-    float scale = 1;
-    for (uint32_t x = 0; x <= patch_size-1; ++x)
+    GenerateGridRow(patch, row_begin, col_begin, col_end + 1, coarser_edges, row0);
+    for (uint32_t z = row_begin; z < row_end; ++z)
     {
-        for (uint32_t z = 0; z <= patch_size-1; ++z)
+        GenerateGridRow(patch, z + 1, col_begin, col_end + 1, coarser_edges, row1);
+
+        for (uint32_t x = 0; x < col_end - col_begin; ++x)
         {
-            uint32_t x0 = x;
-            uint32_t x1 = x + step_size;
-            uint32_t z0 = z;
-            uint32_t z1 = z + step_size;
+            const GridVertex& v0 = row0[x];     // (x,   z)
+            const GridVertex& v1 = row1[x];     // (x,   z+1)
+            const GridVertex& v2 = row1[x + 1]; // (x+1, z+1)
+            const GridVertex& v3 = row0[x + 1]; // (x+1, z)
+
+            WriteVertex(&streams, v0.m_Position, v0.m_Normal, 0.0f);
+            WriteVertex(&streams, v1.m_Position, v1.m_Normal, 0.0f);
+            WriteVertex(&streams, v2.m_Position, v2.m_Normal, 0.0f);
+
+            WriteVertex(&streams, v2.m_Position, v2.m_Normal, 0.0f);
+            WriteVertex(&streams, v3.m_Position, v3.m_Normal, 0.0f);
+            WriteVertex(&streams, v0.m_Position, v0.m_Normal, 0.0f);
+        }
+        SkipVertices(&streams, row_skip);
 
-            float u0 = x * oo_patch_size_f;
-            float u1 = (x+1) * oo_patch_size_f;
-            float v0 = z * oo_patch_size_f;
-            float v1 = (z+1) * oo_patch_size_f;
+        GridVertex* tmp = row0;
+        row0 = row1;
+        row1 = tmp;
+    }
+}
 
-            //printf("uv: %f %f  %f %f\n", u0, v0, u1, v1);
+// Each patch has a skirt along each edge, hanging down from the edge vertices.
+// It hides any cracks between patches of different lods
+static void GenerateSkirts(TerrainPatch* patch, bool indexed, uint32_t coarser_edges)
+{
+    VertexStreams streams;
+    if (!GetStreams(patch->m_Buffer, patch->m_CompactVertices, &streams))
+        return;
 
-            float h0 = GetHeight(patch, x,     z);
-            float h1 = GetHeight(patch, x,     z + 1);
-            float h2 = GetHeight(patch, x + 1, z + 1);
-            float h3 = GetHeight(patch, x + 1, z);
+    uint32_t patch_size = GetPatchSize(0);
+    uint32_t num_verts = patch_size + 1;
 
-            Vector3 p0 = Vector3(x0, h0, z0) * scale;
-            Vector3 p1 = Vector3(x0, h1, z1) * scale;
-            Vector3 p2 = Vector3(x1, h2, z1) * scale;
-            Vector3 p3 = Vector3(x1, h3, z0) * scale;
+    // The skirt vertices are stored after the grid vertices
+    uint32_t first_vertex = indexed ? num_verts * num_verts : patch_size * patch_size * 2 * 3;
+    SkipVertices(&streams, first_vertex);
 
-            Vector3 n0 = GetNormal(patch, x,     z);
-            Vector3 n1 = GetNormal(patch, x,     z + 1);
-            Vector3 n2 = GetNormal(patch, x + 1, z + 1);
-            Vector3 n3 = GetNormal(patch, x + 1, z);
+    float depth = GetPatchStep(patch->m_Lod) * SKIRT_DEPTH;
 
-            uint8_t col0[3] = {255,255,255};
-            uint8_t col1[3] = {255,255,255};
-            uint8_t col2[3] = {255,255,255};
-            uint8_t col3[3] = {255,255,255};
+    for (int edge = 0; edge < NUM_EDGES; ++edge)
+    {
+        uint32_t x, z;
+        GridVertex a, b;
+        GetEdgeCoord(edge, 0, patch_size, &x, &z);
+        GetGridVertex(patch, x, z, coarser_edges, &a);
 
-            #define INCREMENT_STRIDE() positions += positions_stride; normals += normals_stride; colors += colors_stride;
+        if (indexed)
+        {
+            // Only the bottom vertices are needed, the top vertices are the grid vertices
+            WriteVertex(&streams, a.m_Position, a.m_Normal, depth);
+        }
 
-            SetVertex(p0, n0, col0, positions, normals, colors); INCREMENT_STRIDE();
-            SetVertex(p1, n1, col1, positions, normals, colors); INCREMENT_STRIDE();
-            SetVertex(p2, n2, col2, positions, normals, colors); INCREMENT_STRIDE();
+        for (uint32_t i = 1; i < num_verts; ++i)
+        {
+            GetEdgeCoord(edge, i, patch_size, &x, &z);
+            GetGridVertex(patch, x, z, coarser_edges, &b);
 
-            SetVertex(p2, n2, col2, positions, normals, colors); INCREMENT_STRIDE();
-            SetVertex(p3, n3, col3, positions, normals, colors); INCREMENT_STRIDE();
-            SetVertex(p0, n0, col0, positions, normals, colors); INCREMENT_STRIDE();
+            if (indexed)
+            {
+                WriteVertex(&streams, b.m_Position, b.m_Normal, depth);
+            }
+            else
+            {
+                WriteVertex(&streams, a.m_Position, a.m_Normal, 0.0f);
+                WriteVertex(&streams, b.m_Position, b.m_Normal, 0.0f);
+                WriteVertex(&streams, b.m_Position, b.m_Normal, depth);
 
-            #undef INCREMENT_STRIDE
+                WriteVertex(&streams, a.m_Position, a.m_Normal, 0.0f);
+                WriteVertex(&streams, b.m_Position, b.m_Normal, depth);
+                WriteVertex(&streams, a.m_Position, a.m_Normal, depth);
+            }
+            a = b;
         }
     }
-
-    return true;
 }
 
-static void CreateBuffer(dmBuffer::HBuffer* buffer, uint32_t num_steps)
+static void CreateBuffer(dmBuffer::HBuffer* buffer, uint32_t num_steps, bool indexed, bool compact)
 {
+    // 27 bytes per vertex
     dmBuffer::StreamDeclaration streams_decl[] = {
         {VERTEX_STREAM_NAME_POSITION, dmBuffer::VALUE_TYPE_FLOAT32, 3},
         {VERTEX_STREAM_NAME_NORMAL, dmBuffer::VALUE_TYPE_FLOAT32, 3},
         {VERTEX_STREAM_NAME_COLOR, dmBuffer::VALUE_TYPE_UINT8, 3},
     };
+    // 10 bytes per vertex (see terrain_compact.vp), of which 4 are written per patch
+    dmBuffer::StreamDeclaration compact_streams_decl[] = {
+        {VERTEX_STREAM_NAME_POSITION, dmBuffer::VALUE_TYPE_UINT16, 4},
+        {VERTEX_STREAM_NAME_NORMAL, dmBuffer::VALUE_TYPE_INT8, 2},
+    };
 
-    // num triangles: num_quads * num_triangles per quad * num vertices per triangle
-    uint32_t element_count = (num_steps*num_steps) * 2 * 3;
+    // indexed: one vertex per grid point, and one skirt vertex per edge vertex
+    // otherwise: (num_quads + num skirt quads) * num triangles per quad * num vertices per triangle
+    uint32_t element_count = indexed ? (num_steps+1)*(num_steps+1) + NUM_EDGES*(num_steps+1)
+                                     : (num_steps*num_steps + NUM_EDGES*num_steps) * 2 * 3;
 
-    dmBuffer::Result r = dmBuffer::Create(element_count, streams_decl, sizeof(streams_decl)/sizeof(dmBuffer::StreamDeclaration), buffer);
+    dmBuffer::Result r = compact ? dmBuffer::Create(element_count, compact_streams_decl, sizeof(compact_streams_decl)/sizeof(dmBuffer::StreamDeclaration), buffer)
+                                 : dmBuffer::Create(element_count, streams_decl, sizeof(streams_decl)/sizeof(dmBuffer::StreamDeclaration), buffer);
     if (r != dmBuffer::RESULT_OK)
     {
         dmLogError("Failed to create buffer: %s (%d)", dmBuffer::GetResultString(r), r);
@@ -387,6 +718,138 @@ static void CreateBuffer(dmBuffer::HBuffer* buffer, uint32_t num_steps)
     }
 }
 
+// The compact vertices store the grid coordinates and the skirt depth in grid steps, which are the same for all patches
+// (and lods). They're written once, so that generating a patch only writes the heights and the normals.
+// The vertex order must match GenerateVertexData() and GenerateSkirts()
+// The grid is still stored in every buffer: a mesh component draws a single vertex buffer, so a grid shared per lod
+// can't be bound next to the patch streams. Sampling the heights from a texture instead would need vertex texture
+// fetch, which GLES2/WebGL1 devices aren't required to support (see InitParams::m_CompactVertices for the saving).
+static void WriteCompactGrid(dmBuffer::HBuffer buffer, bool indexed)
+{
+    VertexStreams streams;
+    if (!GetStreams(buffer, true, &streams))
+        return;
+
+    uint16_t* positions = streams.m_PackedPositions;
+    uint32_t stride = streams.m_PositionsStride;
+    uint32_t patch_size = GetPatchSize(0);
+    uint32_t num_verts = patch_size + 1;
+    uint16_t skirt = (uint16_t)SKIRT_DEPTH;
+
+    #define WRITE_GRID(X, Z, SKIRT) positions[0] = (uint16_t)(X); positions[1] = 0; positions[2] = (uint16_t)(Z); positions[3] = (SKIRT); positions += stride;
+
+    for (uint32_t z = 0; z < (indexed ? num_verts : patch_size); ++z)
+    {
+        for (uint32_t x = 0; x < (indexed ? num_verts : patch_size); ++x)
+        {
+            if (indexed)
+            {
+                WRITE_GRID(x, z, 0);
+                continue;
+            }
+            WRITE_GRID(x, z, 0); WRITE_GRID(x, z+1, 0); WRITE_GRID(x+1, z+1, 0);
+            WRITE_GRID(x+1, z+1, 0); WRITE_GRID(x+1, z, 0); WRITE_GRID(x, z, 0);
+        }
+    }
+
+    for (int edge = 0; edge < NUM_EDGES; ++edge)
+    {
+        uint32_t ax, az, bx, bz;
+        GetEdgeCoord(edge, 0, patch_size, &ax, &az);
+        if (indexed)
+        {
+            WRITE_GRID(ax, az, skirt);
+        }
+
+        for (uint32_t i = 1; i < num_verts; ++i)
+        {
+            GetEdgeCoord(edge, i, patch_size, &bx, &bz);
+            if (indexed)
+            {
+                WRITE_GRID(bx, bz, skirt);
+            }
+            else
+            {
+                WRITE_GRID(ax, az, 0); WRITE_GRID(bx, bz, 0); WRITE_GRID(bx, bz, skirt);
+                WRITE_GRID(ax, az, 0); WRITE_GRID(bx, bz, skirt); WRITE_GRID(ax, az, skirt);
+            }
+            ax = bx;
+            az = bz;
+        }
+    }
+
+    #undef WRITE_GRID
+}
+
+// The index buffer is the same for all patches, since they share the same grid layout
+static void CreateIndexBuffer(dmBuffer::HBuffer* buffer, uint32_t num_steps)
+{
+    dmBuffer::StreamDeclaration streams_decl[] = {
+        {VERTEX_STREAM_NAME_INDEX, dmBuffer::VALUE_TYPE_UINT32, 1},
+    };
+
+    uint32_t element_count = (num_steps*num_steps + NUM_EDGES*num_steps) * 2 * 3;
+
+    dmBuffer::Result r = dmBuffer::Create(element_count, streams_decl, sizeof(streams_decl)/sizeof(dmBuffer::StreamDeclaration), buffer);
+    if (r != dmBuffer::RESULT_OK)
+    {
+        dmLogError("Failed to create index buffer: %s (%d)", dmBuffer::GetResultString(r), r);
+        return;
+    }
+
+    uint32_t* indices; uint32_t count; uint32_t components; uint32_t stride;
+    r = dmBuffer::GetStream(*buffer, VERTEX_STREAM_NAME_INDEX, (void**)&indices, &count, &components, &stride);
+    if (r != dmBuffer::RESULT_OK)
+    {
+        dmLogError("Failed to get stream '%s': %s (%d)", dmHashReverseSafe64(VERTEX_STREAM_NAME_INDEX), dmBuffer::GetResultString(r), r);
+        return;
+    }
+
+    uint32_t num_verts = num_steps + 1;
+    for (uint32_t z = 0; z < num_steps; ++z)
+    {
+        for (uint32_t x = 0; x < num_steps; ++x)
+        {
+            uint32_t i0 = z * num_verts + x;            // (x,   z)
+            uint32_t i1 = (z + 1) * num_verts + x;      // (x,   z+1)
+            uint32_t i2 = (z + 1) * num_verts + x + 1;  // (x+1, z+1)
+            uint32_t i3 = z * num_verts + x + 1;        // (x+1, z)
+
+            indices[0] = i0; indices += stride;
+            indices[0] = i1; indices += stride;
+            indices[0] = i2; indices += stride;
+
+            indices[0] = i2; indices += stride;
+            indices[0] = i3; indices += stride;
+            indices[0] = i0; indices += stride;
+        }
+    }
+
+    // The skirts, see GenerateSkirts()
+    uint32_t first_skirt_vertex = num_verts * num_verts;
+    for (uint32_t edge = 0; edge < NUM_EDGES; ++edge)
+    {
+        for (uint32_t i = 0; i < num_steps; ++i)
+        {
+            uint32_t x, z;
+            GetEdgeCoord(edge, i, num_steps, &x, &z);
+            uint32_t a = z * num_verts + x;
+            GetEdgeCoord(edge, i + 1, num_steps, &x, &z);
+            uint32_t b = z * num_verts + x;
+            uint32_t a_bottom = first_skirt_vertex + edge * num_verts + i;
+            uint32_t b_bottom = a_bottom + 1;
+
+            indices[0] = a; indices += stride;
+            indices[0] = b; indices += stride;
+            indices[0] = b_bottom; indices += stride;
+
+            indices[0] = a; indices += stride;
+            indices[0] = b_bottom; indices += stride;
+            indices[0] = a_bottom; indices += stride;
+        }
+    }
+}
+
 static void PatchSetState(TerrainPatch* patch, PatchState state)
 {
     if (state == PS_UNLOADED)
@@ -395,6 +858,7 @@ static void PatchSetState(TerrainPatch* patch, PatchState state)
     }
 
     dmAtomicStore32(&patch->m_DataState, 0);
+    dmAtomicStore32(&patch->m_ReadState, PRS_NONE);
     dmAtomicStore32(&patch->m_LuaCallback, 0);
     dmAtomicStore32(&patch->m_State, state);
 }
@@ -416,51 +880,133 @@ static void PatchUnload(HTerrain terrain, TerrainPatch* patch)
     printf("Unloading %d, %d  %p\n", patch->m_XZ[0], patch->m_XZ[1], patch);
 }
 
-// Return false when not finished. Return true when finished with this state
-static bool DoPatchLoad(HTerrain terrain, TerrainPatch* patch)
+static const uint32_t GENERATE_ROWS_PER_CHUNK = 16;
+
+struct GenerateContext
 {
-    (void)terrain;
+    HTerrain        m_Terrain;
+    TerrainPatch**  m_Patches;
+    uint32_t        m_RowsPerPatch;
+};
 
-    if (patch->m_Generate)
-    {
-        int data_state = dmAtomicGet32(&patch->m_DataState);
-        if (0 == data_state)
-        {
-            bool result = GeneratePatchHeights(patch);
-            if (result)
-                dmAtomicIncrement32(&patch->m_DataState);
-            return false;
-        }
-        else if (1 == data_state)
-        {
-            bool result = GenerateVertexData(patch);
-            if (result)
-                dmAtomicIncrement32(&patch->m_DataState);
-            return false;
-        }
-        return true;
-    }
+// The scratch memory of a worker thread (see dmWorkerPool::RangeFunc)
+static GridVertex* GetScratch(HTerrain terrain, uint32_t worker_index)
+{
+    return terrain->m_Scratch + worker_index * terrain->m_ScratchSizePerWorker;
+}
 
-    dmBuffer::Result r = dmBuffer::ValidateBuffer(patch->m_Buffer);
-    if (r != dmBuffer::RESULT_OK)
+// Calls fn(ctx, worker_index, patch, row_begin, row_end) for the rows in [begin, end) of the flattened list of patch rows
+template<typename Fn>
+static void ForEachPatchRows(GenerateContext* ctx, uint32_t worker_index, uint32_t begin, uint32_t end, Fn fn)
+{
+    while (begin < end)
     {
-        dmLogError("Failed to validate buffer: %s (%d)", dmBuffer::GetResultString(r), r);
-        return true;
+        uint32_t patch_index = begin / ctx->m_RowsPerPatch;
+        uint32_t row_begin = begin % ctx->m_RowsPerPatch;
+        uint32_t row_end = dmMath::Min(ctx->m_RowsPerPatch, row_begin + (end - begin));
+        fn(ctx, worker_index, ctx->m_Patches[patch_index], row_begin, row_end);
+        begin += row_end - row_begin;
     }
+}
 
-    return true;
+static void GenerateHeightsRows(GenerateContext* ctx, uint32_t worker_index, TerrainPatch* patch, uint32_t row_begin, uint32_t row_end)
+{
+    GeneratePatchHeights(patch, row_begin, row_end, (float*)GetScratch(ctx->m_Terrain, worker_index));
 }
 
-static bool DoPatchUnload(HTerrain terrain, TerrainPatch* patch)
+// The edges of the patch where the neighbor has a coarser lod
+static uint32_t GetCoarserEdges(HTerrain terrain, TerrainPatch* patch)
 {
-    int data_state = dmAtomicGet32(&patch->m_DataState);
+    TerrainPatchLod* patch_lod = &terrain->m_Terrain[patch->m_Lod];
+    const uint8_t* neighbor_lods = patch_lod->m_NeighborLods[patch - patch_lod->m_Patches];
+
+    uint32_t coarser_edges = 0;
+    for (int edge = 0; edge < NUM_EDGES; ++edge)
+    {
+        if (neighbor_lods[edge] > patch->m_Lod)
+            coarser_edges |= 1 << edge;
+    }
+    return coarser_edges;
+}
+
+static void GenerateVertexRows(GenerateContext* ctx, uint32_t worker_index, TerrainPatch* patch, uint32_t row_begin, uint32_t row_end)
+{
+    bool indexed = ctx->m_Terrain->m_Indexed;
+    GenerateVertexData(patch, indexed, GetCoarserEdges(ctx->m_Terrain, patch), row_begin, row_end, 0, GetNumVertexRows(indexed), GetScratch(ctx->m_Terrain, worker_index));
+}
+
+static void GenerateHeightsRange(void* _ctx, uint32_t worker_index, uint32_t begin, uint32_t end)
+{
+    ForEachPatchRows((GenerateContext*)_ctx, worker_index, begin, end, GenerateHeightsRows);
+}
+
+static void GenerateVertexRange(void* _ctx, uint32_t worker_index, uint32_t begin, uint32_t end)
+{
+    ForEachPatchRows((GenerateContext*)_ctx, worker_index, begin, end, GenerateVertexRows);
+}
+
+// Runs one generation stage for all the given patches.
+// The rows of all patches are split into chunks and processed in parallel by the worker pool.
+// Returns true if the patches are finished
+static bool GeneratePatches(HTerrain terrain, TerrainPatch** patches, uint32_t num_patches, int data_state)
+{
+    if (num_patches == 0)
+        return false;
+
+    GenerateContext ctx;
+    ctx.m_Terrain = terrain;
+    ctx.m_Patches = patches;
+
     if (0 == data_state)
     {
-        DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
+        TimerScope tscope("GeneratePatchHeights");
+
+        ctx.m_RowsPerPatch = GetPatchSize(0) + 3;
+        dmWorkerPool::ParallelFor(terrain->m_WorkerPool, num_patches * ctx.m_RowsPerPatch, GENERATE_ROWS_PER_CHUNK, GenerateHeightsRange, &ctx);
+
+        for (uint32_t i = 0; i < num_patches; ++i)
+            UpdatePatchHeightRange(patches[i]);
+    }
+    else if (1 == data_state)
+    {
+        TimerScope tscope("GenerateVertexData");
+
+        ctx.m_RowsPerPatch = GetNumVertexRows(terrain->m_Indexed);
+        dmWorkerPool::ParallelFor(terrain->m_WorkerPool, num_patches * ctx.m_RowsPerPatch, GENERATE_ROWS_PER_CHUNK, GenerateVertexRange, &ctx);
+
+        for (uint32_t i = 0; i < num_patches; ++i)
+            GenerateSkirts(patches[i], terrain->m_Indexed, GetCoarserEdges(terrain, patches[i]));
+    }
+
+    for (uint32_t i = 0; i < num_patches; ++i)
+        dmAtomicIncrement32(&patches[i]->m_DataState);
+
+    return data_state == 1;
+}
+
+// If the event isn't taken, the patch stays in PS_LOADING with its data, and is loaded again in the next pass
+static void PatchLoaded(HTerrain terrain, TerrainPatch* patch)
+{
+    DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
+    if (!terrain->m_Callback(TERRAIN_PATCH_SHOW, patch))
+        return;
+
+    // Not PatchSetState(), since the Lua callback may already have been invoked on the main thread
+    dmAtomicStore32(&patch->m_DataState, 0);
+    dmAtomicStore32(&patch->m_ReadState, PRS_NONE);
+    dmAtomicStore32(&patch->m_State, PS_LOADED);
+}
 
-        terrain->m_Callback(TERRAIN_PATCH_HIDE, patch);
+static bool DoPatchUnload(HTerrain terrain, TerrainPatch* patch)
+{
+    int data_state = dmAtomicGet32(&patch->m_DataState);
+    if (0 == data_state)
+    {
+        DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
 
-        dmAtomicIncrement32(&patch->m_DataState);
+        // If the event isn't taken, it's sent again in the next pass
+        if (terrain->m_Callback(TERRAIN_PATCH_HIDE, patch))
+            dmAtomicIncrement32(&patch->m_DataState);
         return false;
     }
 
@@ -471,7 +1017,15 @@ static bool DoPatchUnload(HTerrain terrain, TerrainPatch* patch)
 
 static void PatchDelete(TerrainPatch* patch)
 {
-    delete[] patch->m_Heightmap;
+    dmBuffer::Destroy(patch->m_Buffer);
+}
+
+static uint32_t GetBufferSize(dmBuffer::HBuffer buffer)
+{
+    void* bytes = 0;
+    uint32_t size = 0;
+    dmBuffer::GetBytes(buffer, &bytes, &size);
+    return size;
 }
 
 // // Coords in [-1,1] range (i.e. around the camera)
@@ -486,68 +1040,188 @@ static void PatchDelete(TerrainPatch* patch)
 //     patch_lod->m_PatchesOccupied[(z+1)*3 + (x+1)] = loaded;
 // }
 
+static const uint32_t PATCH_READ_AHEAD = 4; // The max number of heightmaps being read from file at a time
+
+static const HeightmapLoader RAW_FILE_LOADER = { RawFileLoader_Init, RawFileLoader_Exit, RawFileLoader_Load, RawFileLoader_GetHeight, 0 };
+static const HeightmapLoader TILE_FILE_LOADER = { TileFileLoader_Init, TileFileLoader_Exit, TileFileLoader_Load, TileFileLoader_GetHeight, TileFileLoader_GetHeightScale };
+
+static const HeightmapLoader* GetHeightmapLoader(const char* path)
+{
+    const char* ext = strrchr(path, '.');
+    if (ext && strcmp(ext, ".terrain") == 0)
+        return &TILE_FILE_LOADER;
+    return &RAW_FILE_LOADER;
+}
+
 HTerrain Create(const InitParams& params)
 {
     assert(params.m_Callback != 0);
 
+    int num_lod_levels = dmMath::Clamp(params.m_NumLodLevels, 1, (int)MAX_LOD_LEVELS);
+
     int base_size = params.m_BasePatchSize;
-    for (int lod = 0; lod < NUM_LOD_LEVELS; ++lod)
+    for (int lod = 0; lod < MAX_LOD_LEVELS; ++lod)
     {
         PATCH_SIZES[lod] = base_size;
         base_size *= 2;
     }
 
+    // The pyramid must reach down to the sub tile level
+    assert(params.m_BasePatchSize >= PYRAMID_LEAF_SIZE * (int)PATCH_NUM_TILES);
+
     HTerrain terrain = new TerrainWorld;
 
     terrain->m_Callback = params.m_Callback;
     terrain->m_View = params.m_View;
     terrain->m_Proj = params.m_Proj;
+    terrain->m_Indexed = params.m_Indexed;
+    terrain->m_NumLodLevels = num_lod_levels;
+    terrain->m_RingRadius = dmMath::Clamp(params.m_RingRadius, 1, MAX_RING_RADIUS);
+    terrain->m_CircularRing = params.m_CircularRing;
+    terrain->m_UnloadTime = 0;
+    terrain->m_UnloadMargin = dmMath::Max(params.m_UnloadMargin, 0.0f);
 
     uint32_t terrain_seed = 1234567;
     dmRng::Init(&terrain->m_Rng, terrain_seed);
+    terrain->m_HeightSeed = terrain_seed;
+
+    HEIGHT_SCALE = DEFAULT_HEIGHT_SCALE;
+    terrain->m_Loader = 0;
+    terrain->m_LoaderContext = 0;
+    if (params.m_HeightmapPath)
+    {
+        const HeightmapLoader* loader = GetHeightmapLoader(params.m_HeightmapPath);
+        terrain->m_LoaderContext = loader->m_Init(params.m_HeightmapPath);
+        if (terrain->m_LoaderContext)
+        {
+            terrain->m_Loader = loader;
+            float height_scale = loader->m_GetHeightScale ? loader->m_GetHeightScale(terrain->m_LoaderContext) : 0.0f;
+            if (height_scale > 0.0f)
+                HEIGHT_SCALE = height_scale;
+        }
+    }
+    terrain->m_PatchReader = 0;
+    if (terrain->m_Loader)
+        terrain->m_PatchReader = PatchReader_New(terrain->m_Loader, terrain->m_LoaderContext, PATCH_READ_AHEAD, !params.m_SingleThreaded);
+    UNSIGNED_TO_HEIGHT_FACTOR = HEIGHT_SCALE / 65535.0f;
 
     Vector3 camera_pos = (terrain->m_View.getCol(3) * -1).getXYZ();
+    terrain->m_CameraPos = camera_pos;
+    terrain->m_CameraDir = Vector3(0, 0, -1);
 
     // Number of steps to divide
     int num_divides = GetPatchSize(0);
 
+    memset(&terrain->m_Stats, 0, sizeof(terrain->m_Stats));
+
+    terrain->m_IndexBuffer = 0;
+    if (terrain->m_Indexed)
+        CreateIndexBuffer(&terrain->m_IndexBuffer, num_divides);
+
     // Initialize patches
-    for (int lod = 0, id = 0; lod < NUM_LOD_LEVELS; ++lod)
+    uint32_t num_total_patches = 0;
+    for (int lod = 0, id = 0; lod < terrain->m_NumLodLevels; ++lod)
     {
         TerrainPatchLod* patch_lod = &terrain->m_Terrain[lod];
 
         WorldToPatchCoord(camera_pos, lod, patch_lod->m_CameraXZ);
 
-        for (int x = -1, i = 0; x <= 1; ++x)
+        // One patch per slot in the ring
+        uint32_t num_patches = 0;
+        uint32_t num_slots = GetNumRingSlots(terrain);
+        for (uint32_t i = 0; i < num_slots; ++i)
         {
-            for (int z = -1; z <= 1; ++z, ++i, ++id)
-            {
-                //SetPatchOccupied(patch_lod, x, z, false);
+            int x, z;
+            ToXZ(terrain, i, &x, &z);
+            if (IsInRing(terrain, x, z))
+                ++num_patches;
+        }
+
+        num_patches += dmMath::Max(params.m_NumCachedPatches, 0);
+
+        patch_lod->m_NumPatches = num_patches;
+        num_total_patches += num_patches;
+        patch_lod->m_Patches = new TerrainPatch[num_patches];
+        patch_lod->m_NeighborLods = new uint8_t[num_patches][NUM_EDGES];
+        memset(patch_lod->m_NeighborLods, 0, num_patches * NUM_EDGES);
+        patch_lod->m_Unloaded = new UnloadedPatch[num_patches];
+        memset(patch_lod->m_Unloaded, 0, num_patches * sizeof(UnloadedPatch));
+        patch_lod->m_Resident = new TerrainPatch*[num_slots];
+        memset(patch_lod->m_Resident, 0, num_slots * sizeof(TerrainPatch*));
+        patch_lod->m_ResidentOrigin[0] = patch_lod->m_ResidentOrigin[1] = 0;
 
-                TerrainPatch* patch = &patch_lod->m_Patches[i];
-                memset(patch, 0, sizeof(*patch));
+        for (uint32_t i = 0; i < num_patches; ++i, ++id)
+        {
+            TerrainPatch* patch = &patch_lod->m_Patches[i];
+            memset(patch, 0, sizeof(*patch));
 
-                patch->m_Id = id; // debug only
-                patch->m_HeightSeed = terrain_seed; // duplicate, but makes it easier to access on threads
-                patch->m_Lod = lod;
-                patch->m_Generate = 1; // pass in option for this in the init function
+            patch->m_Id = id; // debug only
+            patch->m_HeightSeed = terrain_seed; // duplicate, but makes it easier to access on threads
+            patch->m_Lod = lod;
+            patch->m_Generate = terrain->m_Loader == 0;
 
-                CreateBuffer(&patch->m_Buffer, num_divides);
+            patch->m_CompactVertices = params.m_CompactVertices;
+            CreateBuffer(&patch->m_Buffer, num_divides, terrain->m_Indexed, patch->m_CompactVertices);
+            if (patch->m_CompactVertices)
+                WriteCompactGrid(patch->m_Buffer, terrain->m_Indexed);
+            terrain->m_Stats.m_VertexBufferBytes += GetBufferSize(patch->m_Buffer);
 
-                PatchSetState(patch, PS_UNLOADED);
+            PatchSetState(patch, PS_UNLOADED);
 
-                // dmRng::Init(&patch->m_Rng, dmRng::RandU32(&terrain->m_Rng));
-            }
+            // dmRng::Init(&patch->m_Rng, dmRng::RandU32(&terrain->m_Rng));
         }
     }
 
-    terrain->m_LoaderContext = 0;
-    //terrain->m_LoaderContext = RawFileLoader_Init("/Users/mawe/work/projects/users/mawe/defold-terrain/data/heightmap.r16");
+    // All memory used while streaming is allocated up front, so that no allocations are made after this point
+    uint32_t num_heights = GetNumHeights();
+    terrain->m_Heightmaps = new uint16_t[num_total_patches * num_heights];
+    uint32_t num_pyramid_values = GetPyramidNumNodes() * 2;
+    terrain->m_HeightPyramids = new uint16_t[num_total_patches * num_pyramid_values];
+    for (int lod = 0, i = 0; lod < terrain->m_NumLodLevels; ++lod)
+    {
+        TerrainPatchLod* patch_lod = &terrain->m_Terrain[lod];
+        for (uint32_t p = 0; p < patch_lod->m_NumPatches; ++p, ++i)
+        {
+            patch_lod->m_Patches[p].m_Heightmap = &terrain->m_Heightmaps[i * num_heights];
+            patch_lod->m_Patches[p].m_HeightPyramid = &terrain->m_HeightPyramids[i * num_pyramid_values];
+        }
+    }
+
+    // Each worker (and the terrain thread and the main thread) needs two rows of vertices, or three rows of heights
+    uint32_t num_workers = params.m_SingleThreaded ? 0 : dmMath::Clamp(params.m_NumWorkers, 0, MAX_WORKERS);
+    uint32_t scratch_vertices = 2 * (num_divides + 1);
+    uint32_t scratch_heights = (uint32_t)((3 * (num_divides + 3) * sizeof(float) + sizeof(GridVertex) - 1) / sizeof(GridVertex));
+    terrain->m_ScratchSizePerWorker = dmMath::Max(scratch_vertices, scratch_heights);
+    terrain->m_Scratch = new GridVertex[(num_workers + 2) * terrain->m_ScratchSizePerWorker];
+
+    terrain->m_Stats.m_NumPatches = num_total_patches;
+    terrain->m_Stats.m_HeightmapBytes = (uint64_t)num_total_patches * num_heights * sizeof(uint16_t);
+    terrain->m_Stats.m_HeightPyramidBytes = (uint64_t)num_total_patches * num_pyramid_values * sizeof(uint16_t);
+    terrain->m_Stats.m_ScratchBytes = (uint64_t)(num_workers + 2) * terrain->m_ScratchSizePerWorker * sizeof(GridVertex);
+    if (terrain->m_IndexBuffer)
+        terrain->m_Stats.m_IndexBufferBytes = GetBufferSize(terrain->m_IndexBuffer);
+
+    terrain->m_PatchCache = 0;
+    if (params.m_CachePath)
+        terrain->m_PatchCache = PatchCache_Init(params.m_CachePath, params.m_CacheMaxSize, PATCH_CACHE_MAX_ENTRIES, num_heights);
+
+    terrain->m_Jobs.SetCapacity(16);
+    TerrainJob job = { JOB_UPDATE, 0 }; // Load the initial patches
+    terrain->m_Jobs.Push(job);
 
     dmAtomicStore32(&terrain->m_ThreadActive, 1);
     terrain->m_ThreadMutex = dmMutex::New();
-    terrain->m_Thread = dmThread::New(TerrainThread, 0x80000, terrain, "terrain");
     terrain->m_ThreadCondition = dmConditionVariable::New();
+    terrain->m_WorkerPool = dmWorkerPool::New(num_workers);
+
+    terrain->m_SlicedPatch = 0;
+    terrain->m_SlicedStep = SLICE_READ_HEIGHTS;
+    terrain->m_SlicedRow = 0;
+    terrain->m_SliceDeadline = 0;
+    terrain->m_FrameBudget = dmMath::Max(params.m_FrameBudget, 0.0f);
+    terrain->m_Thread = 0;
+    if (!params.m_SingleThreaded)
+        terrain->m_Thread = dmThread::New(TerrainThread, 0x80000, terrain, "terrain");
 
     return terrain;
 }
@@ -555,9 +1229,6 @@ HTerrain Create(const InitParams& params)
 
 void Destroy(HTerrain terrain)
 {
-    if (terrain->m_LoaderContext)
-        RawFileLoader_Exit(terrain->m_LoaderContext);
-
     // Exit the thread
     dmAtomicStore32(&terrain->m_ThreadActive, 0);
 
@@ -566,120 +1237,566 @@ void Destroy(HTerrain terrain)
     dmMutex::Unlock(terrain->m_ThreadMutex);
 
     // wait for it
-    dmThread::Join(terrain->m_Thread);
+    if (terrain->m_Thread)
+        dmThread::Join(terrain->m_Thread);
+
+    if (terrain->m_PatchReader)
+        PatchReader_Delete(terrain->m_PatchReader);
+    if (terrain->m_Loader)
+        terrain->m_Loader->m_Exit(terrain->m_LoaderContext);
 
     dmConditionVariable::Delete(terrain->m_ThreadCondition);
     dmMutex::Delete(terrain->m_ThreadMutex);
 
-    for (int lod = 0; lod < NUM_LOD_LEVELS; ++lod)
+    dmWorkerPool::Delete(terrain->m_WorkerPool);
+
+    if (terrain->m_PatchCache)
+        PatchCache_Exit(terrain->m_PatchCache);
+
+    for (int lod = 0; lod < terrain->m_NumLodLevels; ++lod)
     {
-        for (int i = 0; i < NUM_PATCHES; ++i)
+        TerrainPatchLod* patch_lod = &terrain->m_Terrain[lod];
+        for (uint32_t i = 0; i < patch_lod->m_NumPatches; ++i)
         {
-            TerrainPatch* patch = &terrain->m_Terrain[lod].m_Patches[i];
+            TerrainPatch* patch = &patch_lod->m_Patches[i];
             PatchDelete(patch);
         }
+        delete[] patch_lod->m_Patches;
+        delete[] patch_lod->m_NeighborLods;
+        delete[] patch_lod->m_Unloaded;
+        delete[] patch_lod->m_Resident;
     }
+    delete[] terrain->m_Heightmaps;
+    delete[] terrain->m_HeightPyramids;
+    delete[] terrain->m_Scratch;
+
+    if (terrain->m_IndexBuffer)
+        dmBuffer::Destroy(terrain->m_IndexBuffer);
 
     delete terrain;
 }
 
+static void PushJob(HTerrain terrain, TerrainJobType type, uint32_t patch_id)
+{
+    DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
+
+    // No need to queue up several updates
+    if (type == JOB_UPDATE)
+    {
+        for (uint32_t i = 0; i < terrain->m_Jobs.Size(); ++i)
+        {
+            if (terrain->m_Jobs[i].m_Type == JOB_UPDATE)
+                return;
+        }
+    }
+
+    if (terrain->m_Jobs.Full())
+        terrain->m_Jobs.OffsetCapacity(16);
+    TerrainJob job = { type, patch_id };
+    terrain->m_Jobs.Push(job);
+
+    if (terrain->m_Thread)
+        dmConditionVariable::Signal(terrain->m_ThreadCondition); // wake up thread if it wasn't already working
+}
+
+static TerrainPatch* FindPatch(HTerrain terrain, uint32_t id)
+{
+    for (int lod = 0; lod < terrain->m_NumLodLevels; ++lod)
+    {
+        for (uint32_t i = 0; i < terrain->m_Terrain[lod].m_NumPatches; ++i)
+        {
+            TerrainPatch* patch = &terrain->m_Terrain[lod].m_Patches[i];
+            if (patch->m_Id == id)
+                return patch;
+        }
+    }
+    return 0;
+}
+
+static void ProcessJob(HTerrain terrain, const TerrainJob& job)
+{
+    if (job.m_Type == JOB_RELOAD)
+    {
+        // Once unloaded, the free slot is loaded again by UpdatePatches()
+        TerrainPatch* patch = FindPatch(terrain, job.m_PatchId);
+        if (patch && dmAtomicGet32(&patch->m_State) == PS_LOADED)
+            PatchUnload(terrain, patch);
+    }
+}
+
 static void TerrainThread(void* ctx)
 {
     TerrainWorld* terrain = (TerrainWorld*)ctx;
+    dmArray<TerrainJob> jobs;
+    jobs.SetCapacity(16);
+
+    bool busy = false;
     while (dmAtomicGet32(&terrain->m_ThreadActive))
     {
-        // Lock and sleep until signaled there is jobs queued up
-        // DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
-        // while(terrain->m_Work.Empty() && terrain->m_ThreadActive)
-        // {
-        //     printf("Thread entering sleep...\n");
-        //     fflush(stdout);
-        //     dmConditionVariable::Wait(terrain->m_ThreadCondition, terrain->m_ThreadMutex);
-        //     printf("Thread waking up!\n");
-        //     fflush(stdout);
-        // }
-        // if (!terrain->m_ThreadActive)
-        //     break;
+        {
+            // Lock and sleep until signaled there is jobs queued up
+            DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
+            while (!busy && terrain->m_Jobs.Empty() && dmAtomicGet32(&terrain->m_ThreadActive))
+            {
+                dmConditionVariable::Wait(terrain->m_ThreadCondition, terrain->m_ThreadMutex);
+            }
+            if (!dmAtomicGet32(&terrain->m_ThreadActive))
+                break;
+
+            if (jobs.Capacity() < terrain->m_Jobs.Size())
+                jobs.SetCapacity(terrain->m_Jobs.Size());
+            jobs.SetSize(0);
+            jobs.PushArray(terrain->m_Jobs.Begin(), terrain->m_Jobs.Size());
+            terrain->m_Jobs.SetSize(0);
+        }
 
-        DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
-        UpdatePatches(terrain, terrain->m_CameraPos);
+        for (uint32_t i = 0; i < jobs.Size(); ++i)
+        {
+            ProcessJob(terrain, jobs[i]);
+        }
 
-        //FlushWorkQueue(terrain, terrain->m_Work);
+        // Keep working as long as there are patches in flight
+        busy = UpdatePatches(terrain);
     }
 
     printf("Thread exited!\n");
     fflush(stdout);
 }
 
-static inline int Sign(int value)
+static const float LOAD_PRIORITY_DIRECTION_WEIGHT = 0.5f; // How much the camera direction affects the load priority
+// One patch per thread (the terrain thread and the workers) per pass. The patches are independent, since the
+// neighbor lods are stored when a patch is loaded. Few patches per pass, so that we can reprioritize often
+static const uint32_t MAX_GENERATE_PATCHES_PER_PASS = MAX_WORKERS + 1;
+static const float DEFAULT_FRAME_BUDGET_FRACTION = 0.25f; // The part of the frame time spent generating patches, when single threaded
+
+// Lower value means the patch is loaded sooner.
+// It's the distance (in base patch sizes) from the camera to the patch, scaled down for patches in front of the camera
+static float GetLoadPriority(int lod, int x, int z, const Vector3& camera_pos, const Vector3& camera_dir)
+{
+    float size = GetPatchSize(lod);
+    float cx = camera_pos.getX();
+    float cz = camera_pos.getZ();
+
+    // The distance to the closest point on the patch
+    float px = dmMath::Clamp(cx, x * size, (x + 1) * size);
+    float pz = dmMath::Clamp(cz, z * size, (z + 1) * size);
+    float distance = sqrtf((px - cx) * (px - cx) + (pz - cz) * (pz - cz));
+
+    // The direction to the center of the patch
+    float dx = (x + 0.5f) * size - cx;
+    float dz = (z + 0.5f) * size - cz;
+    float dir_length = sqrtf(dx * dx + dz * dz);
+    float camera_dir_length = sqrtf(camera_dir.getX() * camera_dir.getX() + camera_dir.getZ() * camera_dir.getZ());
+    float alignment = 0.0f;
+    if (dir_length > 0.0001f && camera_dir_length > 0.0001f)
+        alignment = (dx * camera_dir.getX() + dz * camera_dir.getZ()) / (dir_length * camera_dir_length);
+
+    return distance / GetPatchSize(0) * (1.0f - LOAD_PRIORITY_DIRECTION_WEIGHT * alignment);
+}
+
+// Finds the unoccupied slot with the highest load priority
+static int FindUnoccupied(HTerrain terrain, const bool* occupied, int lod, const int* camera_xz, const Vector3& camera_pos, const Vector3& camera_dir, int* out_x, int* out_z)
+{
+    int best = -1;
+    float best_priority = 0.0f;
+    uint32_t num_slots = GetNumRingSlots(terrain);
+    for (uint32_t i = 0; i < num_slots; ++i)
+    {
+        if (occupied[i])
+            continue;
+
+        int x, z;
+        ToXZ(terrain, i, &x, &z);
+        float priority = GetLoadPriority(lod, camera_xz[0] + x, camera_xz[1] + z, camera_pos, camera_dir);
+        if (best < 0 || priority < best_priority)
+        {
+            best = i;
+            best_priority = priority;
+        }
+    }
+    if (best >= 0)
+        ToXZ(terrain, best, out_x, out_z);
+    return best;
+}
+
+struct LoadCandidate
+{
+    TerrainPatch*   m_Patch;
+    float           m_Priority;
+};
+
+// Insertion sort, as there are only a few patches
+static void SortByPriority(LoadCandidate* candidates, uint32_t count)
+{
+    for (uint32_t i = 1; i < count; ++i)
+    {
+        LoadCandidate c = candidates[i];
+        uint32_t j = i;
+        for (; j > 0 && candidates[j-1].m_Priority > c.m_Priority; --j)
+            candidates[j] = candidates[j-1];
+        candidates[j] = c;
+    }
+}
+
+// A coarse patch (x, z) covers the finer patches [2x, 2x+1] in each direction.
+// It isn't needed if all of them are part of the finer lod ring. Otherwise, the part inside the finer ring
+// isn't drawn once the finer patches are shown (see GetCoveredQuarters())
+static bool IsCoveredByFinerLod(HTerrain terrain, const int* finer_camera_xz, int x, int z)
+{
+    if (!finer_camera_xz)
+        return false;
+    for (int j = 0; j < 2; ++j)
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            if (!IsInRing(terrain, 2*x + i - finer_camera_xz[0], 2*z + j - finer_camera_xz[1]))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Stores the lod of the neighbors of a patch that is about to be loaded
+static void UpdateNeighborLods(HTerrain terrain, TerrainPatch* patch, int camera_xzs[][2])
 {
-    return value > 0 ? 1 : -1;
+    static const int offsets[NUM_EDGES][2] = { {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
+
+    int lod = patch->m_Lod;
+    TerrainPatchLod* patch_lod = &terrain->m_Terrain[lod];
+    uint8_t* neighbor_lods = patch_lod->m_NeighborLods[patch - patch_lod->m_Patches];
+    const int* camera_xz = camera_xzs[lod];
+    const int* finer_camera_xz = lod > 0 ? camera_xzs[lod-1] : 0;
+
+    for (int edge = 0; edge < NUM_EDGES; ++edge)
+    {
+        int x = patch->m_XZ[0] + offsets[edge][0];
+        int z = patch->m_XZ[1] + offsets[edge][1];
+
+        int neighbor_lod = lod;
+        if (!IsInRing(terrain, x - camera_xz[0], z - camera_xz[1]))
+        {
+            // Outside of the ring, the next lod ring takes over
+            if (lod + 1 < terrain->m_NumLodLevels)
+                neighbor_lod = lod + 1;
+        }
+        else if (IsCoveredByFinerLod(terrain, finer_camera_xz, x, z))
+        {
+            neighbor_lod = lod - 1;
+        }
+        neighbor_lods[edge] = (uint8_t)neighbor_lod;
+    }
 }
 
-static int ToIndex(int x, int z)
+static void GetPatchCacheKey(TerrainPatch* patch, PatchCacheKey* key)
 {
-    int ix = x + 1;  // -1→0, 0→1, 1→2
-    int iz = z + 1;  // -1→0, 0→1, 1→2
-    return ix + 3 * iz;  // Row-major: 0-2 (z=-1), 3-5 (z=0), 6-8 (z=1)
+    memset(key, 0, sizeof(*key));
+    key->m_Seed = patch->m_HeightSeed;
+    key->m_Version = HEIGHT_GENERATOR_VERSION;
+    key->m_PatchSize = GetPatchSize(0);
+    key->m_Lod = patch->m_Lod;
+    key->m_X = patch->m_XZ[0];
+    key->m_Z = patch->m_XZ[1];
 }
 
-static void ToXZ(int idx, int *out_x, int *out_z)
+// Reads the heightmap from the disk cache. Returns false if it isn't cached
+static bool LoadCachedPatch(HTerrain terrain, TerrainPatch* patch)
 {
-    int ix = idx % 3;   // 0..2
-    int iz = idx / 3;   // 0..2
+    if (!terrain->m_PatchCache)
+        return false;
 
-    *out_x = ix - 1;    // 0..2 -> -1..1
-    *out_z = iz - 1;    // 0..2 -> -1..1
+    uint32_t size = GetPatchSize(0) + 3;
+    PatchCacheKey key;
+    GetPatchCacheKey(patch, &key);
+    return PatchCache_Load(terrain->m_PatchCache, key, patch->m_Heightmap, size, size);
 }
 
-static int FindUnoccupied(const bool* occupied, int* out_x, int* out_z)
+// Loads the heightmaps found in the disk cache, which then skip the height generation.
+// Returns the patches that still need to be generated (in the same array)
+static uint32_t LoadCachedPatches(HTerrain terrain, TerrainPatch** patches, uint32_t num_patches)
 {
-    for (int i = 0; i < NUM_PATCHES; ++i)
+    if (!terrain->m_PatchCache)
+        return num_patches;
+
+    uint32_t num_missing = 0;
+    for (uint32_t i = 0; i < num_patches; ++i)
     {
-        if (!occupied[i])
+        TerrainPatch* patch = patches[i];
+        if (LoadCachedPatch(terrain, patch))
+        {
+            UpdatePatchHeightRange(patch);
+            dmAtomicIncrement32(&patch->m_DataState);
+        }
+        else
         {
-            ToXZ(i, out_x, out_z);
-            return i;
+            patches[num_missing++] = patch;
         }
     }
-    return -1;
+    return num_missing;
 }
 
-// mark patches as discarded
-// Allow empty patches to load
-static void UpdatePatches(HTerrain terrain, Vector3 camera_pos)
+static void StoreCachedPatches(HTerrain terrain, TerrainPatch** patches, uint32_t num_patches)
 {
-    // static int frame = 0;
-    // frame++;
+    if (!terrain->m_PatchCache)
+        return;
 
-    for (int lod = 0; lod < NUM_LOD_LEVELS; ++lod)
+    uint32_t size = GetPatchSize(0) + 3;
+    for (uint32_t i = 0; i < num_patches; ++i)
     {
-        TerrainPatchLod* patch_lod = &terrain->m_Terrain[lod];
+        PatchCacheKey key;
+        GetPatchCacheKey(patches[i], &key);
+        PatchCache_Store(terrain->m_PatchCache, key, patches[i]->m_Heightmap, size, size);
+    }
+}
 
-        int camera_xz[2];
+// The edited heights aren't kept, since the neighbors are regenerated without the edits
+static bool HasUnloadedData(TerrainPatch* patch, const UnloadedPatch& unloaded, int x, int z)
+{
+    return unloaded.m_Time != 0 && !patch->m_Edited && unloaded.m_XZ[0] == x && unloaded.m_XZ[1] == z;
+}
+
+// Finds a patch for the slot. Preferably one that was unloaded from the same slot (and still has its data),
+// otherwise the patch that was unloaded the longest time ago.
+static TerrainPatch* FindFreePatch(HTerrain terrain, int lod, int x, int z)
+{
+    TerrainPatchLod* patch_lod = &terrain->m_Terrain[lod];
+    TerrainPatch* best = 0;
+    uint32_t best_time = 0;
+    for (uint32_t i = 0; i < patch_lod->m_NumPatches; ++i)
+    {
+        TerrainPatch* patch = &patch_lod->m_Patches[i];
+        if (dmAtomicGet32(&patch->m_State) != PS_UNLOADED)
+            continue;
+
+        const UnloadedPatch& unloaded = patch_lod->m_Unloaded[i];
+        if (HasUnloadedData(patch, unloaded, x, z))
+            return patch;
+        if (!best || unloaded.m_Time < best_time)
         {
-            DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
+            best = patch;
+            best_time = unloaded.m_Time;
+        }
+    }
+    return best;
+}
+
+// Starts loading a patch into the slot. If the patch still has the data from that slot, the generation is skipped,
+// except for the vertices if the neighbor lods have changed
+static void LoadFreePatch(HTerrain terrain, TerrainPatch* patch, int x, int z, int camera_xzs[][2])
+{
+    TerrainPatchLod* patch_lod = &terrain->m_Terrain[patch->m_Lod];
+    uint32_t index = patch - patch_lod->m_Patches;
+    UnloadedPatch& unloaded = patch_lod->m_Unloaded[index];
+    bool has_data = HasUnloadedData(patch, unloaded, x, z);
+    unloaded.m_Time = 0;
+    patch->m_Edited = 0;
+
+    uint8_t neighbor_lods[NUM_EDGES];
+    memcpy(neighbor_lods, patch_lod->m_NeighborLods[index], sizeof(neighbor_lods));
+
+    PatchLoad(terrain, patch, x, z);
+    UpdateNeighborLods(terrain, patch, camera_xzs);
+
+    if (has_data)
+    {
+        bool same_neighbors = memcmp(neighbor_lods, patch_lod->m_NeighborLods[index], sizeof(neighbor_lods)) == 0;
+        dmAtomicStore32(&patch->m_DataState, same_neighbors ? 2 : 1);
+    }
+}
+
+// Keeps the data of the patch, until the patch is reused for another slot
+static void RememberUnloadedPatch(HTerrain terrain, TerrainPatch* patch)
+{
+    TerrainPatchLod* patch_lod = &terrain->m_Terrain[patch->m_Lod];
+    UnloadedPatch& unloaded = patch_lod->m_Unloaded[patch - patch_lod->m_Patches];
+    unloaded.m_XZ[0] = patch->m_XZ[0];
+    unloaded.m_XZ[1] = patch->m_XZ[1];
+    unloaded.m_Time = ++terrain->m_UnloadTime;
+}
+
+// Returns true when the heights of a file backed patch are ready. A heightmap that couldn't be read gets flat heights,
+// since generated heights wouldn't match the neighbors. They are never stored in the disk cache
+static bool FinishPatchRead(TerrainPatch* patch)
+{
+    int read_state = dmAtomicGet32(&patch->m_ReadState);
+    if (read_state == PRS_FAILED)
+    {
+        uint32_t size = GetPatchSize(0) + 3;
+        memset(patch->m_Heightmap, 0, size * size * sizeof(uint16_t));
+    }
+    return read_state == PRS_READ || read_state == PRS_FAILED;
+}
+
+// Does the steps (see SliceStep) of the patch, one step or row at a time, until the deadline.
+// At least one step is done, so that the patch is finished eventually, whatever the budget.
+// Returns true if the patch is finished
+static bool GeneratePatchRows(HTerrain terrain, TerrainPatch* patch, uint64_t deadline)
+{
+    GridVertex* scratch = GetScratch(terrain, 0);
+    bool indexed = terrain->m_Indexed;
+    do
+    {
+        // The heights may already be there (see LoadFreePatch())
+        int data_state = dmAtomicGet32(&patch->m_DataState);
+        if (data_state == 2)
+            return true;
+        if (data_state == 1 && terrain->m_SlicedStep < SLICE_VERTEX_ROWS)
+        {
+            terrain->m_SlicedStep = SLICE_VERTEX_ROWS;
+            terrain->m_SlicedRow = 0;
+        }
+        else if (data_state == 0 && terrain->m_SlicedStep >= SLICE_VERTEX_ROWS)
+        {
+            terrain->m_SlicedStep = SLICE_READ_HEIGHTS;
+            terrain->m_SlicedRow = 0;
+        }
+
+        uint32_t row = terrain->m_SlicedRow;
+        switch (terrain->m_SlicedStep)
+        {
+        case SLICE_READ_HEIGHTS:
+            if (!patch->m_Generate)
+            {
+                // Without the terrain thread, the reader has no thread either, and reads the heightmap directly
+                if (dmAtomicGet32(&patch->m_ReadState) == PRS_NONE)
+                    PatchReader_Request(terrain->m_PatchReader, patch);
+                if (FinishPatchRead(patch))
+                    terrain->m_SlicedStep = SLICE_HEIGHT_RANGE;
+            }
+            else
+            {
+                terrain->m_SlicedStep = LoadCachedPatch(terrain, patch) ? SLICE_HEIGHT_RANGE : SLICE_HEIGHT_ROWS;
+            }
+            break;
+        case SLICE_HEIGHT_ROWS:
+            GeneratePatchHeights(patch, row, row + 1, (float*)scratch);
+            if (++row == (uint32_t)GetPatchSize(0) + 3)
+            {
+                terrain->m_SlicedStep = SLICE_STORE_HEIGHTS;
+                row = 0;
+            }
+            break;
+        case SLICE_STORE_HEIGHTS:
+            StoreCachedPatches(terrain, &patch, 1);
+            terrain->m_SlicedStep = SLICE_HEIGHT_RANGE;
+            break;
+        case SLICE_HEIGHT_RANGE:
+            UpdatePatchHeightRange(patch);
+            dmAtomicIncrement32(&patch->m_DataState);
+            terrain->m_SlicedStep = SLICE_VERTEX_ROWS;
+            break;
+        case SLICE_VERTEX_ROWS:
+            {
+                uint32_t num_rows = GetNumVertexRows(indexed);
+                GenerateVertexData(patch, indexed, GetCoarserEdges(terrain, patch), row, row + 1, 0, num_rows, scratch);
+                if (++row == num_rows)
+                {
+                    terrain->m_SlicedStep = SLICE_SKIRTS;
+                    row = 0;
+                }
+            }
+            break;
+        case SLICE_SKIRTS:
+            GenerateSkirts(patch, indexed, GetCoarserEdges(terrain, patch));
+            dmAtomicIncrement32(&patch->m_DataState);
+            break;
+        }
+        terrain->m_SlicedRow = row;
+    } while (dmTime::GetTime() < deadline);
+
+    return dmAtomicGet32(&patch->m_DataState) == 2;
+}
+
+// Single threaded generation. Builds the patches in priority order until m_SliceDeadline.
+// A patch that isn't finished in time is resumed at the same step in the next Update(), before any other patch,
+// so that no work is lost when the priorities change.
+// Returns the number of finished patches
+static uint32_t GeneratePatchesSliced(HTerrain terrain, const LoadCandidate* candidates, uint32_t num_candidates)
+{
+    uint32_t num_built = 0;
+    uint32_t next = 0;
+    do
+    {
+        TerrainPatch* patch = terrain->m_SlicedPatch;
+        if (!patch)
+        {
+            while (next < num_candidates && dmAtomicGet32(&candidates[next].m_Patch->m_State) != PS_LOADING)
+                ++next;
+            if (next == num_candidates)
+                break;
+            patch = candidates[next++].m_Patch;
+            terrain->m_SlicedPatch = patch;
+            terrain->m_SlicedStep = SLICE_READ_HEIGHTS;
+            terrain->m_SlicedRow = 0;
+        }
 
-            camera_xz[0] = patch_lod->m_CameraXZ[0];
-            camera_xz[1] = patch_lod->m_CameraXZ[1];
+        if (GeneratePatchRows(terrain, patch, terrain->m_SliceDeadline))
+        {
+            PatchLoaded(terrain, patch);
+            terrain->m_SlicedPatch = 0;
+            num_built++;
+        }
+    } while (dmTime::GetTime() < terrain->m_SliceDeadline);
+
+    return num_built;
+}
+
+// mark patches as discarded
+// Allow empty patches to load
+// Returns true if there is more work to do (i.e. patches are loading or unloading)
+static bool UpdatePatches(HTerrain terrain)
+{
+    bool busy = false;
+
+    // The patches waiting to be generated
+    LoadCandidate candidates[MAX_TOTAL_PATCHES];
+    uint32_t num_candidates = 0;
+
+    int camera_xzs[MAX_LOD_LEVELS][2];
+    Vector3 camera_pos;
+    Vector3 camera_dir;
+    {
+        DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
+        camera_pos = terrain->m_CameraPos;
+        camera_dir = terrain->m_CameraDir;
+        for (int lod = 0; lod < terrain->m_NumLodLevels; ++lod)
+        {
+            camera_xzs[lod][0] = terrain->m_Terrain[lod].m_CameraXZ[0];
+            camera_xzs[lod][1] = terrain->m_Terrain[lod].m_CameraXZ[1];
         }
+    }
+
+    for (int lod = 0; lod < terrain->m_NumLodLevels; ++lod)
+    {
+        TerrainPatchLod* patch_lod = &terrain->m_Terrain[lod];
+
+        int* camera_xz = camera_xzs[lod];
+        int* finer_camera_xz = lod > 0 ? camera_xzs[lod-1] : 0;
 
 // TODO: Early out if the lod camera position hasn't moved
 
         // This let's us know if the patches directly surrounding the camera patch is occupied
         // Note that it doesn't guarantuee that the patch is available for use.
-        bool occupied[NUM_PATCHES] = {false, false, false, false, false, false, false, false, false};
+        bool occupied[MAX_RING_SLOTS];
         bool some_empty = false;
 
-        for (int i = 0; i < NUM_PATCHES; ++i)
+        // The slots that are outside of the ring, or covered by the finer lod ring don't need a patch
+        uint32_t num_slots = GetNumRingSlots(terrain);
+        for (uint32_t i = 0; i < num_slots; ++i)
+        {
+            int x, z;
+            ToXZ(terrain, i, &x, &z);
+            occupied[i] = !IsInRing(terrain, x, z) || IsCoveredByFinerLod(terrain, finer_camera_xz, camera_xz[0] + x, camera_xz[1] + z);
+        }
+
+        for (uint32_t i = 0; i < patch_lod->m_NumPatches; ++i)
         {
             TerrainPatch* patch = &patch_lod->m_Patches[i];
 
             int diffx = patch->m_XZ[0] - camera_xz[0];
             int diffz = patch->m_XZ[1] - camera_xz[1];
-            if (dmMath::Abs(diffx) <= 1 && dmMath::Abs(diffz) <= 1)
+            if (IsInRing(terrain, diffx, diffz))
             {
-                int idx = ToIndex(diffx, diffz);
+                int idx = ToIndex(terrain, diffx, diffz);
                 occupied[idx] = true;
             }
             // else
@@ -691,7 +1808,7 @@ static void UpdatePatches(HTerrain terrain, Vector3 camera_pos)
         // if (some_empty)
         // {
         //     printf("occupied: ");
-        //     for (int i = 0; i < NUM_PATCHES; ++i)
+        //     for (uint32_t i = 0; i < num_slots; ++i)
         //     {
         //         printf("%d ", occupied[i]);
         //     }
@@ -700,44 +1817,36 @@ static void UpdatePatches(HTerrain terrain, Vector3 camera_pos)
         //     DebugPrint(terrain);
         // }
 
-        for (int i = 0; i < NUM_PATCHES; ++i)
+        // Load the empty slots, starting with the one we want to load first
+        while (true)
         {
-            TerrainPatch* patch = &patch_lod->m_Patches[i];
+            int x, z;
+            int idx = FindUnoccupied(terrain, occupied, lod, camera_xz, camera_pos, camera_dir, &x, &z);
+            if (idx < 0)
+                break;
+            TerrainPatch* patch = FindFreePatch(terrain, lod, camera_xz[0] + x, camera_xz[1] + z);
+            if (!patch)
+                break;
+
+            occupied[idx] = true;
+            LoadFreePatch(terrain, patch, camera_xz[0] + x, camera_xz[1] + z, camera_xzs);
+        }
 
-            // Bounding box check
+        for (uint32_t i = 0; i < patch_lod->m_NumPatches; ++i)
+        {
+            TerrainPatch* patch = &patch_lod->m_Patches[i];
 
-            // find out if it's more than one step away from the camera position
+            // find out if it's outside of the ring around the camera position
             int diffx = patch->m_XZ[0] - camera_xz[0];
             int diffz = patch->m_XZ[1] - camera_xz[1];
+            bool outside = !IsInRing(terrain, diffx, diffz);
 
-            // If the difference is positive, then the camera is moving in the positive direction
-            // and the next patch position should be before the camera in that same direction
-            int movex = dmMath::Abs(diffx) > 1 ? Sign(diffx) : 0;
-            int movez = dmMath::Abs(diffz) > 1 ? Sign(diffz) : 0;
-
-            // If the patch has moved away from the camera
-            if (movex || movez)
+            // If the patch has moved away from the camera, or the finer lod covers it
+            bool covered = IsCoveredByFinerLod(terrain, finer_camera_xz, patch->m_XZ[0], patch->m_XZ[1]);
+            if ((outside || covered) && PS_LOADED == dmAtomicGet32(&patch->m_State))
             {
-                int state = dmAtomicGet32(&patch->m_State);
-
-                if (PS_UNLOADED == state) // It is free to load a new one
-                {
-                    // Time to load a new patch
-
-                    // Find an unoccupied slot next to the camera
-                    // TODO: Find an unoccupied slot in front of the camera first, as we want to load them first
-                    int x, z;
-                    int idx = FindUnoccupied(occupied, &x, &z);
-                    if (idx >= 0)
-                    {
-                        occupied[idx] = true;
-                        PatchLoad(terrain, patch, camera_xz[0] + x, camera_xz[1] + z);
-                    }
-                }
-                else if (PS_LOADED == state)
-                {
-                    PatchUnload(terrain, patch);
-                }
+                PatchUnload(terrain, patch);
+                RememberUnloadedPatch(terrain, patch);
             }
 
             // update any loading/unloading state
@@ -745,12 +1854,17 @@ static void UpdatePatches(HTerrain terrain, Vector3 camera_pos)
 
             if (PS_LOADING == state)
             {
-                if (DoPatchLoad(terrain, patch))
+                if (dmAtomicGet32(&patch->m_DataState) == 2)
                 {
-                    PatchSetState(patch, PS_LOADED);
-
-                    DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
-                    terrain->m_Callback(TERRAIN_PATCH_SHOW, patch);
+                    // The data was kept from when it was unloaded
+                    PatchLoaded(terrain, patch);
+                }
+                else
+                {
+                    // Loaded/generated in priority order below
+                    LoadCandidate& candidate = candidates[num_candidates++];
+                    candidate.m_Patch = patch;
+                    candidate.m_Priority = GetLoadPriority(lod, patch->m_XZ[0], patch->m_XZ[1], camera_pos, camera_dir);
                 }
             }
             else if (PS_UNLOADING == state)
@@ -758,95 +1872,134 @@ static void UpdatePatches(HTerrain terrain, Vector3 camera_pos)
                 if (DoPatchUnload(terrain, patch))
                 {
                     PatchSetState(patch, PS_UNLOADED);
+                    busy = true; // The patch is now free to be loaded into an empty slot
+                }
+                else if (dmAtomicGet32(&patch->m_DataState) == 0)
+                {
+                    busy = true; // The event wasn't taken
                 }
             }
+
+            // While waiting for the Lua callback, we're woken up again from Update()
+            if (PS_LOADING == dmAtomicGet32(&patch->m_State))
+            {
+                busy = true;
+            }
+        }
+    }
+
+    // Generate the most important patches, the rest are reprioritized in the next pass,
+    // since the camera may have turned by then.
+    // The rows of the patches are generated in parallel
+    SortByPriority(candidates, num_candidates);
+
+    // The heightmaps of the file backed patches are requested ahead, so that they are read
+    // while the vertices of the patches before them are built.
+    // Without the terrain thread, the patches are instead built a few rows per frame (see GeneratePatchesSliced())
+    bool can_request = true;
+    uint32_t max_generate = dmMath::Min(dmWorkerPool::GetNumWorkers(terrain->m_WorkerPool) + 1, MAX_GENERATE_PATCHES_PER_PASS);
+    TerrainPatch* generate[2][MAX_GENERATE_PATCHES_PER_PASS];
+    uint32_t num_generate[2] = {0, 0};
+    for (uint32_t i = 0; i < num_candidates && terrain->m_Thread; ++i)
+    {
+        TerrainPatch* patch = candidates[i].m_Patch;
+        if (!patch->m_Generate && dmAtomicGet32(&patch->m_DataState) == 0)
+        {
+            if (can_request && dmAtomicGet32(&patch->m_ReadState) == PRS_NONE)
+                can_request = PatchReader_Request(terrain->m_PatchReader, patch);
+
+            if (!FinishPatchRead(patch))
+                continue; // Not read yet
+            UpdatePatchHeightRange(patch);
+            dmAtomicIncrement32(&patch->m_DataState);
+        }
+
+        if (num_generate[1] == max_generate)
+            continue;
+        if (dmAtomicGet32(&patch->m_DataState) == 0)
+            generate[0][num_generate[0]++] = patch;
+        generate[1][num_generate[1]++] = patch;
+    }
+
+    uint32_t num_in_use = 0;
+    uint32_t num_cached = 0;
+    for (int lod = 0; lod < terrain->m_NumLodLevels; ++lod)
+    {
+        TerrainPatchLod* patch_lod = &terrain->m_Terrain[lod];
+        for (uint32_t i = 0; i < patch_lod->m_NumPatches; ++i)
+        {
+            bool unloaded = dmAtomicGet32(&patch_lod->m_Patches[i].m_State) == PS_UNLOADED;
+            num_in_use += unloaded ? 0 : 1;
+            num_cached += unloaded && patch_lod->m_Unloaded[i].m_Time != 0 ? 1 : 0;
+        }
+    }
+    {
+        DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
+        terrain->m_Stats.m_NumPatchesInUse = num_in_use;
+        terrain->m_Stats.m_NumPatchesCached = num_cached;
+        terrain->m_Stats.m_MaxPatchesInUse = dmMath::Max(terrain->m_Stats.m_MaxPatchesInUse, num_in_use);
+    }
+
+    uint64_t build_start = dmTime::GetTime();
+    uint32_t num_built = 0;
+    bool built_any = num_generate[1] != 0;
+    if (!terrain->m_Thread)
+    {
+        built_any = terrain->m_SlicedPatch != 0 || num_candidates != 0;
+        num_built = GeneratePatchesSliced(terrain, candidates, num_candidates);
+    }
+    else
+    {
+        num_generate[0] = LoadCachedPatches(terrain, generate[0], num_generate[0]);
+        GeneratePatches(terrain, generate[0], num_generate[0], 0);
+        StoreCachedPatches(terrain, generate[0], num_generate[0]);
+        if (GeneratePatches(terrain, generate[1], num_generate[1], 1))
+        {
+            for (uint32_t i = 0; i < num_generate[1]; ++i)
+                PatchLoaded(terrain, generate[1][i]);
+            num_built = num_generate[1];
         }
     }
+    uint64_t build_time = dmTime::GetTime() - build_start;
+
+    {
+        DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
+        terrain->m_Stats.m_NumPatchesBuilt += num_built;
+        terrain->m_Stats.m_BuildTime += built_any ? build_time : 0;
+        if (terrain->m_PatchReader)
+            PatchReader_GetStats(terrain->m_PatchReader, &terrain->m_Stats.m_NumPatchesRead, &terrain->m_Stats.m_ReadTime);
+    }
+
+    return busy;
+}
+
 
-    // for (int lod = 0; lod < NUM_LOD_LEVELS; ++lod)
-    // {
-    //     TerrainPatchLod* patch_lod = &terrain->m_Terrain[lod];
-
-    //     // Since we want to prioritize the loading of the patch immediately in front of the camera
-    //     // we want to sort the patches.
-    //     // This index table allows us to iterate in a different order
-    //     int idx[8*9] = {
-    //         4, 5, 2, 8, 1, 7, 0, 3, 6,  // dir:  1, 0, 0  East
-    //         4, 2, 1, 5, 0, 8, 3, 7, 6,  // dir:  1, 0,-1  NorthEast
-    //         4, 1, 0, 2, 3, 5, 6, 7, 8,  // dir: 0, 0, -1  North
-    //         4, 0, 1, 3, 6, 2, 7, 5, 8,  // dir: -1, 0,-1  NorthWest
-    //         4, 3, 6, 0, 7, 1, 8, 5, 2,  // dir: -1, 0, 0  West
-    //         4, 6, 3, 7, 0, 8, 1, 5, 2,  // dir: -1, 0, 1  SouthWest
-    //         4, 7, 6, 8, 3, 5, 0, 1, 2,  // dir: 0, 0,  1  South
-    //         4, 8, 7, 5, 6, 2, 3, 1, 0,  // dir:  1, 0, 1  SouthEast
-    //     };
-
-    //     const char* octantnames[8] = {
-    //         "East",
-    //         "NorthEast",
-    //         "North",
-    //         "NorthWest",
-    //         "West",
-    //         "SouthWest",
-    //         "South",
-    //         "SouthEast",
-    //     };
-
-    //     // figure out the quadrant that the camera direction is pointing at
-    //     float camdirx = terrain->m_CameraDir.getX();
-    //     float camdirz = -terrain->m_CameraDir.getZ(); // we want negative Z to be "north"
-    //     float a = atan2f(camdirz, camdirx);
-    //     int octant = int( 8 * a / (2*M_PI) + 8.5f ) % 8;
-
-    //     //printf("octant: %s\n", octantnames[octant]);
-
-    //     for (int i = 0; i < NUM_PATCHES; ++i)
-    //     {
-    //         int index = idx[octant * NUM_PATCHES + i];
-    //         int x = index % 3 - 1;
-    //         int z = index / 3 - 1;
-    //         {
-    //             if (!IsPatchOccupied(patch_lod, x, z))
-    //             {
-    //                 TerrainPatch* patch = AllocateFreePatch(terrain, lod);
-    //                 if (!patch)
-    //                     continue;
-
-    //                 // move this patch
-    //                 patch->m_XZ[0] = patch_lod->m_CameraXZ[0] + x;
-    //                 patch->m_XZ[1] = patch_lod->m_CameraXZ[1] + z;
-
-    //                 patch->m_Position = PatchToWorldCoord(patch->m_XZ, lod);
-
-    //                 // printf("Loading patch: %d %d (%d %d)    pos: %.3f, %.3f  camera: %d %d\n",
-    //                 //     patch->m_XZ[0], patch->m_XZ[1], x, z, patch->m_Position.getX(), patch->m_Position.getZ(),
-    //                 //     patch_lod->m_CameraXZ[0], patch_lod->m_CameraXZ[1]);
-
-    //                 PatchLoad(terrain, patch);
-
-    //                 SetPatchOccupied(patch_lod, x, z, true);
-    //             }
-    //         }
-    //     }
-    // }
-}
-
-static float round_to_step(float x, float step)
-{
-    float scaled = x / step;
-    float rounded = (floorf(scaled + 0.5f)) * step;
-    return rounded;
-}
-
-static bool UpdateCameraPos(HTerrain terrain, dmVMath::Vector3& camera_pos)
+// The camera patch only changes when the camera is further than the margin from the current camera patch.
+// Otherwise, moving back and forth across a patch edge would unload and load the same patches over and over
+static void GetCameraPatchCoord(HTerrain terrain, const Vector3& camera_pos, uint32_t lod, const int current_xz[2], int camera_xz[2])
+{
+    WorldToPatchCoord(camera_pos, lod, camera_xz);
+
+    // A larger margin could let the finer lod ring move outside of the coarser lod ring
+    float size = GetPatchSize(lod);
+    float margin = dmMath::Min(terrain->m_UnloadMargin, size * 0.25f);
+    float pos[2] = { camera_pos.getX(), camera_pos.getZ() };
+    for (int i = 0; i < 2; ++i)
+    {
+        if (camera_xz[i] != current_xz[i] && pos[i] >= current_xz[i] * size - margin && pos[i] <= (current_xz[i] + 1) * size + margin)
+            camera_xz[i] = current_xz[i];
+    }
+}
+
+static bool UpdateCameraPos(HTerrain terrain, const Vector3& camera_pos)
 {
     bool lods_need_update = false;
-    for (int lod = 0; lod < NUM_LOD_LEVELS; ++lod)
+    for (int lod = 0; lod < terrain->m_NumLodLevels; ++lod)
     {
         TerrainPatchLod* patch_lod = &terrain->m_Terrain[lod];
 
         int camera_xz[2];
-        WorldToPatchCoord(camera_pos, lod, camera_xz);
+        GetCameraPatchCoord(terrain, camera_pos, lod, patch_lod->m_CameraXZ, camera_xz);
 
         int camera_diffx = camera_xz[0] - patch_lod->m_CameraXZ[0];
         int camera_diffz = camera_xz[1] - patch_lod->m_CameraXZ[1];
@@ -875,44 +2028,921 @@ static bool UpdateCameraPos(HTerrain terrain, dmVMath::Vector3& camera_pos)
     return lods_need_update;
 }
 
+// Descends the min/max pyramid down to the sub tile level. Subtrees outside of the frustum are skipped,
+// and subtrees inside of the frustum don't need any more tests
+static void CullPyramidNode(const Vector4 planes[6], TerrainPatch* patch, float skirt_depth, int level, int x, int z, uint64_t* visible_tiles)
+{
+    Vector3 aabb_min, aabb_max;
+    GetPyramidNodeAABB(patch, level, x, z, skirt_depth, &aabb_min, &aabb_max);
+    FrustumResult result = ClassifyAABB(planes, aabb_min, aabb_max);
+    if (result == FRUSTUM_OUTSIDE)
+        return;
+
+    if (result == FRUSTUM_INSIDE || level == PYRAMID_TILE_LEVEL)
+    {
+        // Mark all sub tiles covered by this node
+        int span = 1 << (PYRAMID_TILE_LEVEL - level);
+        for (int tz = z * span; tz < (z + 1) * span; ++tz)
+        {
+            for (int tx = x * span; tx < (x + 1) * span; ++tx)
+                *visible_tiles |= 1ULL << (tx + tz * PATCH_NUM_TILES);
+        }
+        return;
+    }
+
+    for (int cz = 0; cz < 2; ++cz)
+    {
+        for (int cx = 0; cx < 2; ++cx)
+            CullPyramidNode(planes, patch, skirt_depth, level + 1, x * 2 + cx, z * 2 + cz, visible_tiles);
+    }
+}
+
+// A coarse patch that is partly inside the finer lod ring is still loaded, and the shown finer patches draw its
+// covered quarters instead. The quarters are aligned to the finer patches, and the finer patches stitch their
+// edges to the coarse grid, so the hole in the coarse patch has no seams.
+// Uses the resident patches (see UpdateResidentPatches())
+static uint8_t GetCoveredQuarters(HTerrain terrain, TerrainPatch* patch)
+{
+    if (patch->m_Lod == 0)
+        return 0;
+
+    TerrainPatchLod* finer_lod = &terrain->m_Terrain[patch->m_Lod - 1];
+    int width = 2 * terrain->m_RingRadius + 1;
+    uint8_t covered = 0;
+    for (int quarter = 0; quarter < 4; ++quarter)
+    {
+        int x = 2 * patch->m_XZ[0] + (quarter & 1) - finer_lod->m_ResidentOrigin[0];
+        int z = 2 * patch->m_XZ[1] + (quarter >> 1) - finer_lod->m_ResidentOrigin[1];
+        if (x < 0 || x >= width || z < 0 || z >= width)
+            continue;
+        TerrainPatch* finer = finer_lod->m_Resident[x + z * width];
+        if (finer && dmAtomicGet32(&finer->m_LuaCallback))
+            covered |= 1 << quarter;
+    }
+    return covered;
+}
+
+// The sub tiles (see PATCH_NUM_TILES) of the covered quarters
+static uint64_t GetCoveredTiles(uint8_t covered)
+{
+    const uint32_t half = PATCH_NUM_TILES / 2;
+    uint64_t tiles = 0;
+    for (uint32_t tz = 0; tz < PATCH_NUM_TILES; ++tz)
+    {
+        for (uint32_t tx = 0; tx < PATCH_NUM_TILES; ++tx)
+        {
+            uint32_t quarter = (tx / half) + 2 * (tz / half);
+            if (covered & (1 << quarter))
+                tiles |= 1ULL << (tx + tz * PATCH_NUM_TILES);
+        }
+    }
+    return tiles;
+}
+
+// Updates the visibility of the patches that are shown (i.e. the Lua callback has been invoked)
+// Runs on the main thread, so the events are delivered after the TERRAIN_PATCH_SHOW event
+static void UpdateVisibility(HTerrain terrain, const Matrix4& view_proj)
+{
+    Vector4 planes[6];
+    ExtractFrustumPlanes(view_proj, planes);
+
+    for (int lod = 0; lod < terrain->m_NumLodLevels; ++lod)
+    {
+        float skirt_depth = GetPatchStep(lod) * SKIRT_DEPTH;
+
+        for (uint32_t i = 0; i < terrain->m_Terrain[lod].m_NumPatches; ++i)
+        {
+            TerrainPatch* patch = &terrain->m_Terrain[lod].m_Patches[i];
+
+            bool shown = dmAtomicGet32(&patch->m_State) == PS_LOADED && dmAtomicGet32(&patch->m_LuaCallback) != 0;
+            if (!shown)
+            {
+                // The patch is hidden (or about to be), so there's no need for an event
+                patch->m_Visible = 0;
+                patch->m_VisibleTiles = 0;
+                patch->m_CoveredQuarters = 0;
+                continue;
+            }
+
+            uint8_t covered = GetCoveredQuarters(terrain, patch);
+            if (covered != patch->m_CoveredQuarters)
+            {
+                patch->m_CoveredQuarters = covered;
+                terrain->m_Callback(TERRAIN_PATCH_COVERAGE, patch);
+            }
+
+            uint64_t visible_tiles = 0;
+            CullPyramidNode(planes, patch, skirt_depth, 0, 0, 0, &visible_tiles);
+            visible_tiles &= ~GetCoveredTiles(covered);
+            patch->m_VisibleTiles = visible_tiles;
+
+            uint8_t visible = visible_tiles != 0;
+            if (visible != patch->m_Visible)
+            {
+                patch->m_Visible = visible;
+                terrain->m_Callback(visible ? TERRAIN_PATCH_VISIBLE : TERRAIN_PATCH_INVISIBLE, patch);
+            }
+        }
+    }
+}
+
+// Maps the ring slots to the loaded patches, so that the height queries can find them quickly
+static void UpdateResidentPatches(HTerrain terrain)
+{
+    int radius = terrain->m_RingRadius;
+    int width = 2 * radius + 1;
+    uint32_t num_slots = GetNumRingSlots(terrain);
+    for (int lod = 0; lod < terrain->m_NumLodLevels; ++lod)
+    {
+        TerrainPatchLod* patch_lod = &terrain->m_Terrain[lod];
+        patch_lod->m_ResidentOrigin[0] = patch_lod->m_CameraXZ[0] - radius;
+        patch_lod->m_ResidentOrigin[1] = patch_lod->m_CameraXZ[1] - radius;
+        memset(patch_lod->m_Resident, 0, num_slots * sizeof(TerrainPatch*));
+
+        for (uint32_t i = 0; i < patch_lod->m_NumPatches; ++i)
+        {
+            TerrainPatch* patch = &patch_lod->m_Patches[i];
+            if (dmAtomicGet32(&patch->m_State) != PS_LOADED)
+                continue;
+            int x = patch->m_XZ[0] - patch_lod->m_ResidentOrigin[0];
+            int z = patch->m_XZ[1] - patch_lod->m_ResidentOrigin[1];
+            if (x >= 0 && x < width && z >= 0 && z < width)
+                patch_lod->m_Resident[x + z * width] = patch;
+        }
+    }
+}
+
 void Update(HTerrain terrain, const UpdateParams& params)
 {
     terrain->m_View = params.m_View;
+    terrain->m_Proj = params.m_Proj;
 
     Matrix4 invView = inverse(params.m_View);
-    terrain->m_CameraDir = -invView.getCol(2).getXYZ();
+    {
+        DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
+        terrain->m_CameraDir = -invView.getCol(2).getXYZ();
+        terrain->m_CameraPos = invView.getCol(3).getXYZ();
+    }
 
-// TODO: This is just a small hack to make the loading/unloading a little bit more stable,
-// when camera is passing boundaries. Should replace with more logic when exiting the current camera's patch.
-    dmVMath::Vector3 pos = invView.getCol(3).getXYZ();
-    pos = dmVMath::Vector3(round_to_step(pos.getX(), 0.05f),
-                           round_to_step(pos.getY(), 0.05f),
-                           round_to_step(pos.getZ(), 0.05f));
+    bool needs_update = UpdateCameraPos(terrain, invView.getCol(3).getXYZ());
 
-    if (UpdateCameraPos(terrain, pos))
+    // Patches that are unloading are waiting for the Lua callback to have been invoked
+    for (int lod = 0; lod < terrain->m_NumLodLevels && !needs_update; ++lod)
     {
-        if (terrain->m_Thread)
-            dmConditionVariable::Signal(terrain->m_ThreadCondition); // wake up thread if it wasn't already working
+        for (uint32_t i = 0; i < terrain->m_Terrain[lod].m_NumPatches; ++i)
+        {
+            TerrainPatch* patch = &terrain->m_Terrain[lod].m_Patches[i];
+            if (dmAtomicGet32(&patch->m_State) == PS_UNLOADING && dmAtomicGet32(&patch->m_LuaCallback))
+            {
+                needs_update = true;
+                break;
+            }
+        }
     }
 
-    // For single threaded systems
+    if (needs_update)
+        PushJob(terrain, JOB_UPDATE, 0);
+
+    // For single threaded systems. The patches are generated within the time budget, and resumed in the next frame
     if (!terrain->m_Thread)
     {
-        UpdatePatches(terrain, terrain->m_CameraPos);
+        float budget = terrain->m_FrameBudget > 0.0f ? terrain->m_FrameBudget : params.m_Dt * 1000.0f * DEFAULT_FRAME_BUDGET_FRACTION;
+        terrain->m_SliceDeadline = dmTime::GetTime() + (uint64_t)(budget * 1000.0f);
+
+        DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
+        for (uint32_t i = 0; i < terrain->m_Jobs.Size(); ++i)
+        {
+            ProcessJob(terrain, terrain->m_Jobs[i]);
+        }
+        terrain->m_Jobs.SetSize(0);
+
+        UpdatePatches(terrain);
+    }
+
+    UpdateResidentPatches(terrain);
+    UpdateVisibility(terrain, params.m_Proj * params.m_View);
+}
+
+uint32_t GetVisiblePatches(HTerrain terrain, TerrainPatch** patches, uint32_t max_patches)
+{
+    uint32_t count = 0;
+    for (int lod = 0; lod < terrain->m_NumLodLevels; ++lod)
+    {
+        for (uint32_t i = 0; i < terrain->m_Terrain[lod].m_NumPatches; ++i)
+        {
+            TerrainPatch* patch = &terrain->m_Terrain[lod].m_Patches[i];
+            if (!patch->m_Visible)
+                continue;
+            if (count < max_patches)
+                patches[count] = patch;
+            ++count;
+        }
     }
+    return count;
 }
 
+// Finds the finest loaded patch that contains the world position
+static TerrainPatch* FindResidentPatch(HTerrain terrain, float x, float z)
+{
+    int width = 2 * terrain->m_RingRadius + 1;
+    Vector3 pos(x, 0, z);
+    for (int lod = 0; lod < terrain->m_NumLodLevels; ++lod)
+    {
+        TerrainPatchLod* patch_lod = &terrain->m_Terrain[lod];
+        int xz[2];
+        WorldToPatchCoord(pos, lod, xz);
+        int sx = xz[0] - patch_lod->m_ResidentOrigin[0];
+        int sz = xz[1] - patch_lod->m_ResidentOrigin[1];
+        if (sx < 0 || sx >= width || sz < 0 || sz >= width)
+            continue;
+
+        // The patch may have been unloaded since the last Update(), but the data isn't
+        // overwritten until the Lua callback for the unload has been invoked on this thread
+        TerrainPatch* patch = patch_lod->m_Resident[sx + sz * width];
+        if (patch && dmAtomicGet32(&patch->m_State) == PS_LOADED && patch->m_XZ[0] == xz[0] && patch->m_XZ[1] == xz[1])
+            return patch;
+    }
+    return 0;
+}
+
+// Bilinear sampling of the heightmap
+static float SamplePatch(TerrainPatch* patch, float x, float z, Vector3* normal)
+{
+    int patch_size = GetPatchSize(0);
+    float step = GetPatchStep(patch->m_Lod);
+    float gx = (x - patch->m_Position.getX()) / step;
+    float gz = (z - patch->m_Position.getZ()) / step;
+    int ix = dmMath::Clamp((int)gx, 0, patch_size - 1);
+    int iz = dmMath::Clamp((int)gz, 0, patch_size - 1);
+    float fx = Clampf(0.0f, 1.0f, gx - ix);
+    float fz = Clampf(0.0f, 1.0f, gz - iz);
+
+    float h00 = GetHeight(patch, ix, iz);
+    float h10 = GetHeight(patch, ix+1, iz);
+    float h01 = GetHeight(patch, ix, iz+1);
+    float h11 = GetHeight(patch, ix+1, iz+1);
+    float h0 = h00 + (h10 - h00) * fx;
+    float h1 = h01 + (h11 - h01) * fx;
+
+    if (normal)
+    {
+        Vector3 n0 = GetNormal(patch, ix, iz) * (1.0f - fx) + GetNormal(patch, ix+1, iz) * fx;
+        Vector3 n1 = GetNormal(patch, ix, iz+1) * (1.0f - fx) + GetNormal(patch, ix+1, iz+1) * fx;
+        *normal = normalize(n0 * (1.0f - fz) + n1 * fz);
+    }
+    return h0 + (h1 - h0) * fz;
+}
+
+// The noise is sampled in lod 0 patch units
+static float EvaluateHeight(HTerrain terrain, float x, float z)
+{
+    if (terrain->m_Loader)
+        return terrain->m_Loader->m_GetHeight(terrain->m_LoaderContext, x, z) * UNSIGNED_TO_HEIGHT_FACTOR;
+
+    float oo_patch_size = 1.0f / GetPatchSize(0);
+    return Clampf(0.0f, 1.0f, GenerateHeight(terrain->m_HeightSeed, x * oo_patch_size, z * oo_patch_size)) * HEIGHT_SCALE;
+}
+
+float GetHeightAndNormal(HTerrain terrain, float x, float z, Vector3* normal)
+{
+    TerrainPatch* patch = FindResidentPatch(terrain, x, z);
+    if (patch)
+        return SamplePatch(patch, x, z, normal);
+
+    // Central differences, one lod 0 vertex step in each direction
+    if (normal)
+    {
+        *normal = GetGradientNormal(EvaluateHeight(terrain, x - 1, z), EvaluateHeight(terrain, x + 1, z),
+                                    EvaluateHeight(terrain, x, z - 1), EvaluateHeight(terrain, x, z + 1), 1.0f);
+    }
+    return EvaluateHeight(terrain, x, z);
+}
+
+float GetHeight(HTerrain terrain, float x, float z)
+{
+    return GetHeightAndNormal(terrain, x, z, 0);
+}
+
+void GetHeights(HTerrain terrain, uint32_t count, const float* x, const float* z, float* out_heights, Vector3* out_normals)
+{
+    // The positions outside of the loaded patches are evaluated in batches,
+    // with the four neighbors for the normal
+    const uint32_t BATCH_SIZE = 64;
+    const uint32_t NUM_SAMPLES = 5;
+    float sample_x[BATCH_SIZE * NUM_SAMPLES];
+    float sample_z[BATCH_SIZE * NUM_SAMPLES];
+    float sample_h[BATCH_SIZE * NUM_SAMPLES];
+    uint32_t missing[BATCH_SIZE];
+
+    float oo_patch_size = 1.0f / GetPatchSize(0);
+    uint32_t num_samples = out_normals ? NUM_SAMPLES : 1;
+    static const float offsets[NUM_SAMPLES][2] = { {0, 0}, {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
+
+    for (uint32_t begin = 0; begin < count; begin += BATCH_SIZE)
+    {
+        uint32_t end = dmMath::Min(count, begin + BATCH_SIZE);
+        uint32_t num_missing = 0;
+        for (uint32_t i = begin; i < end; ++i)
+        {
+            TerrainPatch* patch = FindResidentPatch(terrain, x[i], z[i]);
+            if (patch)
+            {
+                out_heights[i] = SamplePatch(patch, x[i], z[i], out_normals ? &out_normals[i] : 0);
+                continue;
+            }
+
+            for (uint32_t s = 0; s < num_samples; ++s)
+            {
+                sample_x[num_missing * num_samples + s] = x[i] + offsets[s][0];
+                sample_z[num_missing * num_samples + s] = z[i] + offsets[s][1];
+            }
+            missing[num_missing++] = i;
+        }
+
+        if (num_missing == 0)
+            continue;
+
+        if (terrain->m_Loader)
+        {
+            for (uint32_t j = 0; j < num_missing * num_samples; ++j)
+                sample_h[j] = terrain->m_Loader->m_GetHeight(terrain->m_LoaderContext, sample_x[j], sample_z[j]) * UNSIGNED_TO_HEIGHT_FACTOR;
+        }
+        else
+        {
+            for (uint32_t j = 0; j < num_missing * num_samples; ++j)
+            {
+                sample_x[j] *= oo_patch_size;
+                sample_z[j] *= oo_patch_size;
+            }
+            GenerateHeights(terrain->m_HeightSeed, sample_x, sample_z, num_missing * num_samples, sample_h);
+            for (uint32_t j = 0; j < num_missing * num_samples; ++j)
+                sample_h[j] = Clampf(0.0f, 1.0f, sample_h[j]) * HEIGHT_SCALE;
+        }
+
+        for (uint32_t j = 0; j < num_missing; ++j)
+        {
+            const float* h = &sample_h[j * num_samples];
+            out_heights[missing[j]] = h[0];
+            if (out_normals)
+                out_normals[missing[j]] = GetGradientNormal(h[1], h[2], h[3], h[4], 1.0f);
+        }
+    }
+}
+
+struct Ray
+{
+    Vector3 m_Origin;
+    Vector3 m_Direction; // Normalized
+    float   m_MaxDistance;
+};
+
+// Ray/box slab test. Returns false if the ray misses the box within [t0, t1]. The range is narrowed to the box
+static bool IntersectRayAABB(const Ray& ray, const Vector3& aabb_min, const Vector3& aabb_max, float* t0, float* t1)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        float o = ray.m_Origin.getElem(i);
+        float d = ray.m_Direction.getElem(i);
+        if (fabsf(d) < 0.000001f)
+        {
+            if (o < aabb_min.getElem(i) || o > aabb_max.getElem(i))
+                return false;
+            continue;
+        }
+        float ta = (aabb_min.getElem(i) - o) / d;
+        float tb = (aabb_max.getElem(i) - o) / d;
+        if (ta > tb)
+        {
+            float tmp = ta; ta = tb; tb = tmp;
+        }
+        *t0 = dmMath::Max(*t0, ta);
+        *t1 = dmMath::Min(*t1, tb);
+        if (*t0 > *t1)
+            return false;
+    }
+    return true;
+}
+
+// Moller-Trumbore. Returns the distance along the ray, or a negative value if there's no hit
+static float IntersectRayTriangle(const Ray& ray, const Vector3& v0, const Vector3& v1, const Vector3& v2)
+{
+    Vector3 e1 = v1 - v0;
+    Vector3 e2 = v2 - v0;
+    Vector3 p = cross(ray.m_Direction, e2);
+    float det = dot(e1, p);
+    if (fabsf(det) < 0.0000001f)
+        return -1.0f;
+    float oo_det = 1.0f / det;
+    Vector3 s = ray.m_Origin - v0;
+    float u = dot(s, p) * oo_det;
+    if (u < 0.0f || u > 1.0f)
+        return -1.0f;
+    Vector3 q = cross(s, e1);
+    float v = dot(ray.m_Direction, q) * oo_det;
+    if (v < 0.0f || u + v > 1.0f)
+        return -1.0f;
+    return dot(e2, q) * oo_det;
+}
+
+struct RaycastContext
+{
+    HTerrain        m_Terrain;
+    TerrainPatch*   m_Patch;
+    const Ray*      m_Ray;
+    RaycastHit*     m_Hit;
+    float           m_Step;
+    float           m_GridOrigin[2];    // The ray origin in the grid units of the patch
+    float           m_GridDirection[2];
+    int             m_LeafLevel;        // The last level of the height pyramid
+};
+
+typedef bool (*RaycastCellFn)(RaycastContext* ctx, int x, int z, float ta, float tb);
+
+// 2D DDA over a grid of square cells (in grid units), for the ray range [t0, t1).
+// Calls fn(ctx, cell_x, cell_z, ta, tb) for each cell in ray order, until it returns true
+static bool TraverseGrid(RaycastContext* ctx, float t0, float t1, float cell_size, int num_cells, RaycastCellFn fn)
+{
+    const float* origin = ctx->m_GridOrigin;
+    const float* dir = ctx->m_GridDirection;
+    int cell[2];
+    int step[2];
+    float t_max[2];
+    float t_delta[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        cell[i] = dmMath::Clamp((int)floorf((origin[i] + dir[i] * t0) / cell_size), 0, num_cells - 1);
+        if (fabsf(dir[i]) < 0.000001f)
+        {
+            step[i] = 0;
+            t_max[i] = t1;
+            t_delta[i] = 0;
+            continue;
+        }
+        step[i] = dir[i] > 0 ? 1 : -1;
+        float boundary = (cell[i] + (dir[i] > 0 ? 1 : 0)) * cell_size;
+        t_max[i] = (boundary - origin[i]) / dir[i];
+        t_delta[i] = cell_size / fabsf(dir[i]);
+    }
+
+    float t = t0;
+    while (t < t1)
+    {
+        int axis = t_max[0] < t_max[1] ? 0 : 1;
+        float t_next = dmMath::Min(t_max[axis], t1);
+        if (fn(ctx, cell[0], cell[1], t, t_next))
+            return true;
+
+        t = t_next;
+        cell[axis] += step[axis];
+        t_max[axis] += t_delta[axis];
+        if (cell[axis] < 0 || cell[axis] >= num_cells)
+            break;
+    }
+    return false;
+}
+
+// Returns true if the ray segment [ta, tb] is completely above or below the height range
+static bool IsRayOutsideHeightRange(const Ray& ray, float ta, float tb, float height_min, float height_max)
+{
+    float ya = ray.m_Origin.getY() + ray.m_Direction.getY() * ta;
+    float yb = ray.m_Origin.getY() + ray.m_Direction.getY() * tb;
+    return dmMath::Min(ya, yb) > height_max || dmMath::Max(ya, yb) < height_min;
+}
+
+static Vector3 GetGridPosition(TerrainPatch* patch, float step, int x, int z)
+{
+    return patch->m_Position + Vector3(x * step, GetHeight(patch, x, z), z * step);
+}
+
+// Tests the two triangles of a grid cell, with the same winding as the mesh
+static bool RaycastCell(RaycastContext* ctx, int x, int z, float ta, float tb)
+{
+    TerrainPatch* patch = ctx->m_Patch;
+    const Ray& ray = *ctx->m_Ray;
+
+    Vector3 v0 = GetGridPosition(patch, ctx->m_Step, x, z);
+    Vector3 v1 = GetGridPosition(patch, ctx->m_Step, x, z+1);
+    Vector3 v2 = GetGridPosition(patch, ctx->m_Step, x+1, z+1);
+    Vector3 v3 = GetGridPosition(patch, ctx->m_Step, x+1, z);
+
+    float cell_min = dmMath::Min(dmMath::Min(v0.getY(), v1.getY()), dmMath::Min(v2.getY(), v3.getY()));
+    float cell_max = dmMath::Max(dmMath::Max(v0.getY(), v1.getY()), dmMath::Max(v2.getY(), v3.getY()));
+    if (IsRayOutsideHeightRange(ray, ta, tb, cell_min, cell_max))
+        return false;
+
+    float t = IntersectRayTriangle(ray, v0, v1, v2);
+    Vector3 normal = cross(v1 - v0, v2 - v0);
+    float t2 = IntersectRayTriangle(ray, v2, v3, v0);
+    if (t2 >= 0.0f && (t < 0.0f || t2 < t))
+    {
+        t = t2;
+        normal = cross(v3 - v2, v0 - v2);
+    }
+    if (t < 0.0f || t > ray.m_MaxDistance || t >= ctx->m_Hit->m_Distance)
+        return false;
+
+    // Coarse patches may overlap finer patches, and the finest patch has precedence
+    Vector3 pos = ray.m_Origin + ray.m_Direction * t;
+    if (FindResidentPatch(ctx->m_Terrain, pos.getX(), pos.getZ()) != patch)
+        return false;
+
+    if (normal.getY() < 0.0f)
+        normal = -normal;
+
+    RaycastHit* hit = ctx->m_Hit;
+    hit->m_Hit = true;
+    hit->m_Distance = t;
+    hit->m_Position = pos;
+    hit->m_Normal = normalize(normal);
+    hit->m_Patch = patch;
+    return true;
+}
+
+struct RaycastNodeRange
+{
+    int     m_X;
+    int     m_Z;
+    float   m_T0;
+    float   m_T1;
+};
+
+// Descends the min/max pyramid, visiting the child nodes in ray order.
+// The leaves are traversed cell by cell
+static bool RaycastPyramidNode(RaycastContext* ctx, int level, int x, int z, float t0, float t1)
+{
+    if (level == ctx->m_LeafLevel)
+        return TraverseGrid(ctx, t0, t1, 1.0f, GetPatchSize(0), RaycastCell);
+
+    RaycastNodeRange children[4];
+    int num_children = 0;
+    for (int cz = 0; cz < 2; ++cz)
+    {
+        for (int cx = 0; cx < 2; ++cx)
+        {
+            RaycastNodeRange child = { x * 2 + cx, z * 2 + cz, t0, t1 };
+            Vector3 aabb_min, aabb_max;
+            GetPyramidNodeAABB(ctx->m_Patch, level + 1, child.m_X, child.m_Z, 0.0f, &aabb_min, &aabb_max);
+            if (!IntersectRayAABB(*ctx->m_Ray, aabb_min, aabb_max, &child.m_T0, &child.m_T1))
+                continue;
+
+            int j = num_children++;
+            for (; j > 0 && children[j-1].m_T0 > child.m_T0; --j)
+                children[j] = children[j-1];
+            children[j] = child;
+        }
+    }
+
+    for (int i = 0; i < num_children; ++i)
+    {
+        const RaycastNodeRange& child = children[i];
+        if (RaycastPyramidNode(ctx, level + 1, child.m_X, child.m_Z, child.m_T0, child.m_T1))
+            return true;
+    }
+    return false;
+}
+
+static bool RaycastPatch(HTerrain terrain, TerrainPatch* patch, const Ray& ray, float t0, float t1, RaycastHit* hit)
+{
+    RaycastContext ctx;
+    ctx.m_Terrain = terrain;
+    ctx.m_Patch = patch;
+    ctx.m_Ray = &ray;
+    ctx.m_Hit = hit;
+    ctx.m_Step = GetPatchStep(patch->m_Lod);
+    ctx.m_GridOrigin[0] = (ray.m_Origin.getX() - patch->m_Position.getX()) / ctx.m_Step;
+    ctx.m_GridOrigin[1] = (ray.m_Origin.getZ() - patch->m_Position.getZ()) / ctx.m_Step;
+    ctx.m_GridDirection[0] = ray.m_Direction.getX() / ctx.m_Step;
+    ctx.m_GridDirection[1] = ray.m_Direction.getZ() / ctx.m_Step;
+    ctx.m_LeafLevel = GetPyramidNumLevels() - 1;
+
+    // The range [t0, t1] is within the root node (i.e. the patch bounds)
+    return RaycastPyramidNode(&ctx, 0, 0, 0, t0, t1);
+}
+
+struct RaycastCandidate
+{
+    TerrainPatch*   m_Patch;
+    float           m_T0;
+    float           m_T1;
+};
+
+bool Raycast(HTerrain terrain, const Vector3& origin, const Vector3& direction, float max_distance, RaycastHit* hit)
+{
+    hit->m_Hit = false;
+    hit->m_Distance = FLT_MAX;
+    hit->m_Patch = 0;
+
+    float length = dmVMath::length(direction);
+    if (length < 0.000001f)
+        return false;
+
+    Ray ray;
+    ray.m_Origin = origin;
+    ray.m_Direction = direction / length;
+    ray.m_MaxDistance = max_distance;
+
+    // The loaded patches that the ray passes through, sorted on the entry distance
+    RaycastCandidate candidates[MAX_TOTAL_PATCHES];
+    uint32_t num_candidates = 0;
+    for (int lod = 0; lod < terrain->m_NumLodLevels; ++lod)
+    {
+        TerrainPatchLod* patch_lod = &terrain->m_Terrain[lod];
+        float patch_size = GetPatchSize(lod);
+        for (uint32_t i = 0; i < patch_lod->m_NumPatches; ++i)
+        {
+            TerrainPatch* patch = &patch_lod->m_Patches[i];
+            if (dmAtomicGet32(&patch->m_State) != PS_LOADED)
+                continue;
+
+            const Vector3& pos = patch->m_Position;
+            Vector3 aabb_min(pos.getX(), patch->m_HeightMin * UNSIGNED_TO_HEIGHT_FACTOR, pos.getZ());
+            Vector3 aabb_max(pos.getX() + patch_size, patch->m_HeightMax * UNSIGNED_TO_HEIGHT_FACTOR, pos.getZ() + patch_size);
+            float t0 = 0.0f;
+            float t1 = max_distance;
+            if (!IntersectRayAABB(ray, aabb_min, aabb_max, &t0, &t1))
+                continue;
+
+            RaycastCandidate c = { patch, t0, t1 };
+            uint32_t j = num_candidates++;
+            for (; j > 0 && candidates[j-1].m_T0 > t0; --j)
+                candidates[j] = candidates[j-1];
+            candidates[j] = c;
+        }
+    }
+
+    for (uint32_t i = 0; i < num_candidates; ++i)
+    {
+        // Overlapping patches of different lods may have an earlier hit than the current best
+        if (candidates[i].m_T0 > hit->m_Distance)
+            break;
+        RaycastPatch(terrain, candidates[i].m_Patch, ray, candidates[i].m_T0, candidates[i].m_T1, hit);
+    }
+    return hit->m_Hit;
+}
+
+uint32_t Raycast(HTerrain terrain, uint32_t count, const Vector3* origins, const Vector3* directions, const float* max_distances, RaycastHit* hits)
+{
+    uint32_t num_hits = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (Raycast(terrain, origins[i], directions[i], max_distances[i], &hits[i]))
+            ++num_hits;
+    }
+    return num_hits;
+}
+
+// ****************************************************************************************************************************************************************
+// Editing
+
+// The brush weight at a (patch local) world position, relative to the brush center
+static float GetBrushWeight(const Brush& brush, float dx, float dz)
+{
+    if (brush.m_Mode == BRUSH_STAMP)
+    {
+        // The stamp covers the square [-radius, radius]
+        if (fabsf(dx) > brush.m_Radius || fabsf(dz) > brush.m_Radius)
+            return 0.0f;
+        float u = (dx / brush.m_Radius * 0.5f + 0.5f) * (brush.m_StampSize - 1);
+        float v = (dz / brush.m_Radius * 0.5f + 0.5f) * (brush.m_StampSize - 1);
+        int x0 = dmMath::Min((int)u, (int)brush.m_StampSize - 2);
+        int z0 = dmMath::Min((int)v, (int)brush.m_StampSize - 2);
+        float fx = u - x0;
+        float fz = v - z0;
+        const float* row0 = &brush.m_Stamp[z0 * brush.m_StampSize + x0];
+        const float* row1 = row0 + brush.m_StampSize;
+        float h0 = row0[0] + (row0[1] - row0[0]) * fx;
+        float h1 = row1[0] + (row1[1] - row1[0]) * fx;
+        return h0 + (h1 - h0) * fz;
+    }
+
+    float distance = sqrtf(dx * dx + dz * dz);
+    if (distance >= brush.m_Radius)
+        return 0.0f;
+    if (brush.m_Falloff <= 0.0f)
+        return 1.0f;
+    float t = Clampf(0.0f, 1.0f, (brush.m_Radius - distance) / (brush.m_Radius * brush.m_Falloff));
+    return t * t * (3.0f - 2.0f * t);
+}
+
+static float ApplyBrush(const Brush& brush, float h, float weight)
+{
+    switch(brush.m_Mode)
+    {
+    case BRUSH_RAISE:   return h + brush.m_Strength * weight;
+    case BRUSH_LOWER:   return h - brush.m_Strength * weight;
+    case BRUSH_FLATTEN: return h + (brush.m_Position.getY() - h) * Clampf(0.0f, 1.0f, brush.m_Strength * weight);
+    case BRUSH_STAMP:   return h + brush.m_Strength * weight; // The stamp height is part of the weight
+    default:            assert(false); return h;
+    }
+}
+
+// Applies the brush to the heightmap samples (including the border) within the brush.
+// Since the brush only depends on the world position, the samples shared with the neighbors get the same values.
+// Returns false if no sample was changed. Otherwise, the changed grid rect [min, max] is returned (may include the border)
+static bool ApplyBrush(TerrainPatch* patch, const Brush& brush, int rect_min[2], int rect_max[2])
+{
+    int patch_size = GetPatchSize(0);
+    int size = patch_size + 3;
+    float step = GetPatchStep(patch->m_Lod);
+    float cx = brush.m_Position.getX() - patch->m_Position.getX();
+    float cz = brush.m_Position.getZ() - patch->m_Position.getZ();
+
+    int x_begin = Clampi(-1, patch_size + 2, (int)floorf((cx - brush.m_Radius) / step));
+    int x_end   = Clampi(-1, patch_size + 2, (int)ceilf((cx + brush.m_Radius) / step) + 1);
+    int z_begin = Clampi(-1, patch_size + 2, (int)floorf((cz - brush.m_Radius) / step));
+    int z_end   = Clampi(-1, patch_size + 2, (int)ceilf((cz + brush.m_Radius) / step) + 1);
+
+    bool changed = false;
+    rect_min[0] = rect_min[1] = patch_size + 1;
+    rect_max[0] = rect_max[1] = -1;
+    for (int z = z_begin; z < z_end; ++z)
+    {
+        uint16_t* row = &patch->m_Heightmap[(z + 1) * size + 1];
+        for (int x = x_begin; x < x_end; ++x)
+        {
+            float weight = GetBrushWeight(brush, x * step - cx, z * step - cz);
+            if (weight == 0.0f)
+                continue;
+
+            float h = ApplyBrush(brush, row[x] * UNSIGNED_TO_HEIGHT_FACTOR, weight);
+            uint16_t uh = (uint16_t)(Clampf(0.0f, HEIGHT_SCALE, h) / UNSIGNED_TO_HEIGHT_FACTOR + 0.5f);
+            if (uh == row[x])
+                continue;
+            row[x] = uh;
+
+            changed = true;
+            rect_min[0] = dmMath::Min(rect_min[0], x);
+            rect_min[1] = dmMath::Min(rect_min[1], z);
+            rect_max[0] = dmMath::Max(rect_max[0], x);
+            rect_max[1] = dmMath::Max(rect_max[1], z);
+        }
+    }
+    return changed;
+}
+
+// Regenerates the vertices affected by the changed heights in the grid rect [rect_min, rect_max]
+static void UpdatePatchVertices(HTerrain terrain, TerrainPatch* patch, const int rect_min[2], const int rect_max[2])
+{
+    int patch_size = GetPatchSize(0);
+    bool indexed = terrain->m_Indexed;
+
+    // The normals depend on the neighboring heights, as do the stitched edge vertices
+    int vert_min[2], vert_max[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        vert_min[i] = Clampi(0, patch_size, rect_min[i] - 1);
+        vert_max[i] = Clampi(0, patch_size, rect_max[i] + 1);
+    }
+
+    // The range of leaves containing the changed heights. Heights on a leaf edge are shared by the neighbor leaves
+    int num_leaves = 1 << (GetPyramidNumLevels() - 1);
+    int leaf_begin[2], leaf_end[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        int h_min = Clampi(0, patch_size, rect_min[i]);
+        int h_max = Clampi(0, patch_size, rect_max[i]);
+        leaf_begin[i] = Clampi(0, num_leaves - 1, (h_min - 1) / PYRAMID_LEAF_SIZE);
+        leaf_end[i] = Clampi(1, num_leaves, h_max / PYRAMID_LEAF_SIZE + 1);
+    }
+    UpdatePatchHeightRange(patch, leaf_begin, leaf_end);
+
+    uint32_t coarser_edges = GetCoarserEdges(terrain, patch);
+    GridVertex* scratch = GetScratch(terrain, dmWorkerPool::GetNumWorkers(terrain->m_WorkerPool) + 1);
+
+    // For non indexed buffers, each quad touching a changed vertex is rewritten
+    uint32_t row_begin, row_end, col_begin, col_end;
+    if (indexed)
+    {
+        row_begin = vert_min[1]; row_end = vert_max[1] + 1;
+        col_begin = vert_min[0]; col_end = vert_max[0] + 1;
+    }
+    else
+    {
+        row_begin = dmMath::Max(vert_min[1] - 1, 0); row_end = dmMath::Min(vert_max[1], patch_size - 1) + 1;
+        col_begin = dmMath::Max(vert_min[0] - 1, 0); col_end = dmMath::Min(vert_max[0], patch_size - 1) + 1;
+    }
+    GenerateVertexData(patch, indexed, coarser_edges, row_begin, row_end, col_begin, col_end, scratch);
+
+    bool edge = vert_min[0] == 0 || vert_min[1] == 0 || vert_max[0] == patch_size || vert_max[1] == patch_size;
+    if (edge)
+        GenerateSkirts(patch, indexed, coarser_edges);
+
+    // Merge with any previous changes that haven't been handled yet
+    if (patch->m_Dirty)
+    {
+        vert_min[0] = dmMath::Min(vert_min[0], (int)patch->m_DirtyMin[0]);
+        vert_min[1] = dmMath::Min(vert_min[1], (int)patch->m_DirtyMin[1]);
+        vert_max[0] = dmMath::Max(vert_max[0], (int)patch->m_DirtyMax[0]);
+        vert_max[1] = dmMath::Max(vert_max[1], (int)patch->m_DirtyMax[1]);
+        edge = edge || patch->m_DirtySkirts;
+    }
+    patch->m_DirtyMin[0] = (uint16_t)vert_min[0];
+    patch->m_DirtyMin[1] = (uint16_t)vert_min[1];
+    patch->m_DirtyMax[0] = (uint16_t)vert_max[0];
+    patch->m_DirtyMax[1] = (uint16_t)vert_max[1];
+    patch->m_DirtySkirts = edge;
+}
+
+uint32_t Edit(HTerrain terrain, const Brush& brush)
+{
+    if (brush.m_Radius <= 0.0f)
+        return 0;
+    if (brush.m_Mode == BRUSH_STAMP && (!brush.m_Stamp || brush.m_StampSize < 2))
+    {
+        dmLogError("The stamp brush needs a stamp of at least 2x2 values");
+        return 0;
+    }
+
+    uint32_t num_changed = 0;
+    for (int lod = 0; lod < terrain->m_NumLodLevels; ++lod)
+    {
+        for (uint32_t i = 0; i < terrain->m_Terrain[lod].m_NumPatches; ++i)
+        {
+            // Loaded patches aren't written to by the terrain thread, and they keep their data until
+            // the Lua callback for the unload has been invoked on this thread
+            TerrainPatch* patch = &terrain->m_Terrain[lod].m_Patches[i];
+            if (dmAtomicGet32(&patch->m_State) != PS_LOADED)
+                continue;
+
+            int rect_min[2], rect_max[2];
+            if (!ApplyBrush(patch, brush, rect_min, rect_max))
+                continue;
+
+            bool was_dirty = patch->m_Dirty;
+            UpdatePatchVertices(terrain, patch, rect_min, rect_max);
+            patch->m_Dirty = 1;
+            patch->m_Edited = 1;
+            ++num_changed;
+
+            if (!was_dirty)
+                terrain->m_Callback(TERRAIN_PATCH_UPDATE, patch);
+        }
+    }
+    return num_changed;
+}
+
+void GetDirtyVertexRange(HTerrain terrain, const TerrainPatch* patch, uint32_t* first_vertex, uint32_t* num_vertices)
+{
+    uint32_t patch_size = GetPatchSize(0);
+    uint32_t num_verts = patch_size + 1;
+    uint32_t first, last;
+    if (terrain->m_Indexed)
+    {
+        first = patch->m_DirtyMin[1] * num_verts + patch->m_DirtyMin[0];
+        last = patch->m_DirtyMax[1] * num_verts + patch->m_DirtyMax[0] + 1;
+    }
+    else
+    {
+        // The quads touching the dirty vertices
+        uint32_t z_begin = patch->m_DirtyMin[1] > 0 ? patch->m_DirtyMin[1] - 1 : 0;
+        uint32_t z_end = dmMath::Min((uint32_t)patch->m_DirtyMax[1], patch_size - 1) + 1;
+        first = z_begin * patch_size * 2 * 3;
+        last = z_end * patch_size * 2 * 3;
+    }
+
+    // The skirts are stored after the grid vertices
+    if (patch->m_DirtySkirts)
+    {
+        uint32_t count = 0;
+        dmBuffer::GetCount(patch->m_Buffer, &count);
+        last = count;
+    }
+
+    *first_vertex = first;
+    *num_vertices = last - first;
+}
+
+void ReloadPatch(HTerrain terrain, uint32_t id)
+{
+    PushJob(terrain, JOB_RELOAD, id);
+}
+
+void GetMemoryStats(HTerrain terrain, MemoryStats* stats)
+{
+    DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
+    *stats = terrain->m_Stats;
+}
+
+dmBuffer::HBuffer GetIndexBuffer(HTerrain terrain)
+{
+    return terrain->m_IndexBuffer;
+}
+
+float GetHeightScale(HTerrain terrain)
+{
+    return HEIGHT_SCALE;
+}
 
 void DebugPrint(HTerrain terrain)
 {
     DM_MUTEX_SCOPED_LOCK(terrain->m_ThreadMutex);
 
-    for (int lod = 0; lod < NUM_LOD_LEVELS; ++lod)
+    for (int lod = 0; lod < terrain->m_NumLodLevels; ++lod)
     {
         TerrainPatchLod* patchlod = &terrain->m_Terrain[lod];
         printf("LOD %d: cam x/z: %d %d\n", lod, patchlod->m_CameraXZ[0], patchlod->m_CameraXZ[1]);
 
-        for (int i = 0; i < NUM_PATCHES; ++i)
+        for (uint32_t i = 0; i < terrain->m_Terrain[lod].m_NumPatches; ++i)
         {
             TerrainPatch* patch = &terrain->m_Terrain[lod].m_Patches[i];
             printf("  p %d: x/z: %d, %d  s: %d  ds: %d lua: %d  p: %p\n", i, patch->m_XZ[0], patch->m_XZ[1],
@@ -923,6 +2953,19 @@ void DebugPrint(HTerrain terrain)
         }
     }
 
+    if (terrain->m_PatchCache)
+    {
+        uint32_t num_entries, num_hits, num_misses;
+        uint64_t size;
+        PatchCache_GetStats(terrain->m_PatchCache, &num_entries, &size, &num_hits, &num_misses);
+        printf("Patch cache: %u entries  %llu bytes  hits: %u  misses: %u\n", num_entries, (unsigned long long)size, num_hits, num_misses);
+    }
+
+    const MemoryStats& stats = terrain->m_Stats;
+    if (stats.m_NumPatchesRead)
+        printf("Read: %u patches  %.3f ms/patch\n", stats.m_NumPatchesRead, stats.m_ReadTime / 1000.0 / stats.m_NumPatchesRead);
+    if (stats.m_NumPatchesBuilt)
+        printf("Built: %u patches  %.3f ms/patch\n", stats.m_NumPatchesBuilt, stats.m_BuildTime / 1000.0 / stats.m_NumPatchesBuilt);
 }
 
 } // namespace
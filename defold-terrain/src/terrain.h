@@ -13,8 +13,14 @@ namespace dmTerrain {
     {
         TERRAIN_PATCH_HIDE,
         TERRAIN_PATCH_SHOW,
+        TERRAIN_PATCH_INVISIBLE,    // A shown patch left the view frustum
+        TERRAIN_PATCH_VISIBLE,      // A shown patch entered the view frustum
+        TERRAIN_PATCH_UPDATE,       // A loaded patch was edited, see m_DirtyMin/m_DirtyMax
+        TERRAIN_PATCH_COVERAGE,     // The quarters of a shown patch that are drawn by the finer lod changed, see m_CoveredQuarters
     };
 
+    static const uint32_t PATCH_NUM_TILES = 8; // Number of sub tiles (per side) in a patch, used for culling
+
     enum PatchState
     {
         PS_UNLOADED,
@@ -23,6 +29,15 @@ namespace dmTerrain {
         PS_UNLOADING,
     };
 
+    // The heightmap of a patch that is loaded from file (see patch_reader.h)
+    enum PatchReadState
+    {
+        PRS_NONE,
+        PRS_READING,
+        PRS_READ,
+        PRS_FAILED,     // The heights are flat (0) instead
+    };
+
     struct TerrainPatch;
 
     struct DM_ALIGNED(16) TerrainPatch
@@ -35,43 +50,164 @@ namespace dmTerrain {
         uint16_t            m_HeightMin;
         uint16_t            m_HeightMax;
         int                 m_XZ[2];        // Unit coords (world space). First patch is (0,0), second is (1,0)
-        uint32_t            m_Id:8;         // An id to separate the patch from all the other patches.
+        uint32_t            m_Id:16;        // An id to separate the patch from all the other patches.
         uint32_t            m_Lod:4;
         uint32_t            m_Generate:1;   // 0 = load from file, 1 = Generate through noise
-        uint32_t            :19;
+        uint32_t            m_CompactVertices:1; // See InitParams::m_CompactVertices
+        uint32_t            :10;
+
+        uint16_t*           m_HeightPyramid; // Min/max height pairs of a quad tree over the heightmap (root first)
+        uint64_t            m_VisibleTiles; // One bit per sub tile (x + z * PATCH_NUM_TILES) inside the view frustum. Updated on the main thread, passed to Lua as "visible_tiles"
+        uint8_t             m_Visible;      // If the patch is inside the view frustum. Updated on the main thread
+        // One bit per quarter of the patch (x + 2 * z) that is covered by a shown patch of the finer lod.
+        // These quarters must not be drawn, see terrain.fp. Updated on the main thread
+        uint8_t             m_CoveredQuarters;
+
+        // The grid vertices [m_DirtyMin, m_DirtyMax] changed by Edit(). Updated on the main thread.
+        // The receiver of TERRAIN_PATCH_UPDATE sets m_Dirty to 0 when it has uploaded the changes
+        uint16_t            m_DirtyMin[2];
+        uint16_t            m_DirtyMax[2];
+        uint8_t             m_Dirty;
+        uint8_t             m_DirtySkirts;  // The skirt vertices were also changed
+        uint8_t             m_Edited;       // Edit() changed the heights since the patch was loaded, so its data isn't kept when unloaded
 
         // PatchState
         int32_atomic_t      m_State;
         int32_atomic_t      m_DataState;
+        int32_atomic_t      m_ReadState;    // PatchReadState
         int32_atomic_t      m_LuaCallback;  // 1 = Lua callback occurred
     };
 
     typedef struct TerrainWorld* HTerrain;
 
+    // All memory is allocated when the terrain is created
+    struct MemoryStats
+    {
+        uint64_t    m_HeightmapBytes;
+        uint64_t    m_VertexBufferBytes;
+        uint64_t    m_IndexBufferBytes;
+        uint64_t    m_ScratchBytes;
+        uint64_t    m_HeightPyramidBytes;
+        uint32_t    m_NumPatches;       // Number of preallocated patches (all lods)
+        uint32_t    m_NumPatchesInUse;  // Patches that aren't unloaded
+        uint32_t    m_MaxPatchesInUse;  // The high-water mark of m_NumPatchesInUse
+        uint32_t    m_NumPatchesCached; // Unloaded patches that still have their data
+        uint32_t    m_NumPatchesRead;   // Heightmaps read from file, on the reader thread
+        uint32_t    m_NumPatchesBuilt;  // Patches made ready on the terrain thread (heights if needed, vertices)
+        uint64_t    m_ReadTime;         // Microseconds spent reading heightmaps
+        uint64_t    m_BuildTime;        // Microseconds spent building the patches
+    };
+
     struct InitParams
     {
         int     m_BasePatchSize; // must be power of two
+        // Each grid vertex is stored once, and the triangles are described by the index buffer (see GetIndexBuffer()).
+        // Note: A Defold mesh component only draws non indexed triangle lists, so the sample (main.script) can't render
+        // this mode. It is only useful with a custom render path that can draw the index buffer
+        bool    m_Indexed;
+        bool    m_CompactVertices; // uint16 positions and octahedral normals, without the color stream (10 instead of 27 bytes per vertex). Use with terrain_compact.material
+        int     m_NumWorkers;    // Number of extra threads used when generating patches [0, 15]
+        bool    m_SingleThreaded; // Generate the patches in Update(), a few rows per frame, instead of on the terrain thread (e.g. for HTML5)
+        float   m_FrameBudget;   // Single threaded only: the max milliseconds per Update() spent generating patches. 0 = a quarter of UpdateParams::m_Dt
+        int     m_NumLodLevels;  // Number of lod rings. Each level covers twice the area of the previous level, with the same number of vertices
+        int     m_RingRadius;    // Number of patches loaded on each side of the camera patch (1 = 3x3 patches, 2 = 5x5 patches, ...)
+        bool    m_CircularRing;  // Only load the patches within the ring radius, skipping the corners of the square
+        float   m_UnloadMargin;  // World units the camera must move into a neighboring patch, before the rings move with it. Avoids reloading patches when moving along a patch edge
+        int     m_NumCachedPatches; // Extra patches per lod, keeping the data of recently unloaded patches, so they can be shown again without regenerating them
+        const char* m_CachePath; // An existing directory where the generated heightmaps are cached. 0 = no disk cache
+        uint64_t    m_CacheMaxSize; // The max size of the disk cache (bytes)
+        const char* m_HeightmapPath; // A tiled heightmap (.terrain, see tile_format.h) or a square raw heightmap (.r16/.r32/8 bit) to load the heights from, instead of generating them. 0 = generate
         Matrix4 m_View; // Camera position
-        Matrix4 m_Proj; // Used for frustum culling (later on)
+        Matrix4 m_Proj; // Used for frustum culling
 
-        void (*m_Callback)(TerrainEvents event, TerrainPatch* patch);
+        // Returns false if the event can't be taken right now (e.g. the event queue is full).
+        // TERRAIN_PATCH_SHOW and TERRAIN_PATCH_HIDE are then sent again later, the other events are always sent from the main thread
+        bool (*m_Callback)(TerrainEvents event, TerrainPatch* patch);
     };
 
     struct UpdateParams
     {
-        float   m_Dt;
+        float   m_Dt;   // Seconds. Used for the generation time budget when single threaded (see InitParams::m_FrameBudget)
         Matrix4 m_View; // Camera position
-        Matrix4 m_Proj; // Used for frustum culling (later on)
+        Matrix4 m_Proj; // Used for frustum culling
     };
 
     HTerrain Create(const InitParams& params);
     void Update(HTerrain terrain, const UpdateParams& params);
     void Destroy(HTerrain terrain);
 
+    // Regenerates the patch with the given id
+    void ReloadPatch(HTerrain terrain, uint32_t id);
+
     // Helper functions
-    int GetPatchSize(int lod);
+    int GetPatchSize(int lod);      // The size of a patch in world units
+    int GetPatchStep(int lod);      // The distance between two vertices in world units
     void WorldToPatchCoord(const Vector3& pos, uint32_t lod, int xz[2]);
     Vector3 PatchToWorldCoord(int xz[2], uint32_t lod);
 
+    // Gets the shown patches that are inside the view frustum (from the last Update())
+    // Returns the total number of visible patches, which may be larger than max_patches
+    uint32_t GetVisiblePatches(HTerrain terrain, TerrainPatch** patches, uint32_t max_patches);
+
+    void GetMemoryStats(HTerrain terrain, MemoryStats* stats);
+
+    // Height queries (world space). Uses the finest loaded patch, and evaluates the noise function if there is none.
+    // Must be called on the same thread as Update()
+    float GetHeight(HTerrain terrain, float x, float z);
+    float GetHeightAndNormal(HTerrain terrain, float x, float z, Vector3* normal);
+    // Batched version. The out_normals may be 0
+    void GetHeights(HTerrain terrain, uint32_t count, const float* x, const float* z, float* out_heights, Vector3* out_normals);
+
+    struct RaycastHit
+    {
+        Vector3         m_Position;
+        Vector3         m_Normal;
+        float           m_Distance;
+        TerrainPatch*   m_Patch;
+        bool            m_Hit;
+    };
+
+    // Intersects rays with the triangles of the loaded patches (i.e. no hits outside of the loaded area).
+    // The direction doesn't need to be normalized. Must be called on the same thread as Update()
+    bool Raycast(HTerrain terrain, const Vector3& origin, const Vector3& direction, float max_distance, RaycastHit* hit);
+    // Batched version. Returns the number of hits
+    uint32_t Raycast(HTerrain terrain, uint32_t count, const Vector3* origins, const Vector3* directions, const float* max_distances, RaycastHit* hits);
+
+    enum BrushMode
+    {
+        BRUSH_RAISE,
+        BRUSH_LOWER,
+        BRUSH_FLATTEN,  // Moves the heights towards the brush height (m_Position.y)
+        BRUSH_STAMP,    // Adds the stamp heights (scaled by the strength) to the square covered by the brush
+    };
+
+    struct Brush
+    {
+        BrushMode       m_Mode;
+        Vector3         m_Position;     // World space center
+        float           m_Radius;       // World units
+        float           m_Strength;     // Height units (for flatten, the fraction [0,1] to move towards the brush height)
+        float           m_Falloff;      // The outer fraction of the radius that fades out smoothly. 0 = hard edge
+        const float*    m_Stamp;        // m_StampSize * m_StampSize values, row by row (+z)
+        uint32_t        m_StampSize;
+    };
+
+    // Modifies the heights of the loaded patches, and regenerates the affected vertices.
+    // Each changed patch gets a TERRAIN_PATCH_UPDATE event, unless it's already dirty.
+    // The edits are lost when the patch is unloaded, also for the patches kept by InitParams::m_NumCachedPatches.
+    // Must be called on the same thread as Update()
+    // Returns the number of changed patches
+    uint32_t Edit(HTerrain terrain, const Brush& brush);
+
+    // Gets the range of vertices in the patch buffer that covers the dirty vertices
+    void GetDirtyVertexRange(HTerrain terrain, const TerrainPatch* patch, uint32_t* first_vertex, uint32_t* num_vertices);
+
+    // Returns the index buffer shared by all patches, or 0 if the terrain isn't indexed.
+    // Not drawable with a mesh component, see InitParams::m_Indexed
+    dmBuffer::HBuffer GetIndexBuffer(HTerrain terrain);
+
+    // The world height of the max height value (65535). Needed to decode the compact vertices
+    float GetHeightScale(HTerrain terrain);
+
     void DebugPrint(HTerrain terrain);
 }
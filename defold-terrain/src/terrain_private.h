@@ -6,17 +6,83 @@
 #include <dmsdk/dlib/condition_variable.h>
 #include "terrain.h"
 #include "rng.h"
+#include "worker_pool.h"
+#include "patch_cache.h"
+#include "patch_reader.h"
 
 namespace dmTerrain {
 
-    const uint32_t NUM_LOD_LEVELS = 1; // Todo: make this configurable
-    const uint32_t NUM_PATCHES = 9;
-    const uint32_t NUM_TOTAL_PATCHES = NUM_LOD_LEVELS * NUM_PATCHES;
+    const uint32_t MAX_LOD_LEVELS = 4;
+    const int      MAX_RING_RADIUS = 7;
+    const uint32_t MAX_RING_SLOTS = (2*MAX_RING_RADIUS+1) * (2*MAX_RING_RADIUS+1);
+    const uint32_t MAX_TOTAL_PATCHES = MAX_LOD_LEVELS * MAX_RING_SLOTS;
+    const int      MAX_WORKERS = 15; // One patch is generated per thread (the workers and the terrain thread) per pass
+
+    enum PatchEdge
+    {
+        EDGE_WEST,  // -x
+        EDGE_EAST,  // +x
+        EDGE_NORTH, // -z
+        EDGE_SOUTH, // +z
+        NUM_EDGES,
+    };
+
+    struct GridVertex
+    {
+        Vector3 m_Position;
+        Vector3 m_Normal;
+    };
+
+    // The data of an unloaded patch is kept until the patch is needed for another slot
+    struct UnloadedPatch
+    {
+        int         m_XZ[2];    // The coords of the patch when it was unloaded
+        uint32_t    m_Time;     // When the patch was unloaded. 0 = the data isn't valid
+    };
 
     struct DM_ALIGNED(16) TerrainPatchLod
     {
-        TerrainPatch    m_Patches[NUM_PATCHES];
+        TerrainPatch*   m_Patches;
+        uint8_t         (*m_NeighborLods)[NUM_EDGES]; // The lod of the neighbors of each patch, when it was loaded
+        UnloadedPatch*  m_Unloaded;    // One per patch
+        uint32_t        m_NumPatches;  // One patch per slot in the ring, plus the cached patches
         int             m_CameraXZ[2]; // The camera pos in patch space
+        TerrainPatch**  m_Resident;    // The loaded patches, one per ring slot. Updated on the main thread, for the height queries
+        int             m_ResidentOrigin[2]; // The patch coord of the first slot in m_Resident
+    };
+
+    enum TerrainJobType
+    {
+        JOB_UPDATE,     // Reevaluate which patches to load/unload (e.g. the camera moved to a new patch)
+        JOB_RELOAD,     // Regenerate a patch
+    };
+
+    // The steps of building a patch when single threaded (see GeneratePatchesSliced()).
+    // Each step, or row of a step, is done in one go, and the frame budget is checked in between
+    enum SliceStep
+    {
+        SLICE_READ_HEIGHTS,     // From the heightmap file, or the disk cache
+        SLICE_HEIGHT_ROWS,      // Generated, if they couldn't be read
+        SLICE_STORE_HEIGHTS,    // The generated heights, to the disk cache
+        SLICE_HEIGHT_RANGE,
+        SLICE_VERTEX_ROWS,
+        SLICE_SKIRTS,
+    };
+
+    struct TerrainJob
+    {
+        TerrainJobType  m_Type;
+        uint32_t        m_PatchId;
+    };
+
+    // Reads the heights of the patches from a file (see loader_file.h, loader_tiles.h)
+    struct HeightmapLoader
+    {
+        void*   (*m_Init)(const char* path);
+        void    (*m_Exit)(void* ctx);
+        bool    (*m_Load)(void* ctx, struct TerrainPatch* patch);
+        float   (*m_GetHeight)(void* ctx, float x, float z);
+        float   (*m_GetHeightScale)(void* ctx); // May be 0, if the format doesn't know the scale
     };
 
     struct DM_ALIGNED(16) TerrainWorld
@@ -26,18 +92,47 @@ namespace dmTerrain {
         Vector3 m_CameraPos;// Camera position
         Vector3 m_CameraDir;// Camera dir
 
-        TerrainPatchLod m_Terrain[NUM_LOD_LEVELS];
+        TerrainPatchLod m_Terrain[MAX_LOD_LEVELS];
+        int             m_NumLodLevels;
+        int             m_RingRadius;   // Number of patches around the camera patch
+        bool            m_CircularRing; // Skip the corners of the ring
+        uint32_t        m_UnloadTime;   // Increased for each unloaded patch
+        float           m_UnloadMargin; // World units
+
+        dmBuffer::HBuffer m_IndexBuffer; // Shared by all patches (if m_Indexed is set)
+        bool m_Indexed;
 
         dmRng::Rng m_Rng;
+        uint32_t   m_HeightSeed;
 
         int32_atomic_t      m_ThreadActive;
         dmThread::Thread    m_Thread;
         dmMutex::HMutex     m_ThreadMutex;
         dmConditionVariable::HConditionVariable m_ThreadCondition;
+        dmArray<TerrainJob> m_Jobs;         // Protected by m_ThreadMutex. The thread sleeps while it's empty
+
+        // Single threaded generation (see GeneratePatchesSliced())
+        TerrainPatch*   m_SlicedPatch;      // The patch being generated. 0 = none
+        uint32_t        m_SlicedStep;       // SliceStep of m_SlicedPatch
+        uint32_t        m_SlicedRow;        // The next row of m_SlicedStep
+        uint64_t        m_SliceDeadline;    // When to stop generating in this Update() (dmTime::GetTime())
+        float           m_FrameBudget;      // Milliseconds. 0 = derived from UpdateParams::m_Dt
+
+        dmWorkerPool::HWorkerPool m_WorkerPool; // Used by the terrain thread to generate patches in parallel
+
+        uint16_t*   m_Heightmaps;           // The heightmaps of all patches
+        uint16_t*   m_HeightPyramids;       // The min/max height pyramids of all patches
+        GridVertex* m_Scratch;              // Scratch memory for the terrain thread and each worker
+        uint32_t    m_ScratchSizePerWorker; // Number of vertices
+        MemoryStats m_Stats;                // Protected by m_ThreadMutex
+
+        HPatchCache m_PatchCache;           // Used by the terrain thread. May be 0
 
-        void* m_LoaderContext;
+        const HeightmapLoader*  m_Loader;   // 0 = the heights are generated
+        void*                   m_LoaderContext;
+        HPatchReader            m_PatchReader;  // Reads the heightmaps when there's a loader
 
-        void (*m_Callback)(TerrainEvents event, TerrainPatch* patch);
+        bool (*m_Callback)(TerrainEvents event, TerrainPatch* patch);
     };
 
     typedef TerrainWorld* HTerrain;
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+
+namespace dmTerrain
+{
+    // A tiled heightmap container (.terrain), written by tools/convert_heightmap.
+    //
+    //  TileFileHeader
+    //  TileFileEntry[sum of the tiles of all levels]  (level by level, row by row)
+    //  the compressed tiles (see compress.h)
+    //
+    // Level l holds every (1 << l):th sample of level 0, which is what a patch of lod l uses,
+    // so a patch of any stored lod is read from one tile.
+    // A tile covers m_TileSize x m_TileSize samples, and is stored with an apron of one sample before and
+    // two samples after it (the border of a patch), with the edge samples repeated outside of the heightmap.
+    // All values are little endian
+
+    static const uint32_t TILE_FILE_MAGIC = 0x54485444; // "DTHT"
+    static const uint32_t TILE_FILE_VERSION = 1;
+    static const uint32_t TILE_FILE_MAX_LEVELS = 8;
+    static const uint32_t TILE_APRON_BEFORE = 1;
+    static const uint32_t TILE_APRON_AFTER = 2;
+
+    struct TileFileHeader
+    {
+        uint32_t    m_Magic;
+        uint32_t    m_Version;
+        uint32_t    m_Width;        // Level 0 samples
+        uint32_t    m_Height;
+        uint32_t    m_TileSize;     // Samples per side, excluding the apron
+        uint32_t    m_NumLevels;
+        float       m_HeightScale;  // The world height of the max value (65535)
+        uint32_t    m_Reserved;
+    };
+
+    struct TileFileEntry
+    {
+        uint64_t    m_Offset;       // From the start of the file
+        uint32_t    m_Size;         // The compressed size
+        uint32_t    m_Reserved;
+    };
+
+    // The number of samples per side of a level
+    static inline uint32_t GetTileLevelSize(uint32_t size, uint32_t level)
+    {
+        return (size + (1u << level) - 1) >> level;
+    }
+
+    // The number of samples per side of a stored tile
+    static inline uint32_t GetTileStoredSize(uint32_t tile_size)
+    {
+        return TILE_APRON_BEFORE + tile_size + TILE_APRON_AFTER;
+    }
+}
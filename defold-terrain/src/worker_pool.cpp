@@ -0,0 +1,184 @@
+#include <dmsdk/sdk.h>
+#include <dmsdk/dlib/atomic.h>
+#include <dmsdk/dlib/thread.h>
+#include <dmsdk/dlib/condition_variable.h>
+#include "worker_pool.h"
+
+namespace dmWorkerPool
+{
+    struct Batch
+    {
+        RangeFunc   m_Fn;
+        void*       m_Ctx;
+        uint32_t    m_Count;
+        uint32_t    m_ChunkSize;
+        uint32_t    m_NumChunks;
+    };
+
+    struct WorkerPool;
+
+    struct WorkerContext
+    {
+        WorkerPool* m_Pool;
+        uint32_t    m_Index;
+    };
+
+    struct WorkerPool
+    {
+        dmArray<dmThread::Thread>   m_Threads;
+        WorkerContext*              m_Contexts;
+        dmMutex::HMutex             m_Mutex;
+        dmConditionVariable::HConditionVariable m_WorkCondition; // Signaled when a new batch is available
+        dmConditionVariable::HConditionVariable m_DoneCondition; // Signaled when a worker is done with a batch
+
+        // Protected by m_Mutex
+        Batch           m_Batch;
+        uint32_t        m_Generation;   // Incremented for each new batch
+        uint32_t        m_NumRunning;   // Number of workers currently processing the batch
+
+        int32_atomic_t  m_NextChunk;
+        int32_atomic_t  m_Active;
+    };
+
+    static void RunChunks(WorkerPool* pool, uint32_t worker_index, const Batch& batch)
+    {
+        while (true)
+        {
+            uint32_t chunk = (uint32_t)dmAtomicIncrement32(&pool->m_NextChunk);
+            if (chunk >= batch.m_NumChunks)
+                break;
+
+            uint32_t begin = chunk * batch.m_ChunkSize;
+            uint32_t end = begin + batch.m_ChunkSize;
+            if (end > batch.m_Count)
+                end = batch.m_Count;
+            batch.m_Fn(batch.m_Ctx, worker_index, begin, end);
+        }
+    }
+
+    static void WorkerThread(void* ctx)
+    {
+        WorkerContext* worker = (WorkerContext*)ctx;
+        WorkerPool* pool = worker->m_Pool;
+        uint32_t generation = 0;
+
+        while (true)
+        {
+            Batch batch;
+            {
+                DM_MUTEX_SCOPED_LOCK(pool->m_Mutex);
+                while (dmAtomicGet32(&pool->m_Active) && generation == pool->m_Generation)
+                {
+                    dmConditionVariable::Wait(pool->m_WorkCondition, pool->m_Mutex);
+                }
+                if (!dmAtomicGet32(&pool->m_Active))
+                    break;
+
+                generation = pool->m_Generation;
+                batch = pool->m_Batch;
+                pool->m_NumRunning++;
+            }
+
+            RunChunks(pool, worker->m_Index, batch);
+
+            {
+                DM_MUTEX_SCOPED_LOCK(pool->m_Mutex);
+                pool->m_NumRunning--;
+                dmConditionVariable::Broadcast(pool->m_DoneCondition);
+            }
+        }
+    }
+
+    HWorkerPool New(uint32_t num_workers)
+    {
+        WorkerPool* pool = new WorkerPool;
+        pool->m_Mutex = dmMutex::New();
+        pool->m_WorkCondition = dmConditionVariable::New();
+        pool->m_DoneCondition = dmConditionVariable::New();
+        pool->m_Generation = 0;
+        pool->m_NumRunning = 0;
+        dmAtomicStore32(&pool->m_NextChunk, 0);
+        dmAtomicStore32(&pool->m_Active, 1);
+
+        pool->m_Contexts = new WorkerContext[num_workers];
+        pool->m_Threads.SetCapacity(num_workers);
+        for (uint32_t i = 0; i < num_workers; ++i)
+        {
+            pool->m_Contexts[i].m_Pool = pool;
+            pool->m_Contexts[i].m_Index = i + 1; // 0 is the calling thread
+            pool->m_Threads.Push(dmThread::New(WorkerThread, 0x80000, &pool->m_Contexts[i], "terrain_worker"));
+        }
+        return pool;
+    }
+
+    void Delete(HWorkerPool pool)
+    {
+        {
+            DM_MUTEX_SCOPED_LOCK(pool->m_Mutex);
+            dmAtomicStore32(&pool->m_Active, 0);
+            dmConditionVariable::Broadcast(pool->m_WorkCondition);
+        }
+
+        for (uint32_t i = 0; i < pool->m_Threads.Size(); ++i)
+        {
+            dmThread::Join(pool->m_Threads[i]);
+        }
+
+        dmConditionVariable::Delete(pool->m_DoneCondition);
+        dmConditionVariable::Delete(pool->m_WorkCondition);
+        dmMutex::Delete(pool->m_Mutex);
+        delete[] pool->m_Contexts;
+        delete pool;
+    }
+
+    uint32_t GetNumWorkers(HWorkerPool pool)
+    {
+        return pool ? pool->m_Threads.Size() : 0;
+    }
+
+    void ParallelFor(HWorkerPool pool, uint32_t count, uint32_t chunk_size, RangeFunc fn, void* ctx)
+    {
+        if (count == 0)
+            return;
+        if (chunk_size == 0)
+            chunk_size = 1;
+
+        if (!pool || pool->m_Threads.Empty() || count <= chunk_size)
+        {
+            fn(ctx, 0, 0, count);
+            return;
+        }
+
+        Batch batch;
+        batch.m_Fn = fn;
+        batch.m_Ctx = ctx;
+        batch.m_Count = count;
+        batch.m_ChunkSize = chunk_size;
+        batch.m_NumChunks = (count + chunk_size - 1) / chunk_size;
+
+        {
+            DM_MUTEX_SCOPED_LOCK(pool->m_Mutex);
+
+            // Workers that woke up late for the previous batch must leave it before we reset the counter
+            while (pool->m_NumRunning > 0)
+            {
+                dmConditionVariable::Wait(pool->m_DoneCondition, pool->m_Mutex);
+            }
+
+            pool->m_Batch = batch;
+            dmAtomicStore32(&pool->m_NextChunk, 0);
+            pool->m_Generation++;
+            dmConditionVariable::Broadcast(pool->m_WorkCondition);
+        }
+
+        // The calling thread helps out
+        RunChunks(pool, 0, batch);
+
+        // All chunks are taken, now wait for the workers to finish theirs
+        DM_MUTEX_SCOPED_LOCK(pool->m_Mutex);
+        while (pool->m_NumRunning > 0)
+        {
+            dmConditionVariable::Wait(pool->m_DoneCondition, pool->m_Mutex);
+        }
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+namespace dmWorkerPool
+{
+    typedef struct WorkerPool* HWorkerPool;
+
+    // Called with the range [begin, end) of the items to process.
+    // The worker index is in [0, GetNumWorkers()], where 0 is the calling thread. Useful for per thread scratch memory
+    typedef void (*RangeFunc)(void* ctx, uint32_t worker_index, uint32_t begin, uint32_t end);
+
+    // A pool with 0 workers runs all work on the calling thread
+    HWorkerPool New(uint32_t num_workers);
+    void        Delete(HWorkerPool pool);
+
+    uint32_t    GetNumWorkers(HWorkerPool pool);
+
+    // Splits [0, count) into chunks of (at most) chunk_size items, and processes them on the workers
+    // as well as the calling thread. Returns when all items are processed.
+    // Must only be called from one thread at a time.
+    void        ParallelFor(HWorkerPool pool, uint32_t count, uint32_t chunk_size, RangeFunc fn, void* ctx);
+}
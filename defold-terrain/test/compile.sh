@@ -1 +1 @@
-clang++ -I../src ../src/noise.cpp test.cpp -o test
\ No newline at end of file
+clang++ -I../src ../src/noise.cpp ../src/noise_simd.cpp ../src/compress.cpp test.cpp -o test
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include <limits.h>
 #include <math.h>
 #include "noise.h"
+#include "compress.h"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
@@ -180,6 +181,114 @@ void MakeFbm(uint8_t* buffer, int size)
 }
 
 
+// Compare the batch (SIMD) fbm with the scalar version
+int TestFbmBatch(int size)
+{
+    int num_octaves = 6;
+    float frequency = 1.5f;
+    float lacunarity = 1.2f;
+    float amplitude = 0.5f;
+    float gain = 0.5f;
+
+    float* x = new float[size];
+    float* y = new float[size];
+    float* out = new float[size];
+
+    int num_errors = 0;
+    float max_diff = 0.0f;
+    for (int z = -1; z < size+1; ++z)
+    {
+        for (int i = 0; i < size; ++i)
+        {
+            x[i] = PATCH_X + (i-1) / (float)size;
+            y[i] = PATCH_Z + z / (float)size;
+        }
+
+        dmNoise::Fbm_2D_Batch(SEED, x, y, size, frequency, lacunarity, amplitude, gain, num_octaves, out);
+
+        for (int i = 0; i < size; ++i)
+        {
+            float n = dmNoise::Fbm_2D(SEED, x[i], y[i], frequency, lacunarity, amplitude, gain, num_octaves);
+            float diff = fabsf(n - out[i]);
+            if (diff > max_diff)
+                max_diff = diff;
+            if (diff > 1e-6f)
+                num_errors++;
+        }
+    }
+    printf("Fbm_2D_Batch: %d errors, max diff: %g\n", num_errors, max_diff);
+
+    delete[] x;
+    delete[] y;
+    delete[] out;
+    return num_errors;
+}
+
+enum HeightPattern
+{
+    PATTERN_FLAT_MIN,
+    PATTERN_FLAT_MAX,
+    PATTERN_CHECKER,    // Alternating 0 and 65535, the worst case for the predictor
+    PATTERN_RANDOM,
+    PATTERN_SLOPE,
+    NUM_PATTERNS,
+};
+
+static uint16_t GetPatternHeight(int pattern, uint32_t x, uint32_t z, uint32_t* rng)
+{
+    switch (pattern)
+    {
+    case PATTERN_FLAT_MIN:  return 0;
+    case PATTERN_FLAT_MAX:  return 65535;
+    case PATTERN_CHECKER:   return ((x + z) & 1) ? 65535 : 0;
+    case PATTERN_RANDOM:    *rng = *rng * 1664525u + 1013904223u; return (uint16_t)(*rng >> 16);
+    default:                return (uint16_t)(x * 97 + z * 13);
+    }
+}
+
+// Compresses and decompresses heightmaps of odd sizes, and checks that they are unchanged
+int TestCompressHeights()
+{
+    static const uint32_t sizes[][2] = { {1, 1}, {2, 1}, {1, 7}, {3, 5}, {17, 33}, {67, 67}, {131, 3} };
+
+    int num_errors = 0;
+    uint32_t rng = 1234567;
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        uint32_t width = sizes[s][0];
+        uint32_t height = sizes[s][1];
+        uint16_t* heights = new uint16_t[width * height];
+        uint16_t* decoded = new uint16_t[width * height];
+        uint32_t max_size = dmTerrain::GetMaxCompressedSize(width, height);
+        uint8_t* compressed = new uint8_t[max_size];
+
+        for (int pattern = 0; pattern < NUM_PATTERNS; ++pattern)
+        {
+            for (uint32_t z = 0; z < height; ++z)
+                for (uint32_t x = 0; x < width; ++x)
+                    heights[z * width + x] = GetPatternHeight(pattern, x, z, &rng);
+
+            uint32_t size = dmTerrain::CompressHeights(heights, width, height, compressed, max_size);
+            memset(decoded, 0xAB, width * height * sizeof(uint16_t));
+            bool ok = size != 0 && dmTerrain::DecompressHeights(compressed, size, width, height, decoded);
+            ok = ok && memcmp(heights, decoded, width * height * sizeof(uint16_t)) == 0;
+            // Truncated data must be detected, rather than read past the end
+            ok = ok && (size < 2 || !dmTerrain::DecompressHeights(compressed, size / 2, width, height, decoded));
+            if (!ok)
+            {
+                printf("CompressHeights: round trip failed for %ux%u, pattern %d (%u bytes)\n", width, height, pattern, size);
+                num_errors++;
+            }
+        }
+
+        delete[] heights;
+        delete[] decoded;
+        delete[] compressed;
+    }
+    printf("CompressHeights: %d errors\n", num_errors);
+    return num_errors;
+}
+
 int main(int argc, char const *argv[])
 {
     int size = IMG_SIZE;
@@ -203,5 +312,10 @@ int main(int argc, char const *argv[])
 
 
     delete[] noise;
+
+    if (TestFbmBatch(size+3))
+        return 1;
+    if (TestCompressHeights())
+        return 1;
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1 @@
+clang++ -I../src ../src/compress.cpp convert_heightmap.cpp -o convert_heightmap
\ No newline at end of file
@@ -0,0 +1,265 @@
+// Converts a square raw heightmap (.r16, .r32 or 8 bit) into a tiled terrain file (see src/tile_format.h)
+//
+//  convert_heightmap <input> <output.terrain> [tile_size=64] [num_levels=4] [height_scale=256]
+//
+// The tile size should match the base patch size of the terrain, so that each patch is read from a single tile.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include "tile_format.h"
+#include "compress.h"
+
+#if defined(_WIN32)
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+using namespace dmTerrain;
+
+// The input is mapped (like the raw file loader does), so that DEMs larger than the memory can be converted
+struct MappedFile
+{
+    const uint8_t*  m_Data;
+    uint64_t        m_DataSize;
+#if defined(_WIN32)
+    HANDLE          m_File;
+    HANDLE          m_Mapping;
+#else
+    int             m_File;
+#endif
+};
+
+static bool MapFile(MappedFile* file, const char* path)
+{
+    file->m_Data = 0;
+    file->m_DataSize = 0;
+#if defined(_WIN32)
+    file->m_Mapping = 0;
+    file->m_File = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file->m_File == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file->m_File, &size))
+        return false;
+    file->m_DataSize = (uint64_t)size.QuadPart;
+
+    file->m_Mapping = CreateFileMappingA(file->m_File, 0, PAGE_READONLY, 0, 0, 0);
+    if (!file->m_Mapping)
+        return false;
+    file->m_Data = (const uint8_t*)MapViewOfFile(file->m_Mapping, FILE_MAP_READ, 0, 0, 0);
+    return file->m_Data != 0;
+#else
+    file->m_File = open(path, O_RDONLY);
+    if (file->m_File < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(file->m_File, &st) != 0)
+        return false;
+    file->m_DataSize = (uint64_t)st.st_size;
+    if ((uint64_t)(size_t)file->m_DataSize != file->m_DataSize || file->m_DataSize == 0)
+        return false; // Too large for the address space, or empty
+
+    void* data = mmap(0, (size_t)file->m_DataSize, PROT_READ, MAP_SHARED, file->m_File, 0);
+    if (data == MAP_FAILED)
+        return false;
+    file->m_Data = (const uint8_t*)data;
+    return true;
+#endif
+}
+
+static void UnmapFile(MappedFile* file)
+{
+#if defined(_WIN32)
+    if (file->m_Data)
+        UnmapViewOfFile(file->m_Data);
+    if (file->m_Mapping)
+        CloseHandle(file->m_Mapping);
+    if (file->m_File != INVALID_HANDLE_VALUE)
+        CloseHandle(file->m_File);
+#else
+    if (file->m_Data)
+        munmap((void*)file->m_Data, (size_t)file->m_DataSize);
+    if (file->m_File >= 0)
+        close(file->m_File);
+#endif
+}
+
+static bool GuessFormat(const char* path, uint64_t filesize, uint32_t* bpp, uint32_t* size)
+{
+    const char* ext = strrchr(path, '.');
+    *bpp = 0;
+    if (ext && strcmp(ext, ".r16") == 0)
+        *bpp = 2;
+    else if (ext && strcmp(ext, ".r32") == 0)
+        *bpp = 4;
+
+    static const uint32_t bpps[] = {1, 2, 4};
+    for (int i = 0; i < 3; ++i)
+    {
+        uint32_t b = *bpp ? *bpp : bpps[i];
+        uint32_t s = (uint32_t)sqrt((double)(filesize / b));
+        if ((uint64_t)s * s * b == filesize)
+        {
+            *bpp = b;
+            *size = s;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint16_t ToHeight(const uint8_t* data, uint32_t bpp, uint64_t index)
+{
+    if (bpp == 1)
+        return data[index] * 257;
+    if (bpp == 2)
+    {
+        uint16_t v;
+        memcpy(&v, data + index * 2, sizeof(v));
+        return v;
+    }
+    float v;
+    memcpy(&v, data + index * 4, sizeof(v));
+    v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+    return (uint16_t)(v * 65535.0f + 0.5f);
+}
+
+static bool SeekFile(FILE* file, uint64_t offset)
+{
+#if defined(_WIN32)
+    return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static int64_t Clamp(int64_t v, int64_t max)
+{
+    return v < 0 ? 0 : (v > max ? max : v);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        printf("Usage: %s <input.r16|.r32|.raw> <output.terrain> [tile_size=64] [num_levels=4] [height_scale=256]\n", argv[0]);
+        return 1;
+    }
+
+    const char* input_path = argv[1];
+    const char* output_path = argv[2];
+    uint32_t tile_size = argc > 3 ? (uint32_t)atoi(argv[3]) : 64;
+    uint32_t num_levels = argc > 4 ? (uint32_t)atoi(argv[4]) : 4;
+    float height_scale = argc > 5 ? (float)atof(argv[5]) : 256.0f;
+    if (tile_size == 0 || num_levels == 0 || num_levels > TILE_FILE_MAX_LEVELS)
+    {
+        printf("Invalid tile size or number of levels (max %u)\n", TILE_FILE_MAX_LEVELS);
+        return 1;
+    }
+
+    // The pages are read on demand, a few tile rows at a time
+    MappedFile in;
+    if (!MapFile(&in, input_path))
+    {
+        printf("Failed to map '%s'\n", input_path);
+        UnmapFile(&in);
+        return 1;
+    }
+
+    uint32_t bpp, size;
+    if (!GuessFormat(input_path, in.m_DataSize, &bpp, &size))
+    {
+        printf("Failed to guess the image size of '%s' from the file size %llu\n", input_path, (unsigned long long)in.m_DataSize);
+        UnmapFile(&in);
+        return 1;
+    }
+
+    TileFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.m_Magic = TILE_FILE_MAGIC;
+    header.m_Version = TILE_FILE_VERSION;
+    header.m_Width = size;
+    header.m_Height = size;
+    header.m_TileSize = tile_size;
+    header.m_NumLevels = num_levels;
+    header.m_HeightScale = height_scale;
+
+    uint32_t num_entries = 0;
+    for (uint32_t level = 0; level < num_levels; ++level)
+    {
+        uint32_t tiles = (GetTileLevelSize(size, level) + tile_size - 1) / tile_size;
+        num_entries += tiles * tiles;
+    }
+    std::vector<TileFileEntry> entries(num_entries);
+    memset(&entries[0], 0, num_entries * sizeof(TileFileEntry));
+
+    FILE* out = fopen(output_path, "wb");
+    if (!out)
+    {
+        printf("Failed to open '%s' for writing\n", output_path);
+        UnmapFile(&in);
+        return 1;
+    }
+
+    // The table is written last, when the offsets are known
+    uint64_t offset = sizeof(header) + num_entries * sizeof(TileFileEntry);
+    SeekFile(out, offset);
+
+    uint32_t stored_size = GetTileStoredSize(tile_size);
+    std::vector<uint16_t> tile(stored_size * stored_size);
+    std::vector<uint8_t> compressed(GetMaxCompressedSize(stored_size, stored_size));
+
+    uint32_t entry = 0;
+    for (uint32_t level = 0; level < num_levels; ++level)
+    {
+        // Every (1 << level):th sample, the same samples as the patches of that lod use
+        int64_t level_size = GetTileLevelSize(size, level);
+        uint32_t tiles = (uint32_t)((level_size + tile_size - 1) / tile_size);
+        for (uint32_t tz = 0; tz < tiles; ++tz)
+        {
+            for (uint32_t tx = 0; tx < tiles; ++tx, ++entry)
+            {
+                for (uint32_t z = 0; z < stored_size; ++z)
+                {
+                    int64_t sz = Clamp((int64_t)tz * tile_size + z - TILE_APRON_BEFORE, level_size - 1) << level;
+                    for (uint32_t x = 0; x < stored_size; ++x)
+                    {
+                        int64_t sx = Clamp((int64_t)tx * tile_size + x - TILE_APRON_BEFORE, level_size - 1) << level;
+                        tile[z * stored_size + x] = ToHeight(in.m_Data, bpp, (uint64_t)sz * size + sx);
+                    }
+                }
+
+                uint32_t compressed_size = CompressHeights(&tile[0], stored_size, stored_size, &compressed[0], (uint32_t)compressed.size());
+                if (fwrite(&compressed[0], 1, compressed_size, out) != compressed_size)
+                {
+                    printf("Failed to write to '%s'\n", output_path);
+                    fclose(out);
+                    UnmapFile(&in);
+                    return 1;
+                }
+                entries[entry].m_Offset = offset;
+                entries[entry].m_Size = compressed_size;
+                offset += compressed_size;
+            }
+        }
+    }
+
+    SeekFile(out, 0);
+    fwrite(&header, 1, sizeof(header), out);
+    fwrite(&entries[0], sizeof(TileFileEntry), num_entries, out);
+    fclose(out);
+    UnmapFile(&in);
+
+    printf("Wrote '%s': %ux%u  tile size: %u  levels: %u  tiles: %u  size: %llu bytes (%.1f%% of the 16 bit raw size)\n",
+            output_path, size, size, tile_size, num_levels, num_entries, (unsigned long long)offset, 100.0 * offset / ((double)size * size * 2));
+    return 0;
+}